@@ -1,8 +1,11 @@
 #include "arch/amd64/mm/map.h"
 #include "sys/binfmt_elf.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/vma.h"
 #include "user/fcntl.h"
 #include "user/errno.h"
+#include "user/mman.h"
+#include "fs/ofile.h"
 #include "fs/vfs.h"
 #include "sys/assert.h"
 #include "sys/thread.h"
@@ -13,29 +16,22 @@
 #include "sys/elf.h"
 
 #define ELF_ADDR_MIN 0x400000
-
-// uintptr_t amd64_map_get(const mm_space_t space, uintptr_t vaddr, uint64_t *flags);
-// int amd64_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint32_t flags);
-
-static int elf_map_section(mm_space_t space, uintptr_t vma_dst, size_t size) {
-    uintptr_t page_aligned = vma_dst & ~0xFFF;
-    uintptr_t page_offset = vma_dst & 0xFFF;
-    size_t npages = (size + page_offset + 4095) / 4096;
-    uintptr_t page_phys;
-
-    for (size_t i = 0; i < npages; ++i) {
-        // TODO: access flags (e.g. is section writable?)
-        if ((page_phys = mm_map_get(space, page_aligned + i * MM_PAGE_SIZE, NULL)) == MM_NADDR) {
-            // Allocation needed
-            assert((page_phys = mm_phys_alloc_page(PU_PRIVATE)) != MM_NADDR,
-                    "Failed to allocate memory\n");
-            assert(mm_map_single(space, page_aligned + i * MM_PAGE_SIZE, page_phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0,
-                    "Failed to map memory\n");
-        }
-    }
-
-    return 0;
-}
+#define ELF_ADDR_MAX ((uintptr_t) AMD64_PML4I_USER_END << 39)
+// Program header table is read at once, limit its size to 64KiB
+#define ELF_PHNUM_MAX (65536 / sizeof(Elf64_Phdr))
+
+// How a page of the image is populated
+enum elf_page_kind {
+    ELF_PAGE_FILE,      // Faulted in from the file's page cache
+    ELF_PAGE_ANON,      // Zero-filled on demand or already loaded
+};
+
+struct elf_run {
+    uintptr_t start, end;
+    enum elf_page_kind kind;
+    int prot;
+    size_t offset;
+};
 
 static int elf_read(struct vfs_ioctx *ctx, struct ofile *fd, off_t pos, void *dst, size_t count) {
     off_t res;
@@ -46,55 +42,122 @@ static int elf_read(struct vfs_ioctx *ctx, struct ofile *fd, off_t pos, void *ds
     }
 
     if ((bread = vfs_read(ctx, fd, dst, count)) != (ssize_t) count) {
-        panic("TODO: properly handle this case\n");
+        return bread < 0 ? bread : -ENOEXEC;
     }
 
     return 0;
 }
 
-static int elf_load_bytes(mm_space_t space, struct vfs_ioctx *ctx, struct ofile *fd, uintptr_t vma_dst, off_t load_src, size_t size) {
-    uintptr_t page_aligned = vma_dst & ~0xFFF;
-    uintptr_t page_offset = vma_dst & 0xFFF;
-    size_t npages = (size + page_offset + 4095) / 4096;
-    uintptr_t page_phys;
-    size_t rem = size;
-    size_t off = 0;
-    char buf[4096];
+static inline int elf_prot(const Elf64_Phdr *phdr) {
+    return ((phdr->p_flags & PF_R) ? PROT_READ : 0) |
+           ((phdr->p_flags & PF_W) ? PROT_WRITE : 0) |
+           ((phdr->p_flags & PF_X) ? PROT_EXEC : 0);
+}
+
+static inline uintptr_t elf_seg_start(const Elf64_Phdr *phdr) {
+    return phdr->p_vaddr & MM_PAGE_MASK;
+}
+
+static inline uintptr_t elf_seg_end(const Elf64_Phdr *phdr) {
+    return (phdr->p_vaddr + phdr->p_memsz + MM_PAGE_SIZE - 1) & MM_PAGE_MASK;
+}
+
+// A page can only be left to the fault handler if a single segment
+// covers it and it's either all file contents or all zeros. Others
+// (the one where .bss starts, pages shared by two segments) are
+// loaded right away
+static int elf_classify(Elf64_Phdr **segs, size_t count, uintptr_t page, enum elf_page_kind *kind, int *prot, size_t *offset) {
+    Elf64_Phdr *seg = NULL;
+    size_t covering = 0;
+    uintptr_t file_end;
+
+    *prot = 0;
+    *offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (page >= elf_seg_start(segs[i]) && page < elf_seg_end(segs[i])) {
+            *prot |= elf_prot(segs[i]);
+            seg = segs[i];
+            ++covering;
+        }
+    }
+    _assert(seg);
+
+    *kind = ELF_PAGE_ANON;
+    if (covering > 1) {
+        return 1;
+    }
+
+    file_end = seg->p_vaddr + seg->p_filesz;
+    if (!seg->p_filesz || file_end <= page) {
+        return 0;
+    }
+    if (page + MM_PAGE_SIZE <= file_end || seg->p_memsz == seg->p_filesz) {
+        // Past the end of the file data is whatever the file has there
+        // if the segment ends in the same page
+        *kind = ELF_PAGE_FILE;
+        *offset = seg->p_offset - (seg->p_vaddr - page);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int elf_load_page(struct process *proc,
+                         struct vfs_ioctx *ctx,
+                         struct ofile *fd,
+                         Elf64_Phdr **segs,
+                         size_t count,
+                         uintptr_t page,
+                         int prot) {
+    uintptr_t phys, from, to;
     int res;
 
-    for (size_t i = 0; i < npages; ++i) {
-        assert((page_phys = mm_map_get(space, page_aligned + i * MM_PAGE_SIZE, NULL)), "What?");
-        size_t nbytes = MIN(rem, 4096 - page_offset);
+    if ((phys = mm_phys_alloc_zeroed_page(PU_PRIVATE)) == MM_NADDR) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        from = MAX(page, segs[i]->p_vaddr);
+        to = MIN(page + MM_PAGE_SIZE, segs[i]->p_vaddr + segs[i]->p_filesz);
 
-        if ((res = elf_read(ctx, fd, load_src + off, buf, nbytes)) != 0) {
+        if (from < to &&
+            (res = elf_read(ctx,
+                            fd,
+                            segs[i]->p_offset + (from - segs[i]->p_vaddr),
+                            (void *) MM_VIRTUALIZE(phys + from - page),
+                            to - from)) != 0) {
+            mm_phys_free_page(phys);
             return res;
         }
-
-        memcpy((void *) MM_VIRTUALIZE(page_phys + page_offset), buf, nbytes);
-        rem -= nbytes;
-        off += nbytes;
-        page_offset = 0;
     }
 
-    return 0;
+    return mm_map_single(proc->space,
+                         page,
+                         phys,
+                         MM_PAGE_USER | ((prot & PROT_WRITE) ? MM_PAGE_WRITE : 0));
 }
 
-static int elf_bzero(mm_space_t space, uintptr_t vma_dst, size_t size) {
-    uintptr_t page_aligned = vma_dst & ~0xFFF;
-    uintptr_t page_offset = vma_dst & 0xFFF;
-    size_t npages = (size + page_offset + 4095) / 4096;
-    uintptr_t page_phys;
-    size_t rem = size;
+// Undo a failed elf_load(): the pages loaded right away and the areas
+// of [start, end) only come from it
+static void elf_unload(struct process *proc, uintptr_t start, uintptr_t end) {
+    uintptr_t phys;
 
-    for (size_t i = 0; i < npages; ++i) {
-        assert((page_phys = mm_map_get(space, page_aligned + i * MM_PAGE_SIZE, NULL)), "What?");
-        size_t nbytes = MIN(rem, 4096 - page_offset);
-        memset((void *) MM_VIRTUALIZE(page_phys + page_offset), 0, nbytes);
-        rem -= nbytes;
-        page_offset = 0;
+    for (uintptr_t page = start; page < end; page += MM_PAGE_SIZE) {
+        if ((phys = mm_umap_single(proc->space, page, MM_UMAP_4K)) != MM_NADDR) {
+            _assert(!PHYS2PAGE(phys)->refcount);
+            mm_phys_free_page(phys);
+        }
     }
 
-    return 0;
+    vma_remove(&proc->vmas, start, end);
+}
+
+static int elf_add_area(struct process *proc, struct vnode *vn, const struct elf_run *run) {
+    if (run->kind == ELF_PAGE_FILE) {
+        return vma_insert(&proc->vmas, run->start, run->end, run->prot, 0, VMA_FILE, vn, run->offset);
+    } else {
+        return vma_insert(&proc->vmas, run->start, run->end, run->prot, 0, VMA_ANON, NULL, 0);
+    }
 }
 
 int binfmt_is_elf(const char *ident, size_t len) {
@@ -115,7 +178,9 @@ int elf_is_dynamic(struct vfs_ioctx *ioctx, struct ofile *fd, int *is_dynamic) {
         return res;
     }
 
-    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+        ehdr.e_phnum > ELF_PHNUM_MAX) {
         return -ENOEXEC;
     }
 
@@ -138,10 +203,18 @@ int elf_is_dynamic(struct vfs_ioctx *ioctx, struct ofile *fd, int *is_dynamic) {
 }
 
 int elf_load(struct process *proc, struct vfs_ioctx *ctx, struct ofile *fd, uintptr_t *entry) {
-    int res;
-    ssize_t bread;
+    struct vnode *vn = fd->file.vnode;
+    struct elf_run run = { 0 };
+    enum elf_page_kind kind;
+    Elf64_Phdr **segs = NULL;
     Elf64_Ehdr ehdr;
-    Elf64_Shdr *shdrs;
+    size_t seg_count = 0;
+    int loaded = 0;
+    uintptr_t page;
+    char *phdrs;
+    size_t offset;
+    int prot;
+    int res;
 
     if ((res = elf_read(ctx, fd, 0, &ehdr, sizeof(Elf64_Ehdr))) != 0) {
         kerror("elf: failed to read file header\n");
@@ -159,77 +232,113 @@ int elf_load(struct process *proc, struct vfs_ioctx *ctx, struct ofile *fd, uint
         return -EINVAL;
     }
 
-    shdrs = kmalloc(ehdr.e_shentsize * ehdr.e_shnum);
-    _assert(shdrs);
+    if (ehdr.e_phentsize != sizeof(Elf64_Phdr) || !ehdr.e_phnum || ehdr.e_phnum > ELF_PHNUM_MAX) {
+        kerror("elf: bad program header table\n");
+        return -ENOEXEC;
+    }
 
-    // Read all section headers
-    if ((res = elf_read(ctx, fd, ehdr.e_shoff, shdrs, ehdr.e_shentsize * ehdr.e_shnum)) != 0) {
-        kerror("elf: failed to read section headers\n");
+    phdrs = kmalloc(ehdr.e_phentsize * ehdr.e_phnum);
+    segs = kmalloc(sizeof(Elf64_Phdr *) * ehdr.e_phnum);
+    if (!phdrs || !segs) {
+        res = -ENOMEM;
+        goto end;
+    }
+
+    // Read all program headers
+    if ((res = elf_read(ctx, fd, ehdr.e_phoff, phdrs, ehdr.e_phentsize * ehdr.e_phnum)) != 0) {
+        kerror("elf: failed to read program headers\n");
         goto end;
     }
 
     proc->image_end = 0;
     proc->brk = 0;
-    //const char *shstrtabd = (const char *) (shdrs[ehdr->e_shstrndx].sh_offset + (uintptr_t) from);
-
-    // Load the sections
-    for (size_t i = 0; i < ehdr.e_shnum; ++i) {
-        Elf64_Shdr *shdr = &shdrs[i];
-        //const char *name = &shstrtabd[shdr->sh_name];
-
-        if (shdr->sh_flags & SHF_ALLOC) {
-            //if (!strncmp(name, ".note", 5)) {
-            //    // Fuck you, gcc
-            //    continue;
-            //}
-            //if (!strncmp(name, ".gnu", 4)) {
-            //    // Fuck you, gcc
-            //    continue;
-            //}
-
-            //kdebug("Loading %s\n", name);
-
-            // If the section is below what is allowed
-            if (shdr->sh_addr < ELF_ADDR_MIN) {
-                kerror("elf: section address is below allowed\n");
-                res = -EINVAL;
-                goto end;
+    seg_count = 0;
+
+    for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+        Elf64_Phdr *phdr = (Elf64_Phdr *) &phdrs[i * ehdr.e_phentsize];
+
+        if (phdr->p_type != PT_LOAD || !phdr->p_memsz) {
+            continue;
+        }
+
+        if (phdr->p_vaddr < ELF_ADDR_MIN ||
+            phdr->p_vaddr + phdr->p_memsz > ELF_ADDR_MAX ||
+            phdr->p_vaddr + phdr->p_memsz < phdr->p_vaddr) {
+            kerror("elf: segment address is out of allowed range\n");
+            res = -EINVAL;
+            goto end;
+        }
+
+        // Pages are mapped straight from the file, so segment contents
+        // must have the same offset within a page in memory and in the file
+        if (phdr->p_filesz > phdr->p_memsz ||
+            ((phdr->p_vaddr - phdr->p_offset) & MM_PAGE_OFFSET_MASK) ||
+            (seg_count && phdr->p_vaddr < segs[seg_count - 1]->p_vaddr)) {
+            kerror("elf: bad segment layout\n");
+            res = -ENOEXEC;
+            goto end;
+        }
+
+        segs[seg_count++] = phdr;
+
+        if (phdr->p_vaddr + phdr->p_memsz > proc->image_end) {
+            proc->image_end = phdr->p_vaddr + phdr->p_memsz;
+        }
+    }
+
+    // Group the pages of the image into areas, consecutive pages with the
+    // same protection and backing end up in the same one
+    page = 0;
+    loaded = seg_count != 0;
+    for (size_t i = 0; i < seg_count; ++i) {
+        uintptr_t end = elf_seg_end(segs[i]);
+
+        page = MAX(page, elf_seg_start(segs[i]));
+
+        for (; page < end; page += MM_PAGE_SIZE) {
+            if (elf_classify(segs, seg_count, page, &kind, &prot, &offset)) {
+                if ((res = elf_load_page(proc, ctx, fd, segs, seg_count, page, prot)) != 0) {
+                    goto end;
+                }
             }
 
-            // Map the pages of this section
-            _assert(elf_map_section(proc->space, shdr->sh_addr, shdr->sh_size) == 0);
-
-            switch (shdr->sh_type) {
-            case SHT_PROGBITS:
-                _assert(elf_load_bytes(proc->space,
-                                       ctx,
-                                       fd,
-                                       shdr->sh_addr,
-                                       shdr->sh_offset,
-                                       shdr->sh_size) == 0);
-                break;
-            case SHT_NOBITS:
-                _assert(elf_bzero(proc->space,
-                                  shdr->sh_addr,
-                                  shdr->sh_size) == 0);
-                break;
+            if (run.end == page &&
+                run.kind == kind &&
+                run.prot == prot &&
+                (kind != ELF_PAGE_FILE || run.offset + (page - run.start) == offset)) {
+                run.end += MM_PAGE_SIZE;
+                continue;
             }
 
-            uintptr_t section_end = shdr->sh_addr + shdr->sh_size;
-            if (section_end > proc->image_end) {
-                proc->image_end = section_end;
+            if (run.end && (res = elf_add_area(proc, vn, &run)) != 0) {
+                goto end;
             }
+
+            run.start = page;
+            run.end = page + MM_PAGE_SIZE;
+            run.kind = kind;
+            run.prot = prot;
+            run.offset = offset;
         }
     }
 
+    if (run.end && (res = elf_add_area(proc, vn, &run)) != 0) {
+        goto end;
+    }
+
     proc->brk = (proc->image_end + MM_PAGE_SIZE - 1) & ~MM_PAGE_OFFSET_MASK;
 
     *entry = ehdr.e_entry;
     res = 0;
 
 end:
+    if (res != 0 && loaded) {
+        elf_unload(proc, elf_seg_start(segs[0]), (proc->image_end + MM_PAGE_SIZE - 1) & MM_PAGE_MASK);
+    }
+
     // Free all the stuff we've allocated
-    kfree(shdrs);
+    kfree(segs);
+    kfree(phdrs);
 
     return res;
 }
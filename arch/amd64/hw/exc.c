@@ -3,8 +3,13 @@
 #include "arch/amd64/smp/smp.h"
 #endif
 #include "arch/amd64/cpu.h"
+#include "fs/pcache.h"
+#include "sys/mem/fault.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
+#include "sys/mem/vma.h"
 #include "sys/thread.h"
+#include "user/mman.h"
 #include "sys/string.h"
 #include "sys/types.h"
 #include "sys/sched.h"
@@ -49,59 +54,248 @@ struct amd64_exception_frame {
     uint64_t rip, cs, rflags, rsp, ss;
 };
 
+// Copy-on-write pages broken on a write fault along with the faulting one,
+// a naturally aligned window around it: writes after fork() tend to be
+// clustered, so most of these would fault right afterwards anyway
+#define PF_COW_AROUND_PAGES     8
+
+// Make a copy-on-write page writable, giving the space its own copy of
+// the frame unless nobody else refers to it anymore
+// Returns 1 if the frame was copied, 0 if it's now owned by the space,
+// -1 if there's no memory for a copy
+static int pfault_cow_break(mm_space_t space, uintptr_t virt, uintptr_t phys) {
+    struct page *page = PHYS2PAGE(phys);
+    uintptr_t new_phys;
+
+    if (page->refcount == 1) {
+        // Only one referring to the frame now, claim ownership
+        _assert(mm_umap_single(space, virt, MM_UMAP_4K) == phys);
+        _assert(mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
+        return 0;
+    }
+
+    // The frame may be shared by any number of spaces (children of
+    // children of the process which wrote it), each of them gets a copy
+    if ((new_phys = mm_phys_alloc_page(PU_PRIVATE)) == MM_NADDR) {
+        return -1;
+    }
+    PHYS2PAGE(new_phys)->flags |= page->flags & PG_MMAPED;
+
+    memcpy((void *) MM_VIRTUALIZE(new_phys), (const void *) MM_VIRTUALIZE(phys), MM_PAGE_SIZE);
+    _assert(mm_umap_single(space, virt, MM_UMAP_4K) == phys);
+    _assert(mm_map_single(space, virt, new_phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
+    return 1;
+}
+
+// Break the copy-on-write pages of the window around virt (except virt
+// itself) which are still in the area
+static void pfault_cow_around(mm_space_t space,
+                              const struct vm_area *area,
+                              uintptr_t virt,
+                              uintptr_t *copy_start,
+                              uintptr_t *copy_end) {
+    uintptr_t start = virt & ~(PF_COW_AROUND_PAGES * MM_PAGE_SIZE - 1);
+    uintptr_t end = start + PF_COW_AROUND_PAGES * MM_PAGE_SIZE;
+
+    if (area->flags & VMA_SHARED) {
+        return;
+    }
+    start = MAX(start, area->start);
+    end = MIN(end, area->end);
+
+    for (uintptr_t addr = start; addr < end; addr += MM_PAGE_SIZE) {
+        uint64_t flags;
+        uintptr_t phys;
+        struct page *page;
+        int res;
+
+        if (addr == virt) {
+            continue;
+        }
+
+        // Demand-paged ones are left to vm_fault()
+        phys = mm_map_get(space, addr, &flags);
+        if (phys == MM_NADDR ||
+            phys == mm_zero_page ||
+            !(flags & MM_PAGE_USER) ||
+            (flags & MM_PAGE_WRITE)) {
+            continue;
+        }
+        if (!(page = PHYS2PAGE(phys)) || page->usage != PU_PRIVATE) {
+            continue;
+        }
+
+        if ((res = pfault_cow_break(space, addr, phys)) < 0) {
+            // Low on memory, only the faulting page is needed
+            break;
+        }
+        if (res) {
+            *copy_start = MIN(*copy_start, addr);
+            *copy_end = MAX(*copy_end, addr + MM_PAGE_SIZE);
+        }
+    }
+}
+
+// Userspace part of the fault, called with the space lock held, so the
+// page tables and areas of the process can't change meanwhile
+static int pfault_user(struct amd64_exception_frame *frame, struct process *proc, mm_space_t space, uintptr_t cr2) {
+    uint64_t flags;
+    uintptr_t phys = mm_map_get(space, cr2 & MM_PAGE_MASK, &flags);
+    struct page *pg = phys == MM_NADDR ? NULL : PHYS2PAGE(phys);
+
+    if (phys != MM_NADDR && (flags & MM_PAGE_USER)) {
+        if ((frame->exc_code & X86_PF_WRITE) && (flags & MM_PAGE_WRITE)) {
+            // Write access has been granted by another thread since
+            // the faulting CPU cached the page as read-only
+            return 0;
+        }
+        if (!(frame->exc_code & (X86_PF_WRITE | X86_PF_PRESENT))) {
+            // Another thread has mapped the page since
+            return 0;
+        }
+    }
+
+    if (phys == MM_NADDR || phys == mm_zero_page || (pg && pg->usage == PU_CACHE)) {
+        // Page of a demand-paged area is accessed for the first time,
+        // or the zero page or a page of a file is written to
+        return vm_fault(proc, cr2, (frame->exc_code & X86_PF_WRITE) ? VM_FAULT_WRITE : 0);
+    }
+
+    struct vm_area *area = NULL;
+    if (frame->exc_code & X86_PF_WRITE) {
+        // Pages of read-only areas are never copied-on-write
+        area = vma_lookup(&proc->vmas, cr2);
+        if (!area || !(area->prot & PROT_WRITE)) {
+            return -1;
+        }
+    }
+
+    if (phys != MM_NADDR) {
+        // If the exception was caused by write operation
+        if ((frame->exc_code & X86_PF_WRITE) &&             // Error was caused by write
+            (flags & MM_PAGE_USER) &&                       // Page is user-accessible
+            (!(flags & MM_PAGE_WRITE)) &&                   // Page is not writable
+            (flags & MM_PAGE_HUGE)) {                       // 2MiB page
+            uintptr_t virt = cr2 & ~MM_PAGE_L2_OFFSET_MASK;
+            phys &= ~MM_PAGE_L2_OFFSET_MASK;
+            struct page *page = PHYS2PAGE(phys);
+            _assert(page);
+            _assert(page->refcount);
+
+            if (page->usage != PU_PRIVATE) {
+                panic("Write to non-CoW page triggered a page fault\n");
+            }
+
+            if (page->refcount == 1) {
+                // Only one referring to the frame now, claim ownership
+                _assert(mm_umap_single(space, virt, MM_UMAP_2M) == phys);
+                _assert(mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE | MM_PAGE_HUGE) == 0);
+                return 0;
+            }
+
+            uintptr_t new_phys = mm_phys_alloc_huge_page(PU_PRIVATE);
+            if (new_phys == MM_NADDR) {
+                // No contiguous memory for a copy, fall back to private
+                // 4KiB copies and let the write fault again on them
+                if (mm_map_split(space, virt) != 0) {
+                    return -1;
+                }
+                tlb_shootdown(proc, virt, virt + MM_HUGE_PAGE_SIZE);
+                return 0;
+            }
+            PHYS2PAGE(new_phys)->flags |= page->flags & PG_MMAPED;
+
+            memcpy((void *) MM_VIRTUALIZE(new_phys), (const void *) MM_VIRTUALIZE(phys), MM_HUGE_PAGE_SIZE);
+            _assert(mm_umap_single(space, virt, MM_UMAP_2M) == phys);
+            _assert(mm_map_single(space, virt, new_phys, MM_PAGE_USER | MM_PAGE_WRITE | MM_PAGE_HUGE) == 0);
+            // Other threads must stop using the shared frame
+            tlb_shootdown(proc, virt, virt + MM_HUGE_PAGE_SIZE);
+
+            return 0;
+        }
+
+        if ((frame->exc_code & X86_PF_WRITE) &&             // Error was caused by write
+            (flags & MM_PAGE_USER) &&                       // Page is user-accessible
+            (!(flags & MM_PAGE_WRITE))) {                   // Page is not writable
+            struct page *page = PHYS2PAGE(phys);
+            _assert(page);
+            _assert(page->refcount);
+
+            if (page->usage != PU_PRIVATE) {
+                panic("Write to non-CoW page triggered a page fault\n");
+            }
+
+            uintptr_t virt = cr2 & MM_PAGE_MASK;
+            uintptr_t copy_start = (uintptr_t) -1, copy_end = 0;
+            int res = pfault_cow_break(space, virt, phys);
+
+            if (res < 0) {
+                // No memory for a copy
+                return -1;
+            }
+            if (res) {
+                copy_start = virt;
+                copy_end = virt + MM_PAGE_SIZE;
+            }
+            pfault_cow_around(space, area, virt, &copy_start, &copy_end);
+
+            // Other threads must stop using the shared frames, a page
+            // which was only made writable can stay cached read-only
+            if (copy_start < copy_end) {
+                tlb_shootdown(proc, copy_start, copy_end);
+            }
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 int do_pfault(struct amd64_exception_frame *frame, uintptr_t cr2, uintptr_t cr3) {
-    mm_space_t space = (mm_space_t) MM_VIRTUALIZE(cr3);
+    mm_space_t space = (mm_space_t) MM_VIRTUALIZE(cr3 & MM_PAGE_MASK);
 
     if (!cr2) {
         // Don't even try to resolve NULL references
         return -1;
     }
 
-    if (cr2 < KERNEL_VIRT_BASE) {
-        // TODO: was that user CS check necessary?
-
-        // Userspace fault
-        uint64_t flags;
-        uintptr_t phys = mm_map_get(space, cr2 & MM_PAGE_MASK, &flags);
+    if (cr2 < USER_VIRT_END) {
         struct thread *thr = thread_self;
         _assert(thr);
         struct process *proc = thr->proc;
         _assert(proc);
+        uintptr_t page = MM_NADDR;
+        uintptr_t irq;
+        int res;
 
-        if (phys != MM_NADDR) {
-            // If the exception was caused by write operation
-            if ((frame->exc_no & X86_PF_WRITE) &&               // Error was caused by write
-                (flags & MM_PAGE_USER) &&                       // Page is user-accessible
-                (!(flags & MM_PAGE_WRITE))) {                   // Page is not writable
-                struct page *page = PHYS2PAGE(phys);
-                _assert(page);
-                _assert(page->refcount);
-
-                if (page->usage != PU_PRIVATE) {
-                    panic("Write to non-CoW page triggered a page fault\n");
-                }
+        while (1) {
+            tlb_space_lock(proc, &irq);
+            res = pfault_user(frame, proc, space, cr2);
+            tlb_space_unlock(proc, &irq);
 
-                if (page->refcount == 2) {
-                    //kdebug("[%d] Cloning page @ %p\n", proc->pid, cr2 & MM_PAGE_MASK);
-                    uintptr_t new_phys = mm_phys_alloc_page(PU_PRIVATE);
-                    _assert(new_phys != MM_NADDR);
-                    memcpy((void *) MM_VIRTUALIZE(new_phys), (const void *) MM_VIRTUALIZE(phys), MM_PAGE_SIZE);
-                    _assert(mm_umap_single(space, cr2 & MM_PAGE_MASK, 1) == phys);
-                    _assert(mm_map_single(space, cr2 & MM_PAGE_MASK, new_phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
-                } else if (page->refcount == 1) {
-                    //kdebug("[%d] Only one referring to %p now, claiming ownership\n", proc->pid, cr2 & MM_PAGE_MASK);
-                    _assert(mm_umap_single(space, cr2 & MM_PAGE_MASK, 1) == phys);
-                    _assert(mm_map_single(space, cr2 & MM_PAGE_MASK, phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
-                } else {
-                    //kdebug("Page refcount == %d\n", page->refcount);
-                    panic("???\n");
-                }
+            if (res != VM_FAULT_MISS) {
+                break;
+            }
 
-                return 0;
+            // Files are read unlocked and the fault is retried, as the
+            // mapping may change meanwhile. The reference keeps the page
+            // cached until then
+            if (page != MM_NADDR) {
+                pcache_put(page);
+                page = MM_NADDR;
+            }
+            if (vm_fault_fill(proc, cr2, &page) != 0) {
+                page = MM_NADDR;
+                res = -1;
+                break;
             }
         }
 
-        return -1;
+        if (page != MM_NADDR) {
+            pcache_put(page);
+        }
+        return res;
     } else {
         // Kernel page faults are not resolvable
         return -1;
@@ -120,20 +314,22 @@ static void exc_dump(int level, struct amd64_exception_frame *frame) {
         asm volatile ("movq %%cr3, %0":"=r"(cr3));
         debugf(level, "Page fault without resolution:\n");
         debugf(level, "%%cr3 = %p\n", cr3);
-        if (MM_VIRTUALIZE(cr3) == (uintptr_t) mm_kernel) {
+        if (MM_VIRTUALIZE(cr3 & MM_PAGE_MASK) == (uintptr_t) mm_kernel) {
             debugf(level, "(Kernel)\n");
         }
         debugf(level, "Fault address: %p\n", cr2);
 
-        uintptr_t phys = mm_map_get((mm_space_t) MM_VIRTUALIZE(cr3), cr2 & MM_PAGE_MASK, NULL);
+        uintptr_t phys = mm_map_get((mm_space_t) MM_VIRTUALIZE(cr3 & MM_PAGE_MASK), cr2 & MM_PAGE_MASK, NULL);
         if (phys == MM_NADDR) {
             debugf(level, "Has no physical address (non-present?)\n");
         } else {
             debugf(level, "Refers to phys %p\n", phys);
 
             struct page *page = PHYS2PAGE(phys);
-            kdebug("  Refcount: %u\n", page->refcount);
-            kdebug("  Usage: %u\n", page->usage);
+            if (page) {
+                kdebug("  Refcount: %u\n", page->refcount);
+                kdebug("  Usage: %u\n", page->usage);
+            }
         }
 
         if (frame->exc_code & X86_PF_RESVD) {
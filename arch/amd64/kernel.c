@@ -6,6 +6,7 @@
 #include "arch/amd64/smp/smp.h"
 #include "arch/amd64/hw/acpi.h"
 #include "arch/amd64/mm/phys.h"
+#include "arch/amd64/mm/numa.h"
 #include "arch/amd64/hw/gdt.h"
 #include "arch/amd64/hw/con.h"
 #include "arch/amd64/hw/idt.h"
@@ -245,6 +246,7 @@ void kernel_early_init(uint64_t entry_method) {
     //}
 
     amd64_apic_init();
+    amd64_numa_init();
     rtc_init();
     // Setup system time
     struct tm t;
@@ -262,6 +264,7 @@ void kernel_early_init(uint64_t entry_method) {
     amd64_make_random_seed();
 
     amd64_fpu_init();
+    amd64_tlb_init();
 
 #if defined(AMD64_SMP)
     amd64_smp_init();
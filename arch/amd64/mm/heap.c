@@ -1,26 +1,102 @@
 #include "arch/amd64/mm/heap.h"
+#include "arch/amd64/mm/pool.h"
+#include "arch/amd64/mm/map.h"
+#include "sys/mem/reclaim.h"
+#include "sys/mem/profile.h"
+#include "arch/amd64/cpu.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
 #include "sys/string.h"
 #include "sys/assert.h"
+#include "sys/sched.h"
 #include "sys/panic.h"
 #include "sys/debug.h"
 #include "sys/spin.h"
 #include "sys/mm.h"
 
-#define HEAP_MAGIC 0x1BAD83A0
-
+#define HEAP_MAGIC          0x1BAD83A0
+#define HEAP_EXTENT_MAGIC   0x7E47E470
+// Low bits of the magic
+#define HEAP_USED           (1 << 0)
+// Block is used from the heap's point of view, but is actually
+// sitting in a per-CPU cache
+#define HEAP_CACHED         (1 << 1)
+
+// Smallest payload, free blocks keep their bin links there
+#define HEAP_MIN_SIZE       16
+// Sizes up to HEAP_EXACT_MAX have a bin of their own, larger ones
+// are binned by power of two
+#define HEAP_EXACT_MAX      512
+#define HEAP_EXACT_BINS     (HEAP_EXACT_MAX / 16)
+#define HEAP_BIN_COUNT      (HEAP_EXACT_BINS + 32 - 9)
+
+// Per-CPU caches hold freed blocks of exact size classes, once a
+// cache grows above HEAP_PCP_HIGH blocks, HEAP_PCP_BATCH of them are
+// returned to the heap
+#define HEAP_PCP_HIGH       32
+#define HEAP_PCP_BATCH      16
+
+// Heap grows by at least this many pages at once
+#define HEAP_EXTENT_PAGES   64
+// Block size has to fit in 32 bits
+#define HEAP_MAX_ALLOC      (1UL << 30)
+// Free memory the heap keeps for itself when asked to shrink
+#define HEAP_KEEP_FREE      (4 * HEAP_EXTENT_PAGES * MM_PAGE_SIZE)
+
+// Header is 32 bytes so that all the payloads are 16-byte aligned
 typedef struct heap_block {
     uint32_t magic;
     uint32_t size;
     struct heap_block *prev, *next;
-} heap_block_t;
+} __attribute__((aligned(16))) heap_block_t;
+
+// Heap memory consists of virtually contiguous extents, each one
+// starts with this header followed by a list of blocks. Blocks never
+// cross extent boundaries
+struct heap_extent {
+    uint32_t magic;
+    uint32_t pages;
+    struct heap_extent *prev, *next;
+} __attribute__((aligned(16)));
+
+#define heap_extent_first(ext) \
+    ((heap_block_t *) &((struct heap_extent *) (ext))[1])
+#define heap_extent_size(pages) \
+    ((size_t) (pages) * MM_PAGE_SIZE - sizeof(struct heap_extent) - sizeof(heap_block_t))
+
+// Free blocks are linked into bins through their payload
+struct heap_bin_link {
+    heap_block_t *prev, *next;
+};
+#define heap_bin_link(block) \
+    ((struct heap_bin_link *) &((heap_block_t *) (block))[1])
+// Cached blocks are linked through the first payload word
+#define heap_pcp_next(block) \
+    (*(heap_block_t **) &((heap_block_t *) (block))[1])
 
 static struct kernel_heap {
-    uintptr_t phys_base;
+    // Reserved virtual range, extents are placed at `top'
+    uintptr_t base, end, top;
+    // Mapped size
     size_t limit;
+    size_t free_size;
+    struct heap_extent *extents;
+    // Free blocks by size, bit N of bin_map is set if
+    // bins[N] is not empty
+    heap_block_t *bins[HEAP_BIN_COUNT];
+    uint64_t bin_map;
 } amd64_global_heap;
 heap_t *heap_global = &amd64_global_heap;
 
+static struct heap_pcp {
+    spin_t lock;
+    heap_block_t *head[HEAP_EXACT_BINS];
+    uint32_t count[HEAP_EXACT_BINS];
+} heap_pcp[AMD64_MAX_SMP];
+
 static spin_t heap_lock = 0;
+// Serializes changes to heap mappings
+static spin_t heap_map_lock = 0;
 
 #if defined(HEAP_TRACE)
 void heap_trace(int type, const char *file, const char *func, int line, void *ptr, size_t count) {
@@ -38,96 +114,513 @@ void heap_trace(int type, const char *file, const char *func, int line, void *pt
 }
 #endif
 
-void heap_stat(heap_t *heap, struct heap_stat *st) {
-    uintptr_t irq;
-    spin_lock_irqsave(&heap_lock, &irq);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
+#if defined(HEAP_DEBUG)
+// Walk the whole block list and check its consistency.
+// Requires heap_lock to be held
+static void heap_check(heap_t *heap) {
+    for (struct heap_extent *ext = heap->extents; ext; ext = ext->next) {
+        heap_block_t *begin = heap_extent_first(ext);
+        heap_block_t *prev = NULL;
 
-    st->alloc_count = 0;
-    st->alloc_size = 0;
-    st->free_size = 0;
-    st->total_size = heap->limit;
+        if (ext->magic != HEAP_EXTENT_MAGIC) {
+            panic("Heap is broken: extent %p magic %08x\n", ext, ext->magic);
+        }
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Broken heap");
+        for (heap_block_t *block = begin; block; block = block->next) {
+            if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
+                panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
+            }
+            if (block->prev != prev) {
+                panic("Heap is broken: %p has invalid prev link %p (expected %p)\n", block, block->prev, prev);
+            }
+            if (prev && !(prev->magic & HEAP_USED) && !(block->magic & HEAP_USED)) {
+                panic("Heap is broken: adjacent free blocks %p, %p\n", prev, block);
+            }
+            if ((uintptr_t) block + sizeof(heap_block_t) + block->size > (uintptr_t) ext + ext->pages * MM_PAGE_SIZE) {
+                panic("Heap is broken: %p crosses extent %p boundary\n", block, ext);
+            }
+            prev = block;
         }
-        if (block->magic & 1) {
-            ++st->alloc_count;
-            st->alloc_size += block->size;
-        } else {
-            st->free_size += block->size;
+    }
+}
+#endif
+
+////
+
+static inline size_t heap_bin_index(size_t size) {
+    if (size < HEAP_EXACT_MAX + 16) {
+        return size / 16 - 1;
+    }
+    return HEAP_EXACT_BINS + (63 - __builtin_clzll(size)) - 9;
+}
+
+static void heap_bin_insert(heap_t *heap, heap_block_t *block) {
+    size_t index = heap_bin_index(block->size);
+    struct heap_bin_link *link = heap_bin_link(block);
+
+    link->prev = NULL;
+    link->next = heap->bins[index];
+    if (link->next) {
+        heap_bin_link(link->next)->prev = block;
+    }
+    heap->bins[index] = block;
+    heap->bin_map |= 1ULL << index;
+    heap->free_size += block->size;
+}
+
+static void heap_bin_remove(heap_t *heap, heap_block_t *block) {
+    size_t index = heap_bin_index(block->size);
+    struct heap_bin_link *link = heap_bin_link(block);
+
+    if (link->prev) {
+        heap_bin_link(link->prev)->next = link->next;
+    } else {
+        heap->bins[index] = link->next;
+        if (!link->next) {
+            heap->bin_map &= ~(1ULL << index);
+        }
+    }
+    if (link->next) {
+        heap_bin_link(link->next)->prev = link->prev;
+    }
+    heap->free_size -= block->size;
+}
+
+// Find a free block of at least `count' bytes and take it out of its bin
+static heap_block_t *heap_bin_take(heap_t *heap, size_t count) {
+    size_t index = heap_bin_index(count);
+    heap_block_t *block;
+    uint64_t map;
+
+    if (index >= HEAP_EXACT_BINS) {
+        // Power-of-two bins may contain blocks smaller than requested
+        for (block = heap->bins[index]; block; block = heap_bin_link(block)->next) {
+            if (block->size >= count) {
+                heap_bin_remove(heap, block);
+                return block;
+            }
+        }
+        ++index;
+    }
+
+    // Any block from larger bins fits
+    if (index >= HEAP_BIN_COUNT || !(map = heap->bin_map & (~0ULL << index))) {
+        return NULL;
+    }
+
+    block = heap->bins[__builtin_ctzll(map)];
+    heap_bin_remove(heap, block);
+    return block;
+}
+
+// Mark the block free, merge it with free neighbours and put into a bin.
+// Requires heap_lock to be held
+static void heap_block_release(heap_t *heap, heap_block_t *block) {
+    heap_block_t *prev = block->prev;
+    heap_block_t *next = block->next;
+
+    block->magic = HEAP_MAGIC;
+
+    if (prev && !(prev->magic & HEAP_USED)) {
+        heap_bin_remove(heap, prev);
+        prev->next = next;
+        if (next) {
+            next->prev = prev;
+        }
+        prev->size += sizeof(heap_block_t) + block->size;
+        block->magic = 0;
+        block = prev;
+    }
+
+    if (next && !(next->magic & HEAP_USED)) {
+        heap_bin_remove(heap, next);
+        block->next = next->next;
+        if (next->next) {
+            next->next->prev = block;
         }
+        next->magic = 0;
+        block->size += sizeof(heap_block_t) + next->size;
+    }
+
+    heap_bin_insert(heap, block);
+}
+
+//// Per-CPU caches
+
+static inline int heap_pcp_ready(void) {
+    // Same as for physical page caches: CPU data is only
+    // available once the scheduler is ready
+    return sched_ready;
+}
+
+static void *heap_pcp_alloc(size_t count) {
+    struct heap_pcp *pcp = &heap_pcp[get_cpu()->processor_id];
+    size_t index = heap_bin_index(count);
+    heap_block_t *block;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&pcp->lock, &irq);
+
+    if (!(block = pcp->head[index])) {
+        spin_release_irqrestore(&pcp->lock, &irq);
+        return NULL;
+    }
+    pcp->head[index] = heap_pcp_next(block);
+    --pcp->count[index];
+
+    spin_release_irqrestore(&pcp->lock, &irq);
+
+    _assert(block->magic == (HEAP_MAGIC | HEAP_USED | HEAP_CACHED));
+    block->magic &= ~HEAP_CACHED;
+
+    return &block[1];
+}
+
+// Return up to `count' blocks of size class `index' to the heap
+// Requires pcp->lock to be held
+static void heap_pcp_drain(heap_t *heap, struct heap_pcp *pcp, size_t index, size_t count) {
+    heap_block_t *block;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&heap_lock, &irq);
+    while (count-- && (block = pcp->head[index]) != NULL) {
+        pcp->head[index] = heap_pcp_next(block);
+        --pcp->count[index];
+
+        heap_block_release(heap, block);
     }
     spin_release_irqrestore(&heap_lock, &irq);
 }
 
-void amd64_heap_init(heap_t *heap, uintptr_t phys_base, size_t sz) {
-    heap->phys_base = phys_base;
-    heap->limit = sz;
+static void heap_pcp_free(heap_t *heap, heap_block_t *block) {
+    struct heap_pcp *pcp = &heap_pcp[get_cpu()->processor_id];
+    size_t index = heap_bin_index(block->size);
+    uintptr_t irq;
+
+    block->magic |= HEAP_CACHED;
+
+    spin_lock_irqsave(&pcp->lock, &irq);
+
+    heap_pcp_next(block) = pcp->head[index];
+    pcp->head[index] = block;
+    if (++pcp->count[index] > HEAP_PCP_HIGH) {
+        heap_pcp_drain(heap, pcp, index, HEAP_PCP_BATCH);
+    }
+
+    spin_release_irqrestore(&pcp->lock, &irq);
+}
 
-    // Create a single whole-heap block
-    heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
+static void heap_pcp_drain_all(heap_t *heap) {
+    uintptr_t irq;
+
+    for (size_t cpu = 0; cpu < AMD64_MAX_SMP; ++cpu) {
+        struct heap_pcp *pcp = &heap_pcp[cpu];
 
-    uint32_t s = 13;
-    for (size_t i = 0; i < sz; ++i) {
-        s ^= s << 13;
-        s ^= s >> 17;
-        s ^= s << 5;
-        ((uint8_t *) block)[i] = s;
+        spin_lock_irqsave(&pcp->lock, &irq);
+        for (size_t i = 0; i < HEAP_EXACT_BINS; ++i) {
+            heap_pcp_drain(heap, pcp, i, pcp->count[i]);
+        }
+        spin_release_irqrestore(&pcp->lock, &irq);
     }
+}
+
+////
+
+//// Growing and shrinking
+
+// Map a new extent of at least `count' bytes of payload and add it to the heap
+static int heap_grow(heap_t *heap, size_t count) {
+    size_t pages = (count + sizeof(struct heap_extent) + sizeof(heap_block_t) + MM_PAGE_SIZE - 1) / MM_PAGE_SIZE;
+    struct heap_extent *ext;
+    heap_block_t *block;
+    uintptr_t irq, phys;
+    size_t i;
+
+    if (pages < HEAP_EXTENT_PAGES) {
+        pages = HEAP_EXTENT_PAGES;
+    }
+
+    // Page allocation may reclaim memory, which frees heap blocks,
+    // so heap_lock must not be held here
+    spin_lock_irqsave(&heap_map_lock, &irq);
+
+    // Virtual addresses are never reused: a released extent may
+    // still be present in other CPUs' TLBs
+    if (heap->top + pages * MM_PAGE_SIZE > heap->end) {
+        spin_release_irqrestore(&heap_map_lock, &irq);
+        kwarn("Kernel heap virtual range exhausted\n");
+        return -1;
+    }
+    ext = (struct heap_extent *) heap->top;
+
+    for (i = 0; i < pages; ++i) {
+        if ((phys = mm_phys_alloc_page(PU_KERNEL)) == MM_NADDR) {
+            break;
+        }
+        _assert(mm_map_single(mm_kernel, (uintptr_t) ext + i * MM_PAGE_SIZE, phys, MM_PAGE_WRITE) == 0);
+    }
+
+    if (i != pages) {
+        while (i--) {
+            phys = mm_umap_single(mm_kernel, (uintptr_t) ext + i * MM_PAGE_SIZE, 1);
+            _assert(phys != MM_NADDR);
+            mm_phys_free_page(phys);
+        }
+        spin_release_irqrestore(&heap_map_lock, &irq);
+        return -1;
+    }
+
+    heap->top += pages * MM_PAGE_SIZE;
+    spin_release_irqrestore(&heap_map_lock, &irq);
+
+    ext->magic = HEAP_EXTENT_MAGIC;
+    ext->pages = pages;
+    ext->prev = NULL;
 
+    block = heap_extent_first(ext);
     block->magic = HEAP_MAGIC;
-    block->next = NULL;
     block->prev = NULL;
-    block->size = sz - sizeof(heap_block_t);
+    block->next = NULL;
+    block->size = heap_extent_size(pages);
+
+    spin_lock_irqsave(&heap_lock, &irq);
+    ext->next = heap->extents;
+    if (ext->next) {
+        ext->next->prev = ext;
+    }
+    heap->extents = ext;
+    heap->limit += pages * MM_PAGE_SIZE;
+    heap_bin_insert(heap, block);
+    spin_release_irqrestore(&heap_lock, &irq);
+
+    return 0;
 }
 
-// Heap interface implementation
-void *heap_alloc(heap_t *heap, size_t count) {
+static inline int heap_extent_free(struct heap_extent *ext) {
+    heap_block_t *block = heap_extent_first(ext);
+    return !(block->magic & HEAP_USED) && !block->next;
+}
+
+static size_t heap_shrink_count(struct shrinker *s) {
+    heap_t *heap = heap_global;
+    size_t pages = 0;
     uintptr_t irq;
+
     spin_lock_irqsave(&heap_lock, &irq);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
+    for (struct heap_extent *ext = heap->extents; ext; ext = ext->next) {
+        if (heap_extent_free(ext)) {
+            pages += ext->pages;
+        }
+    }
+    spin_release_irqrestore(&heap_lock, &irq);
 
-    // Some alignment fuck ups led me to this
-    count = (count + 15) & ~15;
+    return pages;
+}
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
-        }
+// Unmap extents which are completely free, keeping HEAP_KEEP_FREE bytes
+// of free heap memory for further allocations
+static size_t heap_shrink_scan(struct shrinker *s, size_t nr, int flags) {
+    heap_t *heap = heap_global;
+    struct heap_extent *ext, *next, *released = NULL;
+    struct tlb_batch batch;
+    size_t freed = 0, pages;
+    uintptr_t irq, map_irq, phys;
+
+    // Page tables of the heap may be being modified by heap_grow()
+    // which is what's allocating memory
+    if (flags & RECLAIM_DIRECT) {
+        return 0;
     }
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if (block->magic & 1) {
+    if (heap_pcp_ready()) {
+        // Cached blocks may be keeping extents busy
+        heap_pcp_drain_all(heap);
+    }
+
+    spin_lock_irqsave(&heap_map_lock, &map_irq);
+    spin_lock_irqsave(&heap_lock, &irq);
+
+    for (ext = heap->extents; ext && freed < nr; ext = next) {
+        next = ext->next;
+
+        if (!heap_extent_free(ext) || heap->free_size < HEAP_KEEP_FREE + heap_extent_size(ext->pages)) {
             continue;
         }
 
-        if (count == block->size) {
-            block->magic |= 1;
-            spin_release_irqrestore(&heap_lock, &irq);
-            return (void *) ((uintptr_t) block + sizeof(heap_block_t));
-        } else if (block->size >= count + sizeof(heap_block_t)) {
-            // Insert new block after this one
-            heap_block_t *cur_next = block->next;
-            heap_block_t *new_block = (heap_block_t *) (((uintptr_t) block) + sizeof(heap_block_t) + count);
-            if (cur_next) {
-                cur_next->prev = new_block;
+        heap_bin_remove(heap, heap_extent_first(ext));
+        if (ext->prev) {
+            ext->prev->next = ext->next;
+        } else {
+            heap->extents = ext->next;
+        }
+        if (ext->next) {
+            ext->next->prev = ext->prev;
+        }
+        heap->limit -= ext->pages * MM_PAGE_SIZE;
+        ext->magic = 0;
+
+        ext->next = released;
+        released = ext;
+        freed += ext->pages;
+    }
+
+    spin_release_irqrestore(&heap_lock, &irq);
+    spin_release_irqrestore(&heap_map_lock, &map_irq);
+
+    // Other CPUs may have the extents cached under any PCID, wait for
+    // them to be invalidated everywhere before the pages are reused.
+    // Other CPUs are waited for, so no lock may be held
+    tlb_batch_init(&batch, NULL);
+    for (ext = released; ext; ext = next) {
+        next = ext->next;
+        pages = ext->pages;
+        tlb_batch_add(&batch, (uintptr_t) ext, (uintptr_t) ext + pages * MM_PAGE_SIZE);
+
+        for (size_t i = pages; i--;) {
+            phys = mm_umap_single(mm_kernel, (uintptr_t) ext + i * MM_PAGE_SIZE, 1);
+            _assert(phys != MM_NADDR);
+            tlb_batch_free(&batch, phys, 0);
+        }
+    }
+    tlb_batch_flush(&batch);
+
+    return freed;
+}
+
+static struct shrinker heap_shrinker = {
+    .name = "heap",
+    .count = heap_shrink_count,
+    .scan = heap_shrink_scan
+};
+
+////
+
+void heap_stat(heap_t *heap, struct heap_stat *st) {
+    uintptr_t irq;
+    spin_lock_irqsave(&heap_lock, &irq);
+
+    st->alloc_count = 0;
+    st->alloc_size = 0;
+    st->free_size = 0;
+    st->total_size = heap->limit;
+
+    for (struct heap_extent *ext = heap->extents; ext; ext = ext->next) {
+        for (heap_block_t *block = heap_extent_first(ext); block; block = block->next) {
+            if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
+                panic("Broken heap");
             }
-            new_block->next = cur_next;
-            new_block->prev = block;
-            new_block->size = block->size - sizeof(heap_block_t) - count;
-            new_block->magic = HEAP_MAGIC;
-            block->next = new_block;
-            block->size = count;
-            block->magic |= 1;
-            spin_release_irqrestore(&heap_lock, &irq);
-            return (void *) ((uintptr_t) block + sizeof(heap_block_t));
+            if (block->magic & HEAP_CACHED) {
+                st->free_size += block->size;
+            } else if (block->magic & HEAP_USED) {
+                ++st->alloc_count;
+                st->alloc_size += block->size;
+            } else {
+                st->free_size += block->size;
+            }
+        }
+    }
+    spin_release_irqrestore(&heap_lock, &irq);
+}
+
+void amd64_heap_init(heap_t *heap, uintptr_t base, uintptr_t end) {
+    size_t pml4i = (AMD64_MM_STRIPSX(base) >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
+    _assert(pml4i == ((AMD64_MM_STRIPSX(end - 1) >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK));
+    _assert(pml4i > AMD64_PML4I_USER_END);
+
+    heap->base = base;
+    heap->end = end;
+    heap->top = base;
+    heap->limit = 0;
+    heap->free_size = 0;
+    heap->extents = NULL;
+    heap->bin_map = 0;
+    memset(heap->bins, 0, sizeof(heap->bins));
+
+    // Spaces copy kernel PML4 entries when created, so the PDPT for
+    // heap range has to exist before that to be shared by all of them
+    if (!(mm_kernel[pml4i] & MM_PAGE_PRESENT)) {
+        uint64_t *pdpt = amd64_mm_pool_alloc();
+        _assert(pdpt);
+        mm_kernel[pml4i] = MM_PHYS(pdpt) | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+    }
+
+    shrinker_register(&heap_shrinker);
+}
+
+static void *heap_alloc_block(heap_t *heap, size_t count) {
+    heap_block_t *block;
+    uintptr_t irq;
+    void *res;
+
+    if (count > HEAP_MAX_ALLOC) {
+        return NULL;
+    }
+
+    // All sizes are multiples of 16
+    count = (count + 15) & ~15;
+    if (count < HEAP_MIN_SIZE) {
+        count = HEAP_MIN_SIZE;
+    }
+
+    if (count <= HEAP_EXACT_MAX && heap_pcp_ready() && (res = heap_pcp_alloc(count))) {
+        return res;
+    }
+
+    spin_lock_irqsave(&heap_lock, &irq);
+#if defined(HEAP_DEBUG)
+    heap_check(heap);
+#endif
+
+    while (!(block = heap_bin_take(heap, count))) {
+        spin_release_irqrestore(&heap_lock, &irq);
+
+        // Freed blocks held by CPU caches may be merged into
+        // a large enough one, otherwise map more memory
+        if (heap_pcp_ready()) {
+            heap_pcp_drain_all(heap);
         }
+
+        spin_lock_irqsave(&heap_lock, &irq);
+        if ((block = heap_bin_take(heap, count)) != NULL) {
+            break;
+        }
+        spin_release_irqrestore(&heap_lock, &irq);
+
+        if (heap_grow(heap, count) != 0) {
+            return NULL;
+        }
+
+        spin_lock_irqsave(&heap_lock, &irq);
+    }
+
+    if (block->size >= count + sizeof(heap_block_t) + HEAP_MIN_SIZE) {
+        // Insert new block after this one
+        heap_block_t *cur_next = block->next;
+        heap_block_t *new_block = (heap_block_t *) (((uintptr_t) block) + sizeof(heap_block_t) + count);
+        if (cur_next) {
+            cur_next->prev = new_block;
+        }
+        new_block->next = cur_next;
+        new_block->prev = block;
+        new_block->size = block->size - sizeof(heap_block_t) - count;
+        new_block->magic = HEAP_MAGIC;
+        block->next = new_block;
+        block->size = count;
+
+        // The block was free, so its neighbours are not
+        heap_bin_insert(heap, new_block);
     }
+    block->magic |= HEAP_USED;
 
     spin_release_irqrestore(&heap_lock, &irq);
-    return NULL;
+    return &block[1];
+}
+
+// Heap interface implementation
+void *heap_alloc(heap_t *heap, size_t count) {
+    void *res = heap_alloc_block(heap, count);
+    alloc_profile_alloc(ALLOC_HEAP, NULL, alloc_profile_site(), (uintptr_t) res, count);
+    return res;
 }
 
 void heap_free(heap_t *heap, void *ptr) {
@@ -135,14 +628,9 @@ void heap_free(heap_t *heap, void *ptr) {
         return;
     }
     uintptr_t irq;
-    spin_lock_irqsave(&heap_lock, &irq);
-
-    if (ptr == (void *) 0xffffff00042ddd70) {
-    }
 
     // Check if the pointer belongs to the heap
-    if (((uintptr_t) ptr) < MM_VIRTUALIZE(heap->phys_base) ||
-        ((uintptr_t) ptr) > (MM_VIRTUALIZE(heap->phys_base) + heap->limit)) {
+    if (((uintptr_t) ptr) < heap->base || ((uintptr_t) ptr) >= heap->top) {
         panic("Tried to free a pointer from outside a heap: %p\n", ptr);
     }
 
@@ -150,40 +638,22 @@ void heap_free(heap_t *heap, void *ptr) {
     heap_block_t *block = (heap_block_t *) (((uintptr_t) ptr) - sizeof(heap_block_t));
 
     assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic: %p\n", ptr);
-    assert(block->magic & 1, "Double free error (kheap): %p\n", ptr);
+    assert(block->magic & HEAP_USED, "Double free error (kheap): %p\n", ptr);
+    assert(!(block->magic & HEAP_CACHED), "Double free error (kheap): %p\n", ptr);
 
-    block->magic = HEAP_MAGIC;
-    //kdebug("%p is free\n", block);
-    heap_block_t *begin = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
+    alloc_profile_free((uintptr_t) ptr);
 
-    for (heap_block_t *block = begin; block; block = block->next) {
-        if ((block->magic & HEAP_MAGIC) != HEAP_MAGIC) {
-            panic("Heap is broken: magic %08x, %p (%lu), size could be %S\n", block->magic, block, (uintptr_t) block - (uintptr_t) begin, block->size);
-        }
+    if (block->size <= HEAP_EXACT_MAX && heap_pcp_ready()) {
+        heap_pcp_free(heap, block);
+        return;
     }
 
-    heap_block_t *prev = block->prev;
-    heap_block_t *next = block->next;
-
-    // TODO: fix this
-    if (prev && !(prev->magic & 1)) {
-        prev->next = next;
-        if (next) {
-            next->prev = prev;
-        }
-        prev->size += sizeof(heap_block_t) + block->size;
-        block->magic = 0;
-        block = prev;
-    }
+    spin_lock_irqsave(&heap_lock, &irq);
+#if defined(HEAP_DEBUG)
+    heap_check(heap);
+#endif
 
-    if (next && !(next->magic & 1)) {
-        block->next = next->next;
-        if (next->next) {
-            next->next->prev = block;
-        }
-        next->magic = 0;
-        block->size += sizeof(heap_block_t) + next->size;
-    }
+    heap_block_release(heap, block);
 
     spin_release_irqrestore(&heap_lock, &irq);
 }
@@ -191,19 +661,23 @@ void heap_free(heap_t *heap, void *ptr) {
 // amd64-specific
 size_t amd64_heap_blocks(const heap_t *heap) {
     size_t c = 0;
-    for (const heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-         block; block = block->next) {
-        assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
-        ++c;
+    for (const struct heap_extent *ext = heap->extents; ext; ext = ext->next) {
+        for (const heap_block_t *block = heap_extent_first(ext); block; block = block->next) {
+            assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
+            ++c;
+        }
     }
     return c;
 }
 
 void amd64_heap_dump(const heap_t *heap) {
-    for (const heap_block_t *block = (heap_block_t *) MM_VIRTUALIZE(heap->phys_base);
-         block; block = block->next) {
-        assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
+    for (const struct heap_extent *ext = heap->extents; ext; ext = ext->next) {
+        kdebug("Extent %p: %S\n", ext, ext->pages * MM_PAGE_SIZE);
+
+        for (const heap_block_t *block = heap_extent_first(ext); block; block = block->next) {
+            assert((block->magic & HEAP_MAGIC) == HEAP_MAGIC, "Corrupted heap block magic\n");
 
-        kdebug("%p: %S %s%s\n", block, block->size, (block->magic & 1 ? "USED" : "FREE"), (block->next ? " -> " : ""));
+            kdebug("%p: %S %s%s\n", block, block->size, (block->magic & HEAP_USED ? "USED" : "FREE"), (block->next ? " -> " : ""));
+        }
     }
 }
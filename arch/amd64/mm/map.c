@@ -2,13 +2,76 @@
 #include "arch/amd64/mm/map.h"
 #include "sys/mem/shmem.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
 #include "sys/assert.h"
 #include "sys/string.h"
 #include "sys/thread.h"
 #include "sys/debug.h"
 #include "sys/panic.h"
+#include "sys/spin.h"
 #include "sys/mm.h"
 
+// Protects the references of 2MiB frames against mm_map_split()
+// turning a frame into separately referenced pages
+static spin_t huge_ref_lock = 0;
+
+// Add `delta' to the references held to a frame by its 2MiB mappings
+static void mm_huge_ref(struct page *head, int delta) {
+    uintptr_t irq;
+    spin_lock_irqsave(&huge_ref_lock, &irq);
+
+    if (head->flags & PG_HUGE) {
+        _assert(delta > 0 || head->refcount);
+        __sync_fetch_and_add(&head->refcount, delta);
+    } else {
+        // One of the mappings of the frame was split, the remaining
+        // 2MiB ones reference each of its pages, which may also be
+        // mapped and unmapped separately meanwhile
+        for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+            _assert(delta > 0 || head[i].refcount);
+            __sync_fetch_and_add(&head[i].refcount, delta);
+        }
+    }
+
+    spin_release_irqrestore(&huge_ref_lock, &irq);
+}
+
+// Drop the reference of an unmapped 2MiB mapping to its frame, freeing
+// the frame or its pages no longer referenced through `batch', or right
+// away if it's NULL
+static void mm_huge_put(struct page *head, uintptr_t phys, struct tlb_batch *batch) {
+    uintptr_t irq;
+    int release;
+
+    spin_lock_irqsave(&huge_ref_lock, &irq);
+    if (head->flags & PG_HUGE) {
+        _assert(head->refcount);
+        release = !__sync_sub_and_fetch(&head->refcount, 1);
+        spin_release_irqrestore(&huge_ref_lock, &irq);
+
+        if (release && batch) {
+            tlb_batch_free(batch, phys, 1);
+        } else if (release) {
+            mm_phys_free_huge_page(phys);
+        }
+        return;
+    }
+    // A frame never becomes huge again once split
+    spin_release_irqrestore(&huge_ref_lock, &irq);
+
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        _assert(head[i].refcount);
+        if (__sync_sub_and_fetch(&head[i].refcount, 1)) {
+            continue;
+        }
+        if (batch) {
+            tlb_batch_free(batch, phys + i * MM_PAGE_SIZE, 0);
+        } else {
+            mm_phys_free_page(phys + i * MM_PAGE_SIZE);
+        }
+    }
+}
+
 uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     vaddr = AMD64_MM_STRIPSX(vaddr);
     size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
@@ -37,7 +100,10 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     }
 
     if (pdpt[pdpti] & MM_PAGE_HUGE) {
-        return (pdpt[pdpti] & MM_PTE_MASK) | (vaddr & MM_PAGE_L3_OFFSET_MASK);
+        if (flags) {
+            *flags = pdpt[pdpti] & MM_PTE_FLAGS_MASK;
+        }
+        return (pdpt[pdpti] & MM_PTE_MASK & ~MM_PAGE_L3_OFFSET_MASK) | (vaddr & MM_PAGE_L3_OFFSET_MASK);
     }
 
     // L2:
@@ -49,7 +115,10 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
 
     if (pd[pdi] & MM_PAGE_HUGE) {
         // Page size is 2MiB (1 << 21)
-        return (pd[pti] & MM_PTE_MASK) | (vaddr & MM_PAGE_L2_OFFSET_MASK);
+        if (flags) {
+            *flags = pd[pdi] & MM_PTE_FLAGS_MASK;
+        }
+        return (pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK) | (vaddr & MM_PAGE_L2_OFFSET_MASK);
     }
 
     // L1:
@@ -66,10 +135,9 @@ uintptr_t mm_map_get(const mm_space_t pml4, uintptr_t vaddr, uint64_t *flags) {
     return (pt[pti] & MM_PTE_MASK) | (vaddr & MM_PAGE_OFFSET_MASK);
 }
 
-uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
+// Pages no longer referenced are freed through `batch' if it's given
+static uintptr_t mm_umap(mm_space_t pml4, uintptr_t vaddr, uint32_t size, struct tlb_batch *batch) {
     vaddr = AMD64_MM_STRIPSX(vaddr);
-    // TODO: support page sizes other than 4KiB
-    // (Though I can't think of any reason to use it)
     size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
     size_t pdpti = (vaddr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
     size_t pdi =   (vaddr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
@@ -107,7 +175,27 @@ uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
     }
 
     if (pd[pdi] & MM_PAGE_HUGE) {
-        panic("NYI\n");
+        if (size != MM_UMAP_ANY && size != MM_UMAP_2M) {
+            return MM_NADDR;
+        }
+
+        uint64_t old = pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
+        pd[pdi] = 0;
+
+        asm volatile("invlpg (%0)"::"r"(vaddr));
+        // Reference count is kept in the first page of the frame
+        struct page *page = PHYS2PAGE(old);
+        if (page && batch) {
+            mm_huge_put(page, old, batch);
+        } else if (page) {
+            mm_huge_ref(page, -1);
+        }
+
+        return old;
+    }
+
+    if (size != MM_UMAP_ANY && size != MM_UMAP_4K) {
+        return MM_NADDR;
     }
 
     // L1:
@@ -122,17 +210,28 @@ uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
 
     asm volatile("invlpg (%0)"::"r"(vaddr));
     struct page *page = PHYS2PAGE(old);
-    _assert(page);
-    _assert(page->refcount);
-    --page->refcount;
+    // NULL for device memory outside of RAM sections
+    if (page) {
+        _assert(page->refcount);
+        if (!__sync_sub_and_fetch(&page->refcount, 1) && batch) {
+            tlb_batch_free(batch, old, 0);
+        }
+    }
 
     return old;
 }
 
+uintptr_t mm_umap_single(mm_space_t pml4, uintptr_t vaddr, uint32_t size) {
+    return mm_umap(pml4, vaddr, size, NULL);
+}
+
+uintptr_t mm_umap_release(mm_space_t pml4, uintptr_t vaddr, uint32_t size, struct tlb_batch *batch) {
+    _assert(batch);
+    return mm_umap(pml4, vaddr, size, batch);
+}
+
 int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t flags) {
     virt_addr = AMD64_MM_STRIPSX(virt_addr);
-    // TODO: support page sizes other than 4KiB
-    // (Though I can't think of any reason to use it)
     size_t pml4i = (virt_addr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
     size_t pdpti = (virt_addr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
     size_t pdi =   (virt_addr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
@@ -167,9 +266,30 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
                       MM_PAGE_USER |
                       MM_PAGE_WRITE;
     } else {
+        assert(!(pdpt[pdpti] & MM_PAGE_HUGE), "%p is inside a 1GiB page\n", virt_addr);
         pd = (mm_pagedir_t) MM_VIRTUALIZE(pdpt[pdpti] & MM_PTE_MASK);
     }
 
+    if (flags & MM_PAGE_HUGE) {
+        _assert(!(virt_addr & MM_PAGE_L2_OFFSET_MASK));
+        _assert(!(phys & MM_PAGE_L2_OFFSET_MASK));
+        // Neither a huge page nor a page table may be there
+        assert(!(pd[pdi] & MM_PAGE_PRESENT), "Entry already present for %p\n", virt_addr);
+
+        struct page *pg = PHYS2PAGE(phys);
+        if (pg) {
+            mm_huge_ref(pg, 1);
+        }
+
+        pd[pdi] = phys |
+                  (flags & MM_PTE_FLAGS_MASK) |
+                  MM_PAGE_PRESENT;
+
+        asm volatile("invlpg (%0)"::"r"(virt_addr));
+
+        return 0;
+    }
+
     if (!(pd[pdi] & MM_PAGE_PRESENT)) {
         // Allocate PT
         pt = (mm_pagetab_t) amd64_mm_pool_alloc();
@@ -181,6 +301,7 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
                   MM_PAGE_USER |
                   MM_PAGE_WRITE;
     } else {
+        assert(!(pd[pdi] & MM_PAGE_HUGE), "%p is inside a huge page\n", virt_addr);
         pt = (mm_pagetab_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
     }
 
@@ -195,10 +316,13 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
             (flags & MM_PAGE_GLOBAL) ? 'G' : '-');
 #endif
 
-    // Increase refcount on physical page
+    // Increase refcount on physical page. Pages such as mm_zero_page
+    // and the ones of the file cache are referenced by other spaces
+    // and the cache concurrently
     struct page *pg = PHYS2PAGE(phys);
-    _assert(pg);
-    ++pg->refcount;
+    if (pg) {
+        __sync_fetch_and_add(&pg->refcount, 1);
+    }
 
     pt[pti] = (phys & MM_PAGE_MASK) |
               (flags & MM_PTE_FLAGS_MASK) |
@@ -209,6 +333,142 @@ int mm_map_single(mm_space_t pml4, uintptr_t virt_addr, uintptr_t phys, uint64_t
     return 0;
 }
 
+int mm_map_split(mm_space_t pml4, uintptr_t vaddr) {
+    vaddr = AMD64_MM_STRIPSX(vaddr) & ~MM_PAGE_L2_OFFSET_MASK;
+    size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdpti = (vaddr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdi =   (vaddr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
+
+    mm_pdpt_t pdpt;
+    mm_pagedir_t pd;
+    mm_pagetab_t pt;
+
+    if (!(pml4[pml4i] & MM_PAGE_PRESENT)) {
+        return -1;
+    }
+    pdpt = (mm_pdpt_t) MM_VIRTUALIZE(pml4[pml4i] & MM_PTE_MASK);
+    if (!(pdpt[pdpti] & MM_PAGE_PRESENT) || (pdpt[pdpti] & MM_PAGE_HUGE)) {
+        return -1;
+    }
+    pd = (mm_pagedir_t) MM_VIRTUALIZE(pdpt[pdpti] & MM_PTE_MASK);
+    if (!(pd[pdi] & MM_PAGE_PRESENT)) {
+        return -1;
+    }
+    if (!(pd[pdi] & MM_PAGE_HUGE)) {
+        // Already split
+        return 0;
+    }
+
+    uintptr_t phys = pd[pdi] & MM_PTE_MASK & ~MM_PAGE_L2_OFFSET_MASK;
+    uint64_t access = pd[pdi] & MM_PTE_FLAGS_MASK & ~MM_PAGE_HUGE;
+    struct page *head = PHYS2PAGE(phys);
+    uintptr_t irq;
+    _assert(head && (head->flags & PG_HUGE));
+    _assert(head->refcount);
+
+    if (!(pt = (mm_pagetab_t) amd64_mm_pool_alloc())) {
+        return -1;
+    }
+
+    if (head->usage == PU_PRIVATE && head->refcount != 1) {
+        // Private frame also mapped elsewhere, copy its contents
+        // unless the other mappings are gone by the time it's done
+        for (size_t i = 0; i < MM_PTE_COUNT; ++i) {
+            uintptr_t page_phys = mm_phys_alloc_page(PU_PRIVATE);
+            if (page_phys == MM_NADDR) {
+                while (i--) {
+                    mm_phys_free_page(pt[i] & MM_PTE_MASK);
+                }
+                amd64_mm_pool_free(pt);
+                return -1;
+            }
+            memcpy((void *) MM_VIRTUALIZE(page_phys),
+                   (const void *) MM_VIRTUALIZE(phys + i * MM_PAGE_SIZE),
+                   MM_PAGE_SIZE);
+            pt[i] = page_phys | access;
+        }
+
+        spin_lock_irqsave(&huge_ref_lock, &irq);
+        if (head->refcount != 1) {
+            __sync_fetch_and_sub(&head->refcount, 1);
+            spin_release_irqrestore(&huge_ref_lock, &irq);
+
+            for (size_t i = 0; i < MM_PTE_COUNT; ++i) {
+                struct page *pg = PHYS2PAGE(pt[i] & MM_PTE_MASK);
+                pg->refcount = 1;
+                pg->flags |= head->flags & PG_MMAPED;
+            }
+            goto done;
+        }
+        spin_release_irqrestore(&huge_ref_lock, &irq);
+
+        for (size_t i = 0; i < MM_PTE_COUNT; ++i) {
+            mm_phys_free_page(pt[i] & MM_PTE_MASK);
+        }
+    }
+
+    // The only mapping of the frame or a shared one: map the pages of
+    // the frame itself, each of them referenced separately from now on
+    // by this and the remaining 2MiB mappings, see mm_huge_ref()
+    spin_lock_irqsave(&huge_ref_lock, &irq);
+    head->flags &= ~PG_HUGE;
+    for (size_t i = 0; i < MM_PTE_COUNT; ++i) {
+        struct page *pg = PHYS2PAGE(phys + i * MM_PAGE_SIZE);
+        pg->refcount = head->refcount;
+        pg->flags |= head->flags & PG_MMAPED;
+        pt[i] = (phys + i * MM_PAGE_SIZE) | access;
+    }
+    spin_release_irqrestore(&huge_ref_lock, &irq);
+
+done:
+    pd[pdi] = MM_PHYS(pt) |
+              MM_PAGE_PRESENT |
+              MM_PAGE_USER |
+              MM_PAGE_WRITE;
+    asm volatile("invlpg (%0)"::"r"(vaddr));
+
+    return 0;
+}
+
+int mm_map_huge_avail(mm_space_t pml4, uintptr_t vaddr) {
+    vaddr = AMD64_MM_STRIPSX(vaddr);
+    size_t pml4i = (vaddr >> MM_PML4I_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdpti = (vaddr >> MM_PDPTI_SHIFT) & MM_PTE_INDEX_MASK;
+    size_t pdi =   (vaddr >> MM_PDI_SHIFT)   & MM_PTE_INDEX_MASK;
+
+    mm_pdpt_t pdpt;
+    mm_pagedir_t pd;
+
+    _assert(!(vaddr & MM_PAGE_L2_OFFSET_MASK));
+
+    if (!(pml4[pml4i] & MM_PAGE_PRESENT)) {
+        return 1;
+    }
+    pdpt = (mm_pdpt_t) MM_VIRTUALIZE(pml4[pml4i] & MM_PTE_MASK);
+    if (!(pdpt[pdpti] & MM_PAGE_PRESENT)) {
+        return 1;
+    }
+    if (pdpt[pdpti] & MM_PAGE_HUGE) {
+        return 0;
+    }
+    pd = (mm_pagedir_t) MM_VIRTUALIZE(pdpt[pdpti] & MM_PTE_MASK);
+
+    return !(pd[pdi] & MM_PAGE_PRESENT);
+}
+
+uintptr_t mm_kernel_phys(const void *ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    uintptr_t phys;
+
+    if (addr >= KERNEL_VIRT_BASE) {
+        return MM_PHYS(addr);
+    }
+
+    phys = mm_map_get(mm_kernel, addr & MM_PAGE_MASK, NULL);
+    assert(phys != MM_NADDR, "%p is not mapped\n", ptr);
+    return phys + (addr & MM_PAGE_OFFSET_MASK);
+}
+
 int mm_space_clone(mm_space_t dst_pml4, const mm_space_t src_pml4, uint32_t flags) {
     if ((flags & MM_CLONE_FLG_USER)) {
         panic("NYI\n");
@@ -229,6 +489,11 @@ int mm_space_clone(mm_space_t dst_pml4, const mm_space_t src_pml4, uint32_t flag
 int mm_space_fork(struct process *dst, const struct process *src, uint32_t flags) {
     mm_pml4_t dst_pml4 = dst->space;
     const mm_pml4_t src_pml4 = src->space;
+    struct tlb_batch batch;
+
+    // Other threads of the source may still have the pages it's losing
+    // write access to cached as writable
+    tlb_batch_init(&batch, src);
 
     if (flags & MM_CLONE_FLG_USER) {
         for (size_t pml4i = 0; pml4i < AMD64_PML4I_USER_END; ++pml4i) {
@@ -268,7 +533,23 @@ int mm_space_fork(struct process *dst, const struct process *src, uint32_t flags
                     }
 
                     if (src_pd[pdi] & MM_PAGE_HUGE) {
-                        panic("2MiB pages not supported in userspace\n");
+                        uintptr_t src_page_virt = (pml4i << MM_PML4I_SHIFT) |
+                                                  (pdpti << MM_PDPTI_SHIFT) |
+                                                  (pdi << MM_PDI_SHIFT);
+                        uintptr_t src_page_phys = src_pd[pdi] & MM_PTE_MASK;
+                        struct page *src_page = PHYS2PAGE(src_page_phys);
+
+                        if (src_page) {
+                            mm_huge_ref(src_page, 1);
+                        }
+
+                        if (src_page && (src_pd[pdi] & MM_PAGE_WRITE) && src_page->usage == PU_PRIVATE) {
+                            // CoW the whole 2MiB frame
+                            src_pd[pdi] &= ~MM_PAGE_WRITE;
+                            tlb_batch_add(&batch, src_page_virt, src_page_virt + MM_HUGE_PAGE_SIZE);
+                        }
+                        dst_pd[pdi] = src_pd[pdi];
+                        continue;
                     }
 
                     mm_pagetab_t src_pt = (mm_pagetab_t) MM_VIRTUALIZE(src_pd[pdi] & MM_PTE_MASK);
@@ -288,15 +569,17 @@ int mm_space_fork(struct process *dst, const struct process *src, uint32_t flags
                         uintptr_t src_page_phys = src_pt[pti] & MM_PTE_MASK;
                         struct page *src_page = PHYS2PAGE(src_page_phys);
 
-                        _assert(src_page->refcount);
-                        ++src_page->refcount;
+                        if (src_page) {
+                            _assert(src_page->refcount);
+                            __sync_fetch_and_add(&src_page->refcount, 1);
+                        }
 
-                        if ((src_pt[pti] & MM_PAGE_WRITE) && src_page->usage == PU_PRIVATE) {
+                        if (src_page && (src_pt[pti] & MM_PAGE_WRITE) && src_page->usage == PU_PRIVATE) {
                             // Clone the mapping, use CoW
                             uint64_t access = src_pt[pti] & (MM_PTE_FLAGS_MASK & ~MM_PAGE_WRITE);
                             dst_pt[pti] = src_page_phys | access;
                             src_pt[pti] &= ~MM_PAGE_WRITE;
-                            asm volatile("invlpg (%0)"::"r"(src_page_virt));
+                            tlb_batch_add(&batch, src_page_virt, src_page_virt + MM_PAGE_SIZE);
                         } else {
                             // Just clone the mapping - it's readonly
                             dst_pt[pti] = src_page_phys | (src_pt[pti] & MM_PTE_FLAGS_MASK);
@@ -307,17 +590,30 @@ int mm_space_fork(struct process *dst, const struct process *src, uint32_t flags
         }
     }
 
+    tlb_batch_flush(&batch);
+
     // Kernel pages don't need to be copied - just use mm_space_clone(, , MM_CLONE_FLG_KERNEL)
     return mm_space_clone(dst_pml4, src_pml4, MM_CLONE_FLG_KERNEL & flags);
 }
 
 void mm_space_release(struct process *proc) {
-    mm_space_t pml4 = proc->space;
+    mm_space_t space = proc->space;
+    mm_pml4_t pml4;
 
-    if (pml4 == mm_kernel) {
+    if (space == mm_kernel) {
         panic("???\n");
     }
 
+    // Detach the user half of the space and invalidate it everywhere
+    // before anything is freed: the space may still be loaded (execve())
+    pml4 = amd64_mm_pool_alloc();
+    _assert(pml4);
+    for (size_t pml4i = 0; pml4i < AMD64_PML4I_USER_END; ++pml4i) {
+        pml4[pml4i] = space[pml4i];
+        space[pml4i] = 0;
+    }
+    tlb_shootdown(proc, 0, USER_VIRT_END);
+
     for (size_t pml4i = 0; pml4i < AMD64_PML4I_USER_END; ++pml4i) {
         if (!(pml4[pml4i] & MM_PAGE_PRESENT)) {
             continue;
@@ -337,6 +633,15 @@ void mm_space_release(struct process *proc) {
                     continue;
                 }
 
+                if (pd[pdi] & MM_PAGE_HUGE) {
+                    uintptr_t page_phys = pd[pdi] & MM_PTE_MASK;
+                    struct page *page = PHYS2PAGE(page_phys);
+                    if (page) {
+                        mm_huge_put(page, page_phys, NULL);
+                    }
+                    continue;
+                }
+
                 mm_space_t pt = (mm_space_t) MM_VIRTUALIZE(pd[pdi] & MM_PTE_MASK);
 
                 for (size_t pti = 0; pti < MM_PTE_COUNT; ++pti) {
@@ -346,11 +651,14 @@ void mm_space_release(struct process *proc) {
 
                     uintptr_t page_phys = pt[pti] & MM_PTE_MASK;
                     struct page *page = PHYS2PAGE(page_phys);
+                    if (!page) {
+                        // Device memory
+                        continue;
+                    }
                     _assert(page->refcount);
-                    --page->refcount;
 
                     // Any page with zero refcount can be released
-                    if (!page->refcount) {
+                    if (!__sync_sub_and_fetch(&page->refcount, 1)) {
                         mm_phys_free_page(page_phys);
                     }
                 }
@@ -362,9 +670,12 @@ void mm_space_release(struct process *proc) {
         }
 
         amd64_mm_pool_free(pdpt);
-
-        pml4[pml4i] = 0;
     }
+
+    amd64_mm_pool_free(pml4);
+
+    mmap_writeback(&proc->vmas, 0, USER_VIRT_END);
+    vma_clear(&proc->vmas);
 }
 
 void mm_space_free(struct process *proc) {
@@ -7,14 +7,16 @@
 #include "sys/panic.h"
 #include "sys/heap.h"
 #include "arch/amd64/mm/phys.h"
+#include "arch/amd64/mm/pool.h"
 #include "sys/mem/phys.h"
 #include "sys/mm.h"
 
 mm_space_t mm_kernel;
+uintptr_t mm_zero_page = MM_NADDR;
 
 // Reserved space for kernel page structs
-// TODO: option to enable PDPE1GB
 // 1x PML4; 1x PDPT; 4x PD
+// PDs are only used by boot code and when 1GiB pages are not supported
 __attribute__((aligned(0x1000))) uint64_t kernel_pd_res[6 * 512];
 
 extern int _kernel_end;
@@ -22,7 +24,55 @@ extern int _kernel_end;
 void userptr_check(const void *ptr) {
     // TODO: "hardened" check - also check that the address is mapped
     assert(ptr, "invalid userptr: NULL\n");
-    assert((uintptr_t) ptr < KERNEL_VIRT_BASE, "invalid userptr: in kernel space (%p)\n", ptr);
+    assert((uintptr_t) ptr < USER_VIRT_END, "invalid userptr: in kernel space (%p)\n", ptr);
+}
+
+// Boot code maps first 4GiB of physical memory using 2MiB pages.
+// Remap it with 1GiB pages if possible and map the rest of memory
+static void amd64_mm_direct_map(uintptr_t end) {
+    mm_pdpt_t pdpt = &kernel_pd_res[4 * 512];
+    uintptr_t addr;
+
+    if (end < PHYS_BOOT_DIRECT_LIMIT) {
+        end = PHYS_BOOT_DIRECT_LIMIT;
+    }
+    _assert(end <= (1ULL << MM_PML4I_SHIFT));
+
+    if (cpuid_ext_features_edx & CPUID_EXT_EDX_FEATURE_PDPE1GB) {
+        kdebug("Mapping %S of physical memory using 1GiB pages\n", end);
+
+        // The same physical addresses and access bits as the current
+        // mapping, so no need to worry about the code running right now
+        for (addr = 0; addr < end; addr += 1ULL << MM_PDPTI_SHIFT) {
+            pdpt[addr >> MM_PDPTI_SHIFT] = addr | MM_PAGE_HUGE | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+        }
+
+        // Flush 2MiB translations
+        asm volatile ("movq %0, %%cr3"::"r"(MM_PHYS(mm_kernel)):"memory");
+        return;
+    }
+
+    if (end == PHYS_BOOT_DIRECT_LIMIT) {
+        return;
+    }
+
+    kdebug("Extending direct mapping up to %p using 2MiB pages\n", end);
+
+    for (addr = PHYS_BOOT_DIRECT_LIMIT; addr < end; addr += 1ULL << MM_PDPTI_SHIFT) {
+        size_t pdpti = addr >> MM_PDPTI_SHIFT;
+        mm_pagedir_t pd;
+
+        _assert(!(pdpt[pdpti] & MM_PAGE_PRESENT));
+        // Allocated from boot direct mapping
+        pd = (mm_pagedir_t) amd64_mm_pool_alloc();
+        _assert(pd);
+
+        for (size_t pdi = 0; pdi < MM_PTE_COUNT; ++pdi) {
+            pd[pdi] = (addr + (pdi << MM_PDI_SHIFT)) | MM_PAGE_HUGE | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+        }
+
+        pdpt[pdpti] = MM_PHYS(pd) | MM_PAGE_WRITE | MM_PAGE_PRESENT;
+    }
 }
 
 void amd64_mm_init(void) {
@@ -30,10 +80,14 @@ void amd64_mm_init(void) {
 
     mm_kernel = &kernel_pd_res[5 * 512];
 
-    uintptr_t heap_base_phys = mm_phys_alloc_contiguous(KERNEL_HEAP >> 12, PU_KERNEL);
-    assert(heap_base_phys != MM_NADDR, "Could not allocate %S of memory for kernel heap\n", KERNEL_HEAP);
-    kdebug("Setting up kernel heap of %S @ %p\n", KERNEL_HEAP, heap_base_phys);
-    amd64_heap_init(heap_global, heap_base_phys, KERNEL_HEAP);
+    amd64_mm_direct_map(amd64_phys_memory_end());
+    amd64_phys_memory_map_high();
+
+    kdebug("Setting up kernel heap @ %p\n", KERNEL_HEAP_BASE);
+    amd64_heap_init(heap_global, KERNEL_HEAP_BASE, KERNEL_HEAP_END);
 
-    amd64_heap_dump(heap_global);
+    mm_zero_page = mm_phys_alloc_zeroed_page(PU_KERNEL);
+    _assert(mm_zero_page != MM_NADDR);
+    // Hold a reference so that unmapping never frees it
+    ++PHYS2PAGE(mm_zero_page)->refcount;
 }
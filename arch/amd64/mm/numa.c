@@ -0,0 +1,158 @@
+#include "arch/amd64/mm/numa.h"
+#include "arch/amd64/mm/phys.h"
+#include "arch/amd64/smp/smp.h"
+#include "arch/amd64/cpu.h"
+#include "sys/mem/phys.h"
+#include "sys/debug.h"
+#include "acpi.h"
+
+// Distances as defined by ACPI when SLIT is not present
+#define NUMA_DISTANCE_LOCAL         10
+#define NUMA_DISTANCE_REMOTE        20
+#define NUMA_MAX_RANGES             32
+
+// Proximity domain -> node index
+static uint32_t numa_domains[PHYS_MAX_NODES];
+static size_t numa_node_count = 0;
+// Memory affinity entries are only applied once the whole table is
+// parsed, as it's unknown until then whether the system is NUMA at all
+static struct {
+    uintptr_t begin, end;
+    int node;
+} numa_ranges[NUMA_MAX_RANGES];
+static size_t numa_range_count = 0;
+
+static int numa_domain_node(uint32_t domain) {
+    for (size_t i = 0; i < numa_node_count; ++i) {
+        if (numa_domains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (numa_node_count == PHYS_MAX_NODES) {
+        kwarn("Too many NUMA proximity domains, %u is treated as node 0\n", domain);
+        return 0;
+    }
+
+    numa_domains[numa_node_count] = domain;
+    return numa_node_count++;
+}
+
+static void numa_cpu_affinity(uint32_t apic_id, int node) {
+#if defined(AMD64_SMP)
+    for (size_t i = 0; i < smp_ncpus; ++i) {
+        if (cpus[i].apic_id == apic_id) {
+            amd64_phys_numa_cpu(i, node);
+            kdebug("cpu%u (APIC %u) -> node %d\n", i, apic_id, node);
+        }
+    }
+#else
+    if (apic_id == 0) {
+        amd64_phys_numa_cpu(0, node);
+    }
+#endif
+}
+
+static void numa_parse_srat(ACPI_TABLE_SRAT *srat) {
+    uintptr_t ptr = (uintptr_t) srat + sizeof(ACPI_TABLE_SRAT);
+    uintptr_t end = (uintptr_t) srat + srat->Header.Length;
+
+    while (ptr + sizeof(ACPI_SUBTABLE_HEADER) <= end) {
+        ACPI_SUBTABLE_HEADER *hdr = (ACPI_SUBTABLE_HEADER *) ptr;
+        if (!hdr->Length) {
+            kwarn("SRAT: zero-length entry\n");
+            break;
+        }
+
+        switch (hdr->Type) {
+        case ACPI_SRAT_TYPE_CPU_AFFINITY:
+            {
+                ACPI_SRAT_CPU_AFFINITY *ent = (ACPI_SRAT_CPU_AFFINITY *) hdr;
+                uint32_t domain = ent->ProximityDomainLo |
+                                  ((uint32_t) ent->ProximityDomainHi[0] << 8) |
+                                  ((uint32_t) ent->ProximityDomainHi[1] << 16) |
+                                  ((uint32_t) ent->ProximityDomainHi[2] << 24);
+                if (ent->Flags & ACPI_SRAT_CPU_USE_AFFINITY) {
+                    numa_cpu_affinity(ent->ApicId, numa_domain_node(domain));
+                }
+            }
+            break;
+        case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY:
+            {
+                ACPI_SRAT_X2APIC_CPU_AFFINITY *ent = (ACPI_SRAT_X2APIC_CPU_AFFINITY *) hdr;
+                if (ent->Flags & ACPI_SRAT_CPU_ENABLED) {
+                    numa_cpu_affinity(ent->ApicId, numa_domain_node(ent->ProximityDomain));
+                }
+            }
+            break;
+        case ACPI_SRAT_TYPE_MEMORY_AFFINITY:
+            {
+                ACPI_SRAT_MEM_AFFINITY *ent = (ACPI_SRAT_MEM_AFFINITY *) hdr;
+                if ((ent->Flags & ACPI_SRAT_MEM_ENABLED) && ent->Length) {
+                    int node = numa_domain_node(ent->ProximityDomain);
+                    if (numa_range_count == NUMA_MAX_RANGES) {
+                        kwarn("SRAT: too many memory affinity entries\n");
+                        break;
+                    }
+                    numa_ranges[numa_range_count].begin = ent->BaseAddress;
+                    numa_ranges[numa_range_count].end = ent->BaseAddress + ent->Length;
+                    numa_ranges[numa_range_count].node = node;
+                    ++numa_range_count;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+
+        ptr += hdr->Length;
+    }
+}
+
+static void numa_parse_slit(ACPI_TABLE_SLIT *slit) {
+    size_t count = slit->LocalityCount;
+
+    for (size_t i = 0; i < numa_node_count; ++i) {
+        for (size_t j = 0; j < numa_node_count; ++j) {
+            if (numa_domains[i] >= count || numa_domains[j] >= count) {
+                continue;
+            }
+            amd64_phys_numa_distance(i, j, slit->Entry[numa_domains[i] * count + numa_domains[j]]);
+        }
+    }
+}
+
+void amd64_numa_init(void) {
+    ACPI_TABLE_HEADER *srat, *slit;
+
+    if (ACPI_FAILURE(AcpiGetTable(ACPI_SIG_SRAT, 1, &srat))) {
+        kdebug("No SRAT present, assuming single NUMA node\n");
+        return;
+    }
+
+    numa_parse_srat((ACPI_TABLE_SRAT *) srat);
+    AcpiPutTable(srat);
+
+    if (numa_node_count < 2) {
+        return;
+    }
+
+    for (size_t i = 0; i < numa_node_count; ++i) {
+        for (size_t j = 0; j < numa_node_count; ++j) {
+            amd64_phys_numa_distance(i, j, i == j ? NUMA_DISTANCE_LOCAL : NUMA_DISTANCE_REMOTE);
+        }
+    }
+
+    if (ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_SLIT, 1, &slit))) {
+        numa_parse_slit((ACPI_TABLE_SLIT *) slit);
+        AcpiPutTable(slit);
+    }
+
+    for (size_t i = 0; i < numa_range_count; ++i) {
+        kdebug("%p .. %p -> node %d\n", numa_ranges[i].begin, numa_ranges[i].end, numa_ranges[i].node);
+        amd64_phys_numa_range(numa_ranges[i].begin, numa_ranges[i].end, numa_ranges[i].node);
+    }
+
+    kinfo("%u NUMA nodes\n", numa_node_count);
+    amd64_phys_numa_commit(numa_node_count);
+}
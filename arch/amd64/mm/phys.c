@@ -4,15 +4,43 @@
 #include "sys/panic.h"
 #include "sys/debug.h"
 #include "sys/string.h"
+#include "sys/sched.h"
 #include "sys/spin.h"
+#include "sys/mem/reclaim.h"
+#include "sys/mem/profile.h"
 #include "sys/mem/phys.h"
+#include "arch/amd64/cpu.h"
 #include "sys/mm.h"
 
-#define PHYS_MAX_PAGES              ((1U << 30) / 0x1000)
+// Largest block is 2^(PHYS_MAX_ORDER - 1) pages (4MiB), blocks never
+// cross section boundaries
+#define PHYS_MAX_ORDER              11
+
+#define PHYS_MAX_ADDR               ((uintptr_t) PHYS_MAX_SECTIONS << PHYS_SECTION_SHIFT)
 
 // Reserve 1MiB at bottom
 #define LOW_BOUND                   0x100000
 
+// Pages each node keeps zeroed in advance by idle threads, zeroing
+// stops when node's free memory drops below PHYS_ZERO_MIN_FREE
+#define PHYS_ZERO_TARGET            256
+#define PHYS_ZERO_MIN_FREE          1024
+
+// Per-CPU page cache limits: once a cache grows above PCP_HIGH pages,
+// PCP_BATCH pages are returned to buddy lists. Refills also take
+// PCP_BATCH pages at once
+#define PCP_HIGH                    64
+#define PCP_BATCH                   16
+
+// Background reclaim is started once free memory drops below
+// 1/PHYS_WATERMARK_DIV of all the pages and runs until it reaches
+// twice that amount
+#define PHYS_WATERMARK_DIV          64
+#define PHYS_WATERMARK_MIN          128
+#define PHYS_WATERMARK_MAX          16384
+// Pages to reclaim synchronously when an allocation fails
+#define PHYS_RECLAIM_BATCH          32
+
 #define MMAP_KIND_RESERVED          0
 #define MMAP_KIND_USABLE            1
 #define MMAP_KIND_UNKNOWN           2
@@ -21,10 +49,47 @@ struct mmap_iter {
     size_t position, limit;
 };
 
-struct page *mm_pages = NULL;
+struct page *mm_sections[PHYS_MAX_SECTIONS] = { NULL };
 static size_t _total_pages, _pages_free;
+static size_t phys_watermark_low, phys_watermark_high;
 static size_t _alloc_pages[_PU_COUNT];
 static spin_t phys_spin = 0;
+
+// Free memory pool of a NUMA node. Systems without SRAT have only
+// node 0 covering all the memory
+static struct phys_node {
+    struct list_head free_areas[PHYS_MAX_ORDER];
+    size_t pages_free;
+    // Allocations requested by CPUs of this node and satisfied
+    // from the node itself/some other node
+    size_t allocs_local, allocs_remote;
+    // Nodes to allocate from, ordered by distance
+    uint8_t fallback[PHYS_MAX_NODES];
+    // Pre-zeroed pages taken out of buddy lists, still
+    // accounted as free
+    struct list_head zero_pages;
+    size_t zero_count;
+} phys_nodes[PHYS_MAX_NODES];
+static size_t phys_node_count = 1;
+static uint8_t phys_section_node[PHYS_MAX_SECTIONS];
+static uint8_t phys_cpu_node[AMD64_MAX_SMP];
+static uint8_t phys_node_distance[PHYS_MAX_NODES][PHYS_MAX_NODES];
+
+// Per-CPU cache of free single pages, serves mm_phys_alloc_page()/
+// mm_phys_free_page() without taking phys_spin
+static struct phys_pcp {
+    spin_t lock;
+    struct list_head pages;
+    size_t count;
+    // Usage accounting done without phys_spin, merged
+    // in mm_phys_stat()
+    ssize_t alloc_pages[_PU_COUNT];
+    // Cached pages always belong to the CPU's node
+    size_t allocs_local;
+} phys_pcp[AMD64_MAX_SMP];
+// Kept to add memory above boot direct mapping later
+static const struct mm_phys_memory_map *phys_mmap;
+static uintptr_t phys_memory_end;
 static struct mm_phys_reserved phys_reserve_mm_pages,
                                phys_reserve_mmap;
 static LIST_HEAD(reserved_regions);
@@ -152,110 +217,679 @@ void mm_phys_reserve(const char *use, struct mm_phys_reserved *res) {
 }
 
 void mm_phys_stat(struct mm_phys_stat *st) {
+    ssize_t alloc_pages[_PU_COUNT];
+    size_t pages_free = _pages_free;
+
+    for (size_t i = 0; i < _PU_COUNT; ++i) {
+        alloc_pages[i] = _alloc_pages[i];
+    }
+    for (size_t cpu = 0; cpu < AMD64_MAX_SMP; ++cpu) {
+        pages_free += phys_pcp[cpu].count;
+        for (size_t i = 0; i < _PU_COUNT; ++i) {
+            alloc_pages[i] += phys_pcp[cpu].alloc_pages[i];
+        }
+    }
+
     st->pages_total = _total_pages;
-    st->pages_free = _pages_free;
-    st->pages_used_kernel = _alloc_pages[PU_KERNEL];
-    st->pages_used_user = _alloc_pages[PU_PRIVATE];
-    st->pages_used_shared = _alloc_pages[PU_SHARED];
-    st->pages_used_paging = _alloc_pages[PU_PAGING];
-    st->pages_used_cache = _alloc_pages[PU_CACHE];
+    st->pages_free = pages_free;
+    st->pages_used_kernel = alloc_pages[PU_KERNEL];
+    st->pages_used_user = alloc_pages[PU_PRIVATE];
+    st->pages_used_shared = alloc_pages[PU_SHARED];
+    st->pages_used_paging = alloc_pages[PU_PAGING];
+    st->pages_used_cache = alloc_pages[PU_CACHE];
+}
+
+size_t mm_phys_node_count(void) {
+    return phys_node_count;
+}
+
+void mm_phys_node_stat(int node, struct mm_phys_node_stat *st) {
+    _assert(node >= 0 && (size_t) node < phys_node_count);
+    struct phys_node *n = &phys_nodes[node];
+
+    st->pages_free = n->pages_free;
+    st->allocs_local = n->allocs_local;
+    st->allocs_remote = n->allocs_remote;
+
+    for (size_t cpu = 0; cpu < AMD64_MAX_SMP; ++cpu) {
+        if (phys_cpu_node[cpu] == node) {
+            st->allocs_local += phys_pcp[cpu].allocs_local;
+            st->pages_free += phys_pcp[cpu].count;
+        }
+    }
+}
+
+int mm_phys_cpu_node(int cpu) {
+    _assert(cpu >= 0 && cpu < AMD64_MAX_SMP);
+    return phys_cpu_node[cpu];
+}
+
+int mm_phys_node(uintptr_t phys) {
+    return phys_section_node[(phys >> PHYS_SECTION_SHIFT) % PHYS_MAX_SECTIONS];
+}
+
+int mm_phys_watermark_ok(void) {
+    return _pages_free >= phys_watermark_high;
 }
 
 uint64_t *amd64_mm_pool_alloc(void) {
     uint64_t *table;
     uintptr_t ptr;
 
-    ptr = mm_phys_alloc_page(PU_PAGING);
+    ptr = mm_phys_alloc_zeroed_page(PU_PAGING);
     _assert(ptr != MM_NADDR);
 
     table = (uint64_t *) MM_VIRTUALIZE(ptr);
-    memset(table, 0, MM_PAGE_SIZE);
     return table;
 }
 
 void amd64_mm_pool_free(uint64_t *p) {
-    memset(p, 0xFF, MM_PAGE_SIZE);
     mm_phys_free_page(MM_PHYS(p));
 }
 
-uintptr_t mm_phys_alloc_page(enum page_usage pu) {
-    _assert(pu < _PU_COUNT && pu != PU_UNKNOWN);
+//// Buddy allocator
 
-    uintptr_t irq;
-    spin_lock_irqsave(&phys_spin, &irq);
+static inline struct phys_node *buddy_node(size_t pfn) {
+    return &phys_nodes[phys_section_node[pfn / PHYS_SECTION_PAGES]];
+}
 
-    for (size_t i = LOW_BOUND >> 12; i < PHYS_MAX_PAGES; ++i) {
-        struct page *pg = &mm_pages[i];
+static inline size_t buddy_order(size_t count) {
+    size_t order = 0;
+    while ((1UL << order) < count) {
+        ++order;
+    }
+    return order;
+}
+
+static inline void buddy_insert(size_t pfn, size_t order) {
+    struct page *pg = mm_pfn_page(pfn);
+    pg->flags |= PG_BUDDY;
+    pg->order = order;
+    list_add(&pg->link, &buddy_node(pfn)->free_areas[order]);
+}
 
-        if (!(pg->flags & PG_ALLOC)) {
-            _assert(pg->usage == PU_UNKNOWN);
-            _assert(pg->refcount == 0);
-            pg->usage = pu;
-            pg->flags |= PG_ALLOC;
-            ++_alloc_pages[pu];
-            _assert(_pages_free);
-            --_pages_free;
+static inline void buddy_remove(size_t pfn) {
+    struct page *pg = mm_pfn_page(pfn);
+    _assert(pg->flags & PG_BUDDY);
+    pg->flags &= ~PG_BUDDY;
+    list_del_init(&pg->link);
+}
 
-            spin_release_irqrestore(&phys_spin, &irq);
-            return i * MM_PAGE_SIZE;
+// Return a block of 2^order pages starting at pfn to free lists,
+// merging it with its buddies while possible
+static void buddy_free(size_t pfn, size_t order) {
+    while (order < PHYS_MAX_ORDER - 1) {
+        // Buddy is always in the same (populated) section
+        size_t buddy_pfn = pfn ^ (1UL << order);
+        struct page *buddy = mm_pfn_page(buddy_pfn);
+        if (!(buddy->flags & PG_BUDDY) || buddy->order != order) {
+            break;
         }
+
+        buddy_remove(buddy_pfn);
+        pfn &= ~(1UL << order);
+        ++order;
     }
 
+    buddy_insert(pfn, order);
+}
+
+// Take a block of 2^order pages from node's free lists, splitting
+// a larger one if needed
+static size_t buddy_alloc_node(struct phys_node *node, size_t order) {
+    size_t avail;
+
+    for (avail = order; avail < PHYS_MAX_ORDER; ++avail) {
+        if (!list_empty(&node->free_areas[avail])) {
+            break;
+        }
+    }
+
+    if (avail == PHYS_MAX_ORDER) {
+        return (size_t) -1;
+    }
+
+    struct page *pg = list_first_entry(&node->free_areas[avail], struct page, link);
+    size_t pfn = mm_page_pfn(pg);
+    buddy_remove(pfn);
+
+    // Return upper halves back to the lists
+    while (avail > order) {
+        --avail;
+        buddy_insert(pfn + (1UL << avail), avail);
+    }
+
+    return pfn;
+}
+
+// Take a block from the nearest node which has one
+static size_t buddy_alloc(size_t order, int node) {
+    struct phys_node *local = &phys_nodes[node];
+    size_t pfn;
+
+    for (size_t i = 0; i < phys_node_count; ++i) {
+        if ((pfn = buddy_alloc_node(&phys_nodes[local->fallback[i]], order)) != (size_t) -1) {
+            if (i == 0) {
+                ++local->allocs_local;
+            } else {
+                ++local->allocs_remote;
+            }
+            return pfn;
+        }
+    }
+
+    return (size_t) -1;
+}
+
+// Free `count' pages starting at `pfn' using the largest
+// naturally aligned blocks possible
+static void buddy_free_range(size_t pfn, size_t count) {
+    while (count) {
+        size_t order = 0;
+        while (order < PHYS_MAX_ORDER - 1 &&
+               !(pfn & ((2UL << order) - 1)) &&
+               (2UL << order) <= count) {
+            ++order;
+        }
+
+        buddy_free(pfn, order);
+        pfn += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+static void phys_pages_claim(size_t pfn, size_t count, enum page_usage pu) {
+    for (size_t i = 0; i < count; ++i) {
+        struct page *pg = mm_pfn_page(pfn + i);
+        _assert(!(pg->flags & PG_ALLOC));
+        _assert(pg->usage == PU_UNKNOWN);
+        _assert(pg->refcount == 0);
+        pg->flags |= PG_ALLOC;
+        pg->usage = pu;
+    }
+
+    buddy_node(pfn)->pages_free -= count;
+    _alloc_pages[pu] += count;
+    _assert(_pages_free >= count);
+    _pages_free -= count;
+}
+
+static void phys_pages_release(size_t pfn, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        struct page *pg = mm_pfn_page(pfn + i);
+        _assert(pg->refcount == 0);
+        _assert(pg->flags & PG_ALLOC);
+        // Not checking _alloc_pages[] here: the page may have been
+        // accounted in a per-CPU cache
+        --_alloc_pages[pg->usage];
+
+        pg->flags &= ~PG_ALLOC;
+        pg->usage = PU_UNKNOWN;
+    }
+
+    buddy_node(pfn)->pages_free += count;
+    _pages_free += count;
+}
+
+//// Per-CPU page caches
+
+static inline int phys_pcp_ready(void) {
+    // %gs-based CPU data is only guaranteed to be set up
+    // on all the CPUs once scheduler is ready
+    return sched_ready;
+}
+
+static inline int phys_pcp_node(struct phys_pcp *pcp) {
+    return phys_cpu_node[pcp - phys_pcp];
+}
+
+// Node of the CPU the caller is running on
+static inline int phys_self_node(void) {
+    if (!phys_pcp_ready()) {
+        return 0;
+    }
+    return phys_cpu_node[get_cpu()->processor_id];
+}
+
+// Move up to `count' pages from buddy lists to the cache
+// Requires pcp->lock to be held
+static size_t phys_pcp_refill(struct phys_pcp *pcp, size_t count) {
+    struct phys_node *node = &phys_nodes[phys_pcp_node(pcp)];
+    uintptr_t irq;
+    size_t pfn, i;
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    // Only local pages are cached, remote ones are allocated
+    // through buddy_alloc() fallback
+    for (i = 0; i < count; ++i) {
+        if ((pfn = buddy_alloc_node(node, 0)) == (size_t) -1) {
+            break;
+        }
+
+        list_add_tail(&mm_pfn_page(pfn)->link, &pcp->pages);
+    }
+    node->pages_free -= i;
+    _pages_free -= i;
+    pcp->count += i;
+
     spin_release_irqrestore(&phys_spin, &irq);
-    return MM_NADDR;
+    return i;
 }
 
-void mm_phys_free_page(uintptr_t addr) {
+// Return up to `count' least recently freed pages to buddy lists
+// Requires pcp->lock to be held
+static void phys_pcp_drain(struct phys_pcp *pcp, size_t count) {
     uintptr_t irq;
     spin_lock_irqsave(&phys_spin, &irq);
 
-    struct page *pg = PHYS2PAGE(addr);
+    while (count-- && pcp->count) {
+        struct page *pg = list_entry(pcp->pages.prev, struct page, link);
+        list_del_init(&pg->link);
+        --pcp->count;
+        ++_pages_free;
+        ++buddy_node(mm_page_pfn(pg))->pages_free;
+
+        buddy_free(mm_page_pfn(pg), 0);
+    }
+
+    spin_release_irqrestore(&phys_spin, &irq);
+}
+
+static void phys_pcp_drain_all(void) {
+    uintptr_t irq;
+
+    for (size_t cpu = 0; cpu < AMD64_MAX_SMP; ++cpu) {
+        struct phys_pcp *pcp = &phys_pcp[cpu];
+        spin_lock_irqsave(&pcp->lock, &irq);
+        phys_pcp_drain(pcp, pcp->count);
+        spin_release_irqrestore(&pcp->lock, &irq);
+    }
+}
+
+static uintptr_t phys_pcp_alloc(enum page_usage pu) {
+    struct phys_pcp *pcp = &phys_pcp[get_cpu()->processor_id];
+    struct page *pg;
+    uintptr_t irq;
+    spin_lock_irqsave(&pcp->lock, &irq);
+
+    if (!pcp->count && !phys_pcp_refill(pcp, PCP_BATCH)) {
+        spin_release_irqrestore(&pcp->lock, &irq);
+        return MM_NADDR;
+    }
+
+    pg = list_first_entry(&pcp->pages, struct page, link);
+    list_del_init(&pg->link);
+    --pcp->count;
+
+    _assert(!(pg->flags & PG_ALLOC));
+    _assert(pg->usage == PU_UNKNOWN);
     _assert(pg->refcount == 0);
-    _assert(pg->flags & PG_ALLOC);
+    pg->flags |= PG_ALLOC;
+    pg->usage = pu;
+    ++pcp->alloc_pages[pu];
+    ++pcp->allocs_local;
+
+    spin_release_irqrestore(&pcp->lock, &irq);
+    return PAGE2PHYS(pg);
+}
+
+// Returns 0 if the page was not cached because it belongs
+// to some other node
+static int phys_pcp_free(uintptr_t addr) {
+    struct phys_pcp *pcp = &phys_pcp[get_cpu()->processor_id];
+    struct page *pg = PHYS2PAGE(addr);
+    uintptr_t irq;
+
+    if (mm_phys_node(addr) != phys_pcp_node(pcp)) {
+        return 0;
+    }
 
-    _assert(_alloc_pages[pg->usage]);
-    --_alloc_pages[pg->usage];
-    ++_pages_free;
+    spin_lock_irqsave(&pcp->lock, &irq);
 
+    _assert(pg->refcount == 0);
+    _assert(pg->flags & PG_ALLOC);
+    --pcp->alloc_pages[pg->usage];
     pg->flags &= ~PG_ALLOC;
     pg->usage = PU_UNKNOWN;
 
+    // Recently freed pages are the first ones to be reused
+    list_add(&pg->link, &pcp->pages);
+    if (++pcp->count > PCP_HIGH) {
+        phys_pcp_drain(pcp, PCP_BATCH);
+    }
+
+    spin_release_irqrestore(&pcp->lock, &irq);
+    return 1;
+}
+
+//// Pre-zeroed pages
+
+// Requires phys_spin to be held
+static uintptr_t phys_zero_take(struct phys_node *node, enum page_usage pu) {
+    struct page *pg;
+    size_t pfn;
+
+    if (!node->zero_count) {
+        return MM_NADDR;
+    }
+
+    pg = list_first_entry(&node->zero_pages, struct page, link);
+    list_del_init(&pg->link);
+    --node->zero_count;
+
+    pfn = mm_page_pfn(pg);
+    phys_pages_claim(pfn, 1, pu);
+    ++node->allocs_local;
+
+    return pfn * MM_PAGE_SIZE;
+}
+
+static void phys_zero_drain_all(void) {
+    uintptr_t irq;
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    for (size_t i = 0; i < phys_node_count; ++i) {
+        struct phys_node *node = &phys_nodes[i];
+
+        while (node->zero_count) {
+            struct page *pg = list_first_entry(&node->zero_pages, struct page, link);
+            list_del_init(&pg->link);
+            --node->zero_count;
+
+            buddy_free(mm_page_pfn(pg), 0);
+        }
+    }
+
     spin_release_irqrestore(&phys_spin, &irq);
 }
 
-uintptr_t mm_phys_alloc_contiguous(size_t count, enum page_usage pu) {
+void mm_phys_zero_idle(void) {
+    struct phys_node *node = &phys_nodes[phys_self_node()];
+    uintptr_t irq;
+    size_t pfn;
+
+    while (1) {
+        spin_lock_irqsave(&phys_spin, &irq);
+
+        if (node->zero_count >= PHYS_ZERO_TARGET ||
+            node->pages_free < PHYS_ZERO_MIN_FREE + node->zero_count) {
+            spin_release_irqrestore(&phys_spin, &irq);
+            break;
+        }
+
+        // The page is in none of the lists while being zeroed,
+        // so nobody else can touch it
+        if ((pfn = buddy_alloc_node(node, 0)) == (size_t) -1) {
+            spin_release_irqrestore(&phys_spin, &irq);
+            break;
+        }
+
+        spin_release_irqrestore(&phys_spin, &irq);
+
+        memset((void *) MM_VIRTUALIZE(pfn * MM_PAGE_SIZE), 0, MM_PAGE_SIZE);
+
+        spin_lock_irqsave(&phys_spin, &irq);
+        list_add(&mm_pfn_page(pfn)->link, &node->zero_pages);
+        ++node->zero_count;
+        spin_release_irqrestore(&phys_spin, &irq);
+    }
+}
+
+////
+
+static void phys_watermarks_update(void) {
+    size_t low = _total_pages / PHYS_WATERMARK_DIV;
+
+    if (low < PHYS_WATERMARK_MIN) {
+        low = PHYS_WATERMARK_MIN;
+    }
+    if (low > PHYS_WATERMARK_MAX) {
+        low = PHYS_WATERMARK_MAX;
+    }
+
+    phys_watermark_low = low;
+    phys_watermark_high = low * 2;
+}
+
+// Wake up background reclaim if free memory is getting low. Pages
+// held in per-CPU caches are not counted, so the check is a bit pessimistic
+static inline void phys_watermark_check(void) {
+    if (_pages_free < phys_watermark_low && phys_pcp_ready()) {
+        mm_reclaim_wakeup();
+    }
+}
+
+// Return pages held in per-CPU caches and zeroed page pools
+// to buddy lists
+static void phys_drain_caches(void) {
+    if (!phys_pcp_ready()) {
+        return;
+    }
+
+    phys_pcp_drain_all();
+    phys_zero_drain_all();
+}
+
+// Synchronously reclaim at least `count' pages from caches,
+// returns zero if nothing could be released
+static int phys_reclaim(size_t count) {
+    if (!phys_pcp_ready()) {
+        return 0;
+    }
+
+    if (count < PHYS_RECLAIM_BATCH) {
+        count = PHYS_RECLAIM_BATCH;
+    }
+    if (!mm_reclaim(count, RECLAIM_DIRECT)) {
+        return 0;
+    }
+
+    // Released pages may have landed in this CPU's cache
+    phys_drain_caches();
+    return 1;
+}
+
+#if defined(ALLOC_PROFILE)
+static const char *const phys_usage_names[_PU_COUNT] = {
+    [PU_UNKNOWN] = "unknown",
+    [PU_PRIVATE] = "private",
+    [PU_SHARED] = "shared",
+    [PU_DEVICE] = "device",
+    [PU_KERNEL] = "kernel",
+    [PU_PAGING] = "paging",
+    [PU_CACHE] = "cache",
+};
+#endif
+
+static uintptr_t phys_alloc_page(enum page_usage pu) {
+    _assert(pu < _PU_COUNT && pu != PU_UNKNOWN);
+
+    int node = phys_self_node();
     uintptr_t irq;
+    uintptr_t res;
+    size_t pfn;
+
+    if (phys_pcp_ready() && (res = phys_pcp_alloc(pu)) != MM_NADDR) {
+        phys_watermark_check();
+        return res;
+    }
+
     spin_lock_irqsave(&phys_spin, &irq);
 
-    for (size_t i = LOW_BOUND >> 12; i < PHYS_MAX_PAGES - count; ++i) {
-        for (size_t j = 0; j < count; ++j) {
-            if (mm_pages[i + j].flags & PG_ALLOC) {
-                goto fail;
+    if ((pfn = buddy_alloc(0, node)) == (size_t) -1) {
+        spin_release_irqrestore(&phys_spin, &irq);
+
+        // Buddy lists are empty, but some pages may still be cached
+        phys_drain_caches();
+        spin_lock_irqsave(&phys_spin, &irq);
+
+        if ((pfn = buddy_alloc(0, node)) == (size_t) -1) {
+            spin_release_irqrestore(&phys_spin, &irq);
+
+            // Ask caches to give some memory back
+            if (!phys_reclaim(1)) {
+                return MM_NADDR;
+            }
+            spin_lock_irqsave(&phys_spin, &irq);
+
+            if ((pfn = buddy_alloc(0, node)) == (size_t) -1) {
+                spin_release_irqrestore(&phys_spin, &irq);
+                return MM_NADDR;
             }
         }
+    }
+    phys_pages_claim(pfn, 1, pu);
+
+    spin_release_irqrestore(&phys_spin, &irq);
+    phys_watermark_check();
+    return pfn * MM_PAGE_SIZE;
+}
+
+uintptr_t mm_phys_alloc_page(enum page_usage pu) {
+    uintptr_t res = phys_alloc_page(pu);
+    alloc_profile_alloc(ALLOC_PAGE, phys_usage_names[pu], alloc_profile_site(), res, MM_PAGE_SIZE);
+    return res;
+}
+
+uintptr_t mm_phys_alloc_zeroed_page(enum page_usage pu) {
+    _assert(pu < _PU_COUNT && pu != PU_UNKNOWN);
 
-        for (size_t j = 0; j < count; ++j) {
-            _assert(!mm_pages[i + j].refcount);
-            mm_pages[i + j].flags |= PG_ALLOC;
-            mm_pages[i + j].usage = pu;
+    uintptr_t irq;
+    uintptr_t res;
+
+    if (phys_pcp_ready()) {
+        spin_lock_irqsave(&phys_spin, &irq);
+        res = phys_zero_take(&phys_nodes[phys_self_node()], pu);
+        spin_release_irqrestore(&phys_spin, &irq);
 
-            ++_alloc_pages[pu];
-            _assert(_pages_free);
-            --_pages_free;
+        if (res != MM_NADDR) {
+            // Pool pages are free memory until taken, like any other
+            phys_watermark_check();
+            alloc_profile_alloc(ALLOC_PAGE, phys_usage_names[pu], alloc_profile_site(), res, MM_PAGE_SIZE);
+            return res;
         }
+    }
 
+    // Pool is empty, zero the page synchronously
+    if ((res = phys_alloc_page(pu)) != MM_NADDR) {
+        memset((void *) MM_VIRTUALIZE(res), 0, MM_PAGE_SIZE);
+    }
+    alloc_profile_alloc(ALLOC_PAGE, phys_usage_names[pu], alloc_profile_site(), res, MM_PAGE_SIZE);
+    return res;
+}
+
+void mm_phys_free_page(uintptr_t addr) {
+    uintptr_t irq;
+    size_t pfn = addr / MM_PAGE_SIZE;
+    _assert(!(addr & MM_PAGE_OFFSET_MASK));
+
+    // A contiguous range released page by page is accounted
+    // as freed along with its first page
+    alloc_profile_free(addr);
+
+    if (phys_pcp_ready() && phys_pcp_free(addr)) {
+        return;
+    }
+
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    phys_pages_release(pfn, 1);
+    buddy_free(pfn, 0);
+
+    spin_release_irqrestore(&phys_spin, &irq);
+}
+
+static uintptr_t phys_alloc_contiguous(size_t count, enum page_usage pu) {
+    _assert(pu < _PU_COUNT && pu != PU_UNKNOWN);
+    _assert(count);
+
+    size_t order = buddy_order(count);
+    int node = phys_self_node();
+    uintptr_t irq;
+    size_t pfn;
+
+    if (order >= PHYS_MAX_ORDER) {
+        kwarn("Contiguous allocation of %u pages exceeds max. block size\n", count);
+        return MM_NADDR;
+    }
+
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    if ((pfn = buddy_alloc(order, node)) == (size_t) -1) {
         spin_release_irqrestore(&phys_spin, &irq);
-        return i * MM_PAGE_SIZE;
-fail:
-        continue;
+
+        // Cached pages may complete a block
+        phys_drain_caches();
+        spin_lock_irqsave(&phys_spin, &irq);
+
+        if ((pfn = buddy_alloc(order, node)) == (size_t) -1) {
+            spin_release_irqrestore(&phys_spin, &irq);
+
+            // Released pages are not guaranteed to form a block
+            // of the requested order, so try only once
+            if (!phys_reclaim(1UL << order)) {
+                return MM_NADDR;
+            }
+            spin_lock_irqsave(&phys_spin, &irq);
+
+            if ((pfn = buddy_alloc(order, node)) == (size_t) -1) {
+                spin_release_irqrestore(&phys_spin, &irq);
+                return MM_NADDR;
+            }
+        }
     }
+
+    // Trim the block if count is not a power of two
+    if ((1UL << order) != count) {
+        buddy_free_range(pfn + count, (1UL << order) - count);
+    }
+    phys_pages_claim(pfn, count, pu);
+
+    spin_release_irqrestore(&phys_spin, &irq);
+    phys_watermark_check();
+    return pfn * MM_PAGE_SIZE;
+}
+
+uintptr_t mm_phys_alloc_contiguous(size_t count, enum page_usage pu) {
+    uintptr_t res = phys_alloc_contiguous(count, pu);
+    alloc_profile_alloc(ALLOC_PAGE, phys_usage_names[pu], alloc_profile_site(), res, count * MM_PAGE_SIZE);
+    return res;
+}
+
+uintptr_t mm_phys_alloc_huge_page(enum page_usage pu) {
+    // Buddy blocks are naturally aligned
+    uintptr_t addr = phys_alloc_contiguous(MM_HUGE_PAGE_COUNT, pu);
+    if (addr != MM_NADDR) {
+        PHYS2PAGE(addr)->flags |= PG_HUGE;
+    }
+    alloc_profile_alloc(ALLOC_PAGE, phys_usage_names[pu], alloc_profile_site(), addr, MM_HUGE_PAGE_SIZE);
+    return addr;
+}
+
+void mm_phys_free_huge_page(uintptr_t addr) {
+    struct page *head = PHYS2PAGE(addr);
+    _assert(head && (head->flags & PG_HUGE));
+    head->flags &= ~(PG_HUGE | PG_MMAPED);
+    mm_phys_free_contiguous(addr, MM_HUGE_PAGE_COUNT);
+}
+
+void mm_phys_free_contiguous(uintptr_t addr, size_t count) {
+    uintptr_t irq;
+    size_t pfn = addr / MM_PAGE_SIZE;
+    _assert(!(addr & MM_PAGE_OFFSET_MASK));
+
+    alloc_profile_free(addr);
+
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    phys_pages_release(pfn, count);
+    buddy_free_range(pfn, count);
+
     spin_release_irqrestore(&phys_spin, &irq);
-    return MM_NADDR;
 }
 
 static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t req_count) {
     struct mmap_iter iter;
-    size_t item_offset;
     uintptr_t base;
     size_t size;
     int kind;
@@ -266,6 +900,11 @@ static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t re
         uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
         uintptr_t page_aligned_end = (base + size) & ~0xFFF;
 
+        // Metadata has to be accessible before direct mapping is extended
+        if (page_aligned_end > PHYS_BOOT_DIRECT_LIMIT) {
+            page_aligned_end = PHYS_BOOT_DIRECT_LIMIT;
+        }
+
         if (kind == MMAP_KIND_USABLE && page_aligned_end > page_aligned_begin) {
             // Something like mm_phys_alloc_contiguous does, but
             // we don't yet have it obviously
@@ -293,59 +932,250 @@ static uintptr_t place_mm_pages(const struct mm_phys_memory_map *mmap, size_t re
     return MM_NADDR;
 }
 
+// Add usable pages in [lo; hi) to buddy lists
+static void phys_add_usable(const struct mm_phys_memory_map *mmap, uintptr_t lo, uintptr_t hi) {
+    extern char _kernel_end;
+    struct mmap_iter iter;
+    uintptr_t base;
+    size_t size;
+    size_t count = 0;
+    int kind;
+
+    mmap_iter_init(mmap, &iter);
+
+    while (mmap_iter_next(&iter, &kind, &base, &size)) {
+        uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
+        uintptr_t page_aligned_end = (base + size) & ~0xFFF;
+
+        if (kind == MMAP_KIND_USABLE && page_aligned_end > page_aligned_begin + 0x1000) {
+            //kdebug("+++ %S @ %p\n", page_aligned_end - page_aligned_begin, page_aligned_begin);
+
+            if (page_aligned_begin < lo) {
+                page_aligned_begin = lo;
+            }
+            if (page_aligned_end > hi) {
+                page_aligned_end = hi;
+            }
+
+            for (uintptr_t addr = page_aligned_begin; addr < page_aligned_end; addr += 0x1000) {
+                if (addr < LOW_BOUND) {
+                    continue;
+                }
+
+                if (!is_reserved(addr) && addr >= (MM_PHYS(&_kernel_end) + 0x1000)) {
+                    struct page *pg = PHYS2PAGE(addr);
+                    _assert(pg);
+                    pg->flags &= ~PG_ALLOC;
+                    pg->usage = PU_UNKNOWN;
+                    pg->refcount = 0;
+                    buddy_free(addr / MM_PAGE_SIZE, 0);
+                    ++buddy_node(addr / MM_PAGE_SIZE)->pages_free;
+                    ++count;
+                }
+            }
+        }
+    }
+
+    _total_pages += count;
+    _pages_free += count;
+}
+
 void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap) {
     struct mmap_iter iter;
     uintptr_t base;
     size_t size;
+    size_t section_count = 0;
     int kind;
 
     phys_reserve_mmap.begin = (uintptr_t) MM_PHYS(mmap->address);
     phys_reserve_mmap.end = phys_reserve_mmap.begin + mmap->entry_count * mmap->entry_size;
     mm_phys_reserve("Memory map", &phys_reserve_mmap);
 
-    // Allocate space for mm_pages array
-    size_t mm_pages_req_count = (PHYS_MAX_PAGES * sizeof(struct page) + 0xFFF) >> 12;
+    phys_mmap = mmap;
+    phys_memory_end = 0;
+
+    // Find out which sections need page metadata. Non-NULL value is only
+    // used as a marker here, actual arrays are placed below
+    mmap_iter_init(mmap, &iter);
+    while (mmap_iter_next(&iter, &kind, &base, &size)) {
+        uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
+        uintptr_t page_aligned_end = (base + size) & ~0xFFF;
+
+        if (kind != MMAP_KIND_USABLE || page_aligned_end <= page_aligned_begin) {
+            continue;
+        }
+
+        if (page_aligned_end > PHYS_MAX_ADDR) {
+            kwarn("Ignoring memory above %S\n", PHYS_MAX_ADDR);
+            page_aligned_end = PHYS_MAX_ADDR;
+            if (page_aligned_end <= page_aligned_begin) {
+                continue;
+            }
+        }
+        if (page_aligned_end > phys_memory_end) {
+            phys_memory_end = page_aligned_end;
+        }
+
+        for (size_t sec = page_aligned_begin >> PHYS_SECTION_SHIFT;
+             sec <= (page_aligned_end - 1) >> PHYS_SECTION_SHIFT; ++sec) {
+            if (!mm_sections[sec]) {
+                mm_sections[sec] = (struct page *) -1;
+                ++section_count;
+            }
+        }
+    }
+    _assert(section_count);
+
+    // Allocate space for section page arrays
+    size_t mm_pages_req_count = (section_count * PHYS_SECTION_PAGES * sizeof(struct page) + 0xFFF) >> 12;
     uintptr_t mm_pages_addr = place_mm_pages(mmap, mm_pages_req_count);
     _assert(mm_pages_addr != MM_NADDR);
 
-    kdebug("Placing mm_pages (%u) at %p\n", mm_pages_req_count, mm_pages_addr);
+    kdebug("Placing mm_pages (%u, %u sections) at %p\n", mm_pages_req_count, section_count, mm_pages_addr);
     phys_reserve_mm_pages.begin = mm_pages_addr;
     phys_reserve_mm_pages.end = mm_pages_addr + mm_pages_req_count * MM_PAGE_SIZE;
     // TODO: also reserve memory map itself before screwing with it?
     mm_phys_reserve("mm_pages", &phys_reserve_mm_pages);
 
-    mm_pages = (struct page *) MM_VIRTUALIZE(mm_pages_addr);
-    for (size_t i = 0; i < PHYS_MAX_PAGES; ++i) {
-        mm_pages[i].flags = PG_ALLOC;
-        mm_pages[i].refcount = (size_t) -1L;
+    struct page *pages = (struct page *) MM_VIRTUALIZE(mm_pages_addr);
+    for (size_t sec = 0; sec < PHYS_MAX_SECTIONS; ++sec) {
+        if (!mm_sections[sec]) {
+            continue;
+        }
+
+        mm_sections[sec] = pages;
+        for (size_t i = 0; i < PHYS_SECTION_PAGES; ++i) {
+            pages[i].flags = PG_ALLOC | ((uint64_t) sec << PG_SECTION_SHIFT);
+            pages[i].refcount = (size_t) -1L;
+            list_head_init(&pages[i].link);
+        }
+        pages += PHYS_SECTION_PAGES;
+    }
+    for (size_t i = 0; i < PHYS_MAX_ORDER; ++i) {
+        list_head_init(&phys_nodes[0].free_areas[i]);
+    }
+    list_head_init(&phys_nodes[0].zero_pages);
+    phys_nodes[0].fallback[0] = 0;
+    for (size_t i = 0; i < AMD64_MAX_SMP; ++i) {
+        list_head_init(&phys_pcp[i].pages);
     }
 
     _total_pages = 0;
-    mmap_iter_init(mmap, &iter);
+    _pages_free = 0;
 
-    // Collect usable physical memory information
-    while (mmap_iter_next(&iter, &kind, &base, &size)) {
-        uintptr_t page_aligned_begin = (base + 0xFFF) & ~0xFFF;
-        uintptr_t page_aligned_end = (base + size) & ~0xFFF;
+    // Memory above boot direct mapping is added once it's mapped,
+    // see amd64_phys_memory_map_high()
+    phys_add_usable(mmap, 0, PHYS_BOOT_DIRECT_LIMIT);
+    phys_watermarks_update();
 
-        if (kind == MMAP_KIND_USABLE && page_aligned_end > page_aligned_begin + 0x1000) {
-            //kdebug("+++ %S @ %p\n", page_aligned_end - page_aligned_begin, page_aligned_begin);
+    kdebug("%S available\n", _total_pages << 12);
+}
 
-            for (uintptr_t addr = page_aligned_begin; addr < page_aligned_end; addr += 0x1000) {
-                extern char _kernel_end;
+uintptr_t amd64_phys_memory_end(void) {
+    return phys_memory_end;
+}
 
-                if (!is_reserved(addr) && addr >= (MM_PHYS(&_kernel_end) + 0x1000)) {
-                    struct page *pg = PHYS2PAGE(addr);
-                    pg->flags &= ~PG_ALLOC;
-                    pg->usage = PU_UNKNOWN;
-                    pg->refcount = 0;
-                    ++_total_pages;
-                }
+void amd64_phys_memory_map_high(void) {
+    uintptr_t irq;
+
+    if (phys_memory_end <= PHYS_BOOT_DIRECT_LIMIT) {
+        return;
+    }
+
+    spin_lock_irqsave(&phys_spin, &irq);
+    phys_add_usable(phys_mmap, PHYS_BOOT_DIRECT_LIMIT, phys_memory_end);
+    phys_watermarks_update();
+    spin_release_irqrestore(&phys_spin, &irq);
+
+    kdebug("%S available\n", _total_pages << 12);
+}
+
+//// NUMA setup
+
+void amd64_phys_numa_range(uintptr_t begin, uintptr_t end, int node) {
+    _assert(node >= 0 && node < PHYS_MAX_NODES);
+
+    if (end > PHYS_MAX_ADDR) {
+        end = PHYS_MAX_ADDR;
+    }
+
+    // Sections are assigned to the range which contains their beginning
+    for (uintptr_t addr = (begin + (1UL << PHYS_SECTION_SHIFT) - 1) & ~((1UL << PHYS_SECTION_SHIFT) - 1);
+         addr < end; addr += 1UL << PHYS_SECTION_SHIFT) {
+        phys_section_node[addr >> PHYS_SECTION_SHIFT] = node;
+    }
+}
+
+void amd64_phys_numa_cpu(int cpu, int node) {
+    _assert(cpu >= 0 && cpu < AMD64_MAX_SMP);
+    _assert(node >= 0 && node < PHYS_MAX_NODES);
+    phys_cpu_node[cpu] = node;
+}
+
+void amd64_phys_numa_distance(int from, int to, uint8_t distance) {
+    _assert(from >= 0 && from < PHYS_MAX_NODES);
+    _assert(to >= 0 && to < PHYS_MAX_NODES);
+    phys_node_distance[from][to] = distance;
+}
+
+void amd64_phys_numa_commit(size_t node_count) {
+    struct list_head blocks[PHYS_MAX_ORDER];
+    uintptr_t irq;
+
+    _assert(node_count && node_count <= PHYS_MAX_NODES);
+    spin_lock_irqsave(&phys_spin, &irq);
+
+    // Take all the free blocks out of node 0 pool
+    for (size_t order = 0; order < PHYS_MAX_ORDER; ++order) {
+        list_head_init(&blocks[order]);
+        if (!list_empty(&phys_nodes[0].free_areas[order])) {
+            blocks[order].next = phys_nodes[0].free_areas[order].next;
+            blocks[order].prev = phys_nodes[0].free_areas[order].prev;
+            blocks[order].next->prev = &blocks[order];
+            blocks[order].prev->next = &blocks[order];
+            list_head_init(&phys_nodes[0].free_areas[order]);
+        }
+    }
+
+    phys_node_count = node_count;
+    for (size_t i = 0; i < node_count; ++i) {
+        struct phys_node *node = &phys_nodes[i];
+
+        if (i != 0) {
+            for (size_t order = 0; order < PHYS_MAX_ORDER; ++order) {
+                list_head_init(&node->free_areas[order]);
+            }
+            list_head_init(&node->zero_pages);
+        }
+        node->pages_free = 0;
+
+        // Sort other nodes by distance
+        for (size_t j = 0; j < node_count; ++j) {
+            size_t k = j;
+            while (k && phys_node_distance[i][node->fallback[k - 1]] > phys_node_distance[i][j]) {
+                node->fallback[k] = node->fallback[k - 1];
+                --k;
             }
+            node->fallback[k] = j;
         }
     }
 
-    _pages_free = _total_pages;
+    // Blocks never cross section boundaries, so they can be put
+    // into node pools as they are
+    for (size_t order = 0; order < PHYS_MAX_ORDER; ++order) {
+        while (!list_empty(&blocks[order])) {
+            struct page *pg = list_first_entry(&blocks[order], struct page, link);
+            size_t pfn = mm_page_pfn(pg);
 
-    kdebug("%S available\n", _total_pages << 12);
+            buddy_remove(pfn);
+            buddy_insert(pfn, order);
+            buddy_node(pfn)->pages_free += 1UL << order;
+        }
+    }
+
+    spin_release_irqrestore(&phys_spin, &irq);
+
+    for (size_t i = 0; i < node_count; ++i) {
+        kdebug("NUMA node %u: %S free\n", i, phys_nodes[i].pages_free << 12);
+    }
 }
@@ -0,0 +1,440 @@
+// Cross-CPU TLB invalidation and address space switching
+//
+// Every process keeps a mask of CPUs which have its address space
+// loaded in %cr3 (space_cpus) and their count (space_refs), maintained
+// by tlb_switch(). Changes to a user space only have to reach those
+// CPUs, changes to the kernel one reach all of them.
+//
+// Kernel threads don't have a user space of their own: a CPU switching
+// to one keeps the space of the last user process it ran loaded
+// ("active"), so coming back to that process costs no TLB refill. The
+// CPU stays in the mask of that process meanwhile and takes part in its
+// shootdowns. Before the page tables of a process are freed, the CPUs
+// still borrowing its space are made to load the kernel one, see
+// tlb_release().
+//
+// Only one invalidation request is in flight at a time. Its initiator
+// sends IPI_VECTOR_TLB to the targets and spins until each of them
+// has cleared its bit in tlb_pending. Interrupts may be disabled on
+// either side (page faults run with IF=0), so CPUs waiting to send
+// a request of their own keep serving the one in flight.
+//
+// If the CPUs support PCIDs, translations of a space survive switching
+// away from it. Each CPU hands out PCIDs 1..4095 to the spaces it runs
+// in order, stamping them with its current generation; once they run
+// out, a new generation starts and all the older stamps become invalid.
+// A space keeps its PCID as long as the stamp is valid and is switched
+// to without flushing, a new PCID is flushed when first loaded. The
+// kernel space only ever uses PCID 0. As CPUs which have switched away
+// are not sent invalidation requests, a shootdown drops the stamps of
+// the space on all of them instead.
+#include "arch/amd64/smp/smp.h"
+#include "arch/amd64/smp/ipi.h"
+#include "arch/amd64/cpuid.h"
+#include "arch/amd64/cpu.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
+#include "sys/assert.h"
+#include "sys/thread.h"
+#include "sys/debug.h"
+#include "sys/mm.h"
+
+#define CR4_PGE                 (1 << 7)
+#define CR4_PCIDE               (1 << 17)
+// Keep the TLB entries of the PCID being loaded
+#define CR3_NOFLUSH             (1ULL << 63)
+#define CR3_PCID_MASK           0xFFFULL
+
+#define TLB_PCID_COUNT          4096
+
+#if defined(AMD64_SMP)
+static struct {
+    // Space to invalidate, 0 for the kernel one
+    uintptr_t cr3;
+    uintptr_t start, end;
+    // If set, the request is to stop using the space of the process
+    // instead, see tlb_release()
+    struct process *release;
+} tlb_request;
+static volatile uint64_t tlb_pending = 0;
+static volatile int tlb_busy = 0;
+#endif
+
+static int tlb_pcid = 0;
+static struct tlb_cpu {
+    // Process whose space is loaded, NULL for the kernel one
+    struct process *active;
+    uint64_t generation;
+    uint64_t next_pcid;
+} tlb_cpus[AMD64_MAX_SMP];
+
+void amd64_tlb_init(void) {
+    size_t cpu = get_cpu()->processor_id;
+    uintptr_t cr4;
+
+    tlb_cpus[cpu].generation = 1;
+    tlb_cpus[cpu].next_pcid = 1;
+
+    if (!(cpuid_features_ecx & CPUID_ECX_FEATURE_PCID)) {
+        return;
+    }
+
+    // %cr3 must have PCID 0 here, which is the case as long as
+    // nothing has been switched to yet
+    asm volatile ("movq %%cr4, %0; orq %1, %0; movq %0, %%cr4":"=&r"(cr4):"i"(CR4_PCIDE):"memory");
+    if (!cpu) {
+        tlb_pcid = 1;
+        kinfo("Using PCIDs for address spaces\n");
+    }
+}
+
+// Drop all the translations of all PCIDs, toggling CR4.PGE does that
+static void tlb_flush_all(void) {
+    uintptr_t cr4;
+
+    asm volatile ("movq %%cr4, %0":"=r"(cr4));
+    asm volatile ("movq %0, %%cr4"::"r"(cr4 ^ CR4_PGE):"memory");
+    asm volatile ("movq %0, %%cr4"::"r"(cr4):"memory");
+}
+
+static void tlb_flush_local(int kernel, uintptr_t start, uintptr_t end) {
+    uintptr_t cr3;
+
+    if (kernel && tlb_pcid) {
+        // Kernel mappings are not global, so every PCID has its own
+        // copies of them
+        tlb_flush_all();
+        return;
+    }
+
+    if ((end - start) / MM_PAGE_SIZE > TLB_FLUSH_MAX_PAGES) {
+        // No global pages are used, reloading %cr3 without
+        // CR3_NOFLUSH drops everything of the current PCID
+        asm volatile ("movq %%cr3, %0; movq %0, %%cr3":"=r"(cr3)::"memory");
+        return;
+    }
+
+    for (uintptr_t addr = start; addr < end; addr += MM_PAGE_SIZE) {
+        asm volatile ("invlpg (%0)"::"r"(addr):"memory");
+    }
+}
+
+// PCID for the space on this CPU, with CR3_NOFLUSH if its
+// translations are still valid
+static uint64_t tlb_pcid_get(struct process *proc, size_t cpu) {
+    struct tlb_cpu *tc = &tlb_cpus[cpu];
+    uint64_t stamp = proc->space_pcid[cpu];
+
+    if (stamp && stamp / TLB_PCID_COUNT == tc->generation) {
+        return (stamp & CR3_PCID_MASK) | CR3_NOFLUSH;
+    }
+
+    if (tc->next_pcid == TLB_PCID_COUNT) {
+        ++tc->generation;
+        tc->next_pcid = 1;
+    }
+    stamp = tc->generation * TLB_PCID_COUNT + tc->next_pcid++;
+    proc->space_pcid[cpu] = stamp;
+
+    return stamp & CR3_PCID_MASK;
+}
+
+// Make CPUs which have switched away from the space drop what they still
+// have cached under its PCIDs when they switch back. This must happen
+// before the CPUs to send an invalidation request to are picked, see
+// tlb_switch()
+static void tlb_pcid_drop(const struct process *proc, int loaded) {
+    size_t self = get_cpu()->processor_id;
+    // Only the TLB bookkeeping of the process is modified
+    uint64_t *stamps = ((struct process *) proc)->space_pcid;
+
+    if (!tlb_pcid) {
+        return;
+    }
+
+    for (size_t i = 0; i < AMD64_MAX_SMP; ++i) {
+        if (i != self || !loaded) {
+            stamps[i] = 0;
+        }
+    }
+}
+
+// Stop using the active space, loading the kernel one
+static void tlb_leave(size_t cpu) {
+    struct process *prev = tlb_cpus[cpu].active;
+    uintptr_t cr3 = MM_PHYS(mm_kernel);
+
+    _assert(prev);
+    if (tlb_pcid) {
+        cr3 |= CR3_NOFLUSH;
+    }
+    asm volatile ("movq %0, %%cr3"::"r"(cr3):"memory");
+
+    tlb_cpus[cpu].active = NULL;
+    __sync_fetch_and_and(&prev->space_cpus, ~(1ULL << cpu));
+    _assert(__sync_fetch_and_sub(&prev->space_refs, 1) > 0);
+}
+
+void tlb_switch(struct process *to) {
+    size_t cpu = get_cpu()->processor_id;
+    struct tlb_cpu *tc = &tlb_cpus[cpu];
+    struct process *prev;
+    uintptr_t rflags, cr3;
+
+    if (!to || to->space == mm_kernel || tc->active == to) {
+        // Kernel threads run in whatever space is loaded
+        return;
+    }
+
+    // An invalidation request must not be served between publishing
+    // the switch and loading %cr3
+    asm volatile ("pushfq; popq %0; cli":"=r"(rflags)::"memory");
+
+    if ((prev = tc->active)) {
+        __sync_fetch_and_and(&prev->space_cpus, ~(1ULL << cpu));
+        _assert(__sync_fetch_and_sub(&prev->space_refs, 1) > 0);
+    }
+    tc->active = to;
+    __sync_fetch_and_add(&to->space_refs, 1);
+    __sync_fetch_and_or(&to->space_cpus, 1ULL << cpu);
+
+    cr3 = MM_PHYS(to->space);
+    if (tlb_pcid) {
+        cr3 |= tlb_pcid_get(to, cpu);
+    }
+    asm volatile ("movq %0, %%cr3"::"r"(cr3):"memory");
+
+    if (rflags & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+#if defined(AMD64_SMP)
+void amd64_ipi_tlb(void) {
+    size_t cpu = get_cpu()->processor_id;
+    uint64_t bit = 1ULL << cpu;
+    uintptr_t cr3;
+
+    if (!(tlb_pending & bit)) {
+        // Already served while waiting to send a request
+        return;
+    }
+
+    if (tlb_request.release) {
+        if (tlb_cpus[cpu].active == tlb_request.release) {
+            tlb_leave(cpu);
+        }
+    } else {
+        asm volatile ("movq %%cr3, %0":"=r"(cr3));
+        if (!tlb_request.cr3 || tlb_request.cr3 == (cr3 & MM_PAGE_MASK)) {
+            tlb_flush_local(!tlb_request.cr3, tlb_request.start, tlb_request.end);
+        }
+    }
+
+    __sync_fetch_and_and(&tlb_pending, ~bit);
+}
+
+// Send the request in tlb_request to the CPUs and wait for them
+static void tlb_send(uint64_t targets) {
+    for (size_t i = 0; i < smp_ncpus; ++i) {
+        if (targets & (1ULL << i)) {
+            amd64_ipi_send(i, IPI_VECTOR_TLB);
+        }
+    }
+
+    while (tlb_pending) {
+        asm volatile ("pause");
+    }
+}
+
+// Serve requests of others until ours may be sent
+static void tlb_lock(uintptr_t *rflags) {
+    asm volatile ("pushfq; popq %0; cli":"=r"(*rflags)::"memory");
+
+    while (__sync_lock_test_and_set(&tlb_busy, 1)) {
+        amd64_ipi_tlb();
+        asm volatile ("pause");
+    }
+}
+
+static void tlb_unlock(uintptr_t *rflags) {
+    __sync_lock_release(&tlb_busy);
+
+    if (*rflags & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+// Other CPUs which may have translations of the space cached
+static uint64_t tlb_targets(const struct process *proc) {
+    uint64_t self = 1ULL << get_cpu()->processor_id;
+    uint64_t mask = 0;
+
+    // Page table changes must be visible before the mask is read:
+    // a CPU which is not in it yet will walk the new tables
+    __sync_synchronize();
+
+    if (!proc || proc->space == mm_kernel) {
+        for (size_t i = 0; i < smp_ncpus; ++i) {
+            if (cpus[i].flags & CPU_READY) {
+                mask |= 1ULL << i;
+            }
+        }
+    } else {
+        mask = proc->space_cpus;
+    }
+
+    return mask & ~self;
+}
+#endif
+
+void tlb_shootdown(const struct process *proc, uintptr_t start, uintptr_t end) {
+    int kernel = !proc || proc->space == mm_kernel;
+    int loaded;
+    uintptr_t cr3;
+
+    if (start >= end) {
+        return;
+    }
+    start &= MM_PAGE_MASK;
+
+    asm volatile ("movq %%cr3, %0":"=r"(cr3));
+    loaded = !kernel && MM_PHYS(proc->space) == (cr3 & MM_PAGE_MASK);
+    if (kernel || loaded) {
+        tlb_flush_local(kernel, start, end);
+    }
+    if (!kernel) {
+        tlb_pcid_drop(proc, loaded);
+    }
+
+#if defined(AMD64_SMP)
+    uint64_t targets;
+    uintptr_t rflags;
+
+    if (!(targets = tlb_targets(proc))) {
+        return;
+    }
+
+    tlb_lock(&rflags);
+
+    tlb_request.cr3 = kernel ? 0 : MM_PHYS(proc->space);
+    tlb_request.start = start;
+    tlb_request.end = end;
+    tlb_request.release = NULL;
+    __sync_synchronize();
+    tlb_pending = targets;
+    tlb_send(targets);
+
+    tlb_unlock(&rflags);
+#endif
+}
+
+void tlb_release(struct process *proc) {
+    size_t cpu = get_cpu()->processor_id;
+    uintptr_t rflags;
+
+    asm volatile ("pushfq; popq %0; cli":"=r"(rflags)::"memory");
+    if (tlb_cpus[cpu].active == proc) {
+        tlb_leave(cpu);
+    }
+    if (rflags & (1 << 9)) {
+        asm volatile ("sti");
+    }
+
+#if defined(AMD64_SMP)
+    uint64_t targets;
+
+    // Only CPUs running kernel threads may still have it loaded
+    if ((targets = tlb_targets(proc))) {
+        tlb_lock(&rflags);
+
+        tlb_request.release = proc;
+        __sync_synchronize();
+        tlb_pending = targets;
+        tlb_send(targets);
+
+        tlb_unlock(&rflags);
+    }
+#endif
+
+    _assert(!proc->space_refs);
+    // The space may be handed over to another process (vfork()), which
+    // must not find its translations under the PCIDs of this one
+    tlb_pcid_drop(proc, 0);
+}
+
+void tlb_space_lock(struct process *proc, uintptr_t *rflags) {
+    asm volatile ("pushfq; popq %0; cli":"=r"(*rflags)::"memory");
+
+    while (__sync_lock_test_and_set(&proc->space_lock, 1)) {
+#if defined(AMD64_SMP)
+        amd64_ipi_tlb();
+#endif
+        asm volatile ("pause");
+    }
+}
+
+void tlb_space_unlock(struct process *proc, uintptr_t *rflags) {
+    __sync_lock_release(&proc->space_lock);
+
+    if (*rflags & (1 << 9)) {
+        asm volatile ("sti");
+    }
+}
+
+void tlb_batch_init(struct tlb_batch *batch, const struct process *proc) {
+    batch->proc = proc;
+    batch->start = MM_NADDR;
+    batch->end = 0;
+    batch->count = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t start, uintptr_t end) {
+    if (start < batch->start) {
+        batch->start = start;
+    }
+    if (end > batch->end) {
+        batch->end = end;
+    }
+}
+
+static void tlb_batch_release(uintptr_t page) {
+    if (page & 1) {
+        mm_phys_free_huge_page(page & ~1);
+    } else {
+        mm_phys_free_page(page);
+    }
+}
+
+void tlb_batch_free(struct tlb_batch *batch, uintptr_t phys, int huge) {
+    uintptr_t page = phys | (huge ? 1 : 0);
+    uintptr_t cr3;
+
+    if (batch->proc && batch->proc->space != mm_kernel) {
+        asm volatile ("movq %%cr3, %0":"=r"(cr3));
+        tlb_pcid_drop(batch->proc, MM_PHYS(batch->proc->space) == (cr3 & MM_PAGE_MASK));
+    }
+
+#if defined(AMD64_SMP)
+    if (tlb_targets(batch->proc) || (tlb_pcid && (!batch->proc || batch->proc->space == mm_kernel))) {
+        if (batch->count == TLB_BATCH_PAGES) {
+            tlb_batch_flush(batch);
+        }
+        batch->pages[batch->count++] = page;
+        return;
+    }
+#endif
+
+    // The page has been invalidated here by mm_umap_single()
+    tlb_batch_release(page);
+}
+
+void tlb_batch_flush(struct tlb_batch *batch) {
+    tlb_shootdown(batch->proc, batch->start, batch->end);
+
+    for (size_t i = 0; i < batch->count; ++i) {
+        tlb_batch_release(batch->pages[i]);
+    }
+
+    tlb_batch_init(batch, batch->proc);
+}
@@ -1,6 +1,7 @@
 #include "arch/amd64/mm/map.h"
 #include "sys/mem/vmalloc.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
 #include "sys/assert.h"
 #include "sys/debug.h"
 #include "sys/panic.h"
@@ -27,11 +28,21 @@ no_match:
 }
 
 void vmfree(mm_space_t pml4, uintptr_t addr, size_t npages) {
+    struct tlb_batch batch;
     uintptr_t phys;
+
+    // Kernel mappings are cached by every CPU under every PCID, the pages
+    // are only freed once all of them are invalidated. This also covers
+    // any user space
+    tlb_batch_init(&batch, NULL);
+    tlb_batch_add(&batch, addr, addr + npages * MM_PAGE_SIZE);
+
     for (size_t i = 0; i < npages; ++i) {
         if ((phys = mm_umap_single(pml4, addr + i * MM_PAGE_SIZE, 1)) == MM_NADDR) {
             panic("Double vmfree error: %p is not an allocated page\n", addr + i * MM_PAGE_SIZE);
         }
-        mm_phys_free_page(phys);
+        tlb_batch_free(&batch, phys, 0);
     }
+
+    tlb_batch_flush(&batch);
 }
@@ -15,7 +15,6 @@
 #define SMP_AP_BOOTSTRAP_CODE       0x7000
 #define SMP_AP_BOOTSTRAP_DATA       0x7FC0
 
-#define CPU_READY                   (1 << 0)
 
 struct ap_param_block {
     uint64_t cr3;
@@ -63,6 +62,7 @@ static void amd64_ap_code_entry(void) {
 
     // Enable FPU
     amd64_fpu_init();
+    amd64_tlb_init();
 
     // Enable LAPIC timer
     amd64_timer_init();
@@ -96,6 +96,7 @@ void *syscall_table[256] = {
     // Process control
     [SYSCALL_NRX_SIGENTRY] =        sys_sigentry,
     [SYSCALL_NR_EXECVE] =           sys_execve,
+    [SYSCALL_NRX_SPAWN] =           sys_spawn,
     [SYSCALL_NR_YIELD] =            sys_yield,
     [SYSCALL_NR_GETPID] =           sys_getpid,
     [SYSCALL_NR_CLONE] =            sys_clone,
@@ -112,6 +113,7 @@ void *syscall_table[256] = {
     // Shared memory
     [SYSCALL_NR_SHMGET] =           sys_shmget,
     [SYSCALL_NR_SHMAT] =            sys_shmat,
+    [SYSCALL_NR_SHMDT] =            sys_shmdt,
 
     // System
     [SYSCALL_NR_SYNC] =             sys_sync,
@@ -113,6 +113,10 @@ struct ahci_cmd_table {
     struct ahci_prd prdt[0];
 };
 
+// Number of PRDs fitting into a command table entry
+#define AHCI_PRD_MAX_COUNT  \
+    ((AHCI_CMD_TABLE_ENTSZ - sizeof(struct ahci_cmd_table)) / sizeof(struct ahci_prd))
+
 //// Generic AHCI
 
 static void ahci_port_stop(struct ahci_port *port) {
@@ -194,6 +198,36 @@ static int ahci_port_alloc(struct ahci_port *port) {
     return 0;
 }
 
+// Describe `len' bytes at `buf' in the PRD table. Memory outside of the
+// physical memory mapping (e.g. heap) is only contiguous within a page,
+// so such buffers are split at page boundaries
+static size_t ahci_prdt_fill(struct ahci_cmd_table *table, void *buf, size_t len) {
+    uintptr_t addr = (uintptr_t) buf;
+    size_t count = 0;
+
+    while (len) {
+        size_t prd_size = MIN(AHCI_PRD_MAX_SIZE, len);
+        if (addr < KERNEL_VIRT_BASE) {
+            prd_size = MIN(prd_size, MM_PAGE_SIZE - (addr & MM_PAGE_OFFSET_MASK));
+        }
+        _assert(count < AHCI_PRD_MAX_COUNT);
+
+        table->prdt[count].dba = mm_kernel_phys((void *) addr);
+        table->prdt[count].__res0 = 0;
+        table->prdt[count].dbc = ((prd_size - 1) << 1) | 1;
+
+        addr += prd_size;
+        len -= prd_size;
+        ++count;
+    }
+
+    _assert(count);
+    // Mark last PRDT entry
+    table->prdt[count - 1].dbc |= 1U << 31;
+
+    return count;
+}
+
 static int ahci_port_ata_cmd(struct ahci_port *port, uint8_t ata, uintptr_t lba, void *data, size_t len) {
     // At least should be sector-aligned
     _assert(len % 512 == 0);
@@ -211,29 +245,10 @@ static int ahci_port_ata_cmd(struct ahci_port *port, uint8_t ata, uintptr_t lba,
     // TODO: support devices with different sector sizes
     size_t nsect = (len + 511) / 512;
     _assert((nsect & ~0xFFFF) == 0);
-    size_t prd_count = (len + AHCI_PRD_MAX_SIZE - 1) / AHCI_PRD_MAX_SIZE;
-    //kdebug("Command requires %d PRDs\n", prd_count);
 
     // Setup command table entry
-    memset(table_entry, 0, sizeof(struct ahci_cmd_table) + sizeof(struct ahci_prd) * prd_count);
-    for (size_t i = 0, bytes_left = len; i < prd_count; ++i) {
-        size_t prd_size = MIN(AHCI_PRD_MAX_SIZE, len);
-        _assert(prd_size);
-
-        uintptr_t prd_buf_phys = MM_PHYS(data) + i * AHCI_PRD_MAX_SIZE;
-
-        table_entry->prdt[i].dba = prd_buf_phys;
-        table_entry->prdt[i].dbc = ((prd_size - 1) << 1) | 1;
-
-        //kdebug("PRD%d: %S at %p\n", i, prd_size, prd_buf_phys);
-
-        if (i == prd_count - 1) {
-            // Mark last PRDT entry
-            table_entry->prdt[i].dbc |= 1U << 31;
-        }
-
-        bytes_left -= prd_size;
-    }
+    memset(table_entry, 0, sizeof(struct ahci_cmd_table));
+    size_t prd_count = ahci_prdt_fill(table_entry, data, len);
 
     // Setup command list entry
     // attr = FIS size in dwords
@@ -308,11 +323,10 @@ static int ahci_port_atapi_read(struct ahci_port *port, uint64_t lba, void *buf,
     // TODO: support devices with different sector sizes
     size_t len = nsect * 2048;
     _assert((nsect & ~0xFFFF) == 0);
-    size_t prd_count = (len + AHCI_PRD_MAX_SIZE - 1) / AHCI_PRD_MAX_SIZE;
-    //kdebug("Command requires %d PRDs\n", prd_count);
 
     // Setup command table entry
-    memset(table_entry, 0, sizeof(struct ahci_cmd_table) + sizeof(struct ahci_prd) * prd_count);
+    memset(table_entry, 0, sizeof(struct ahci_cmd_table));
+    size_t prd_count = ahci_prdt_fill(table_entry, buf, len);
     table_entry->acmd[0] = 0xA8;
     table_entry->acmd[9] = nsect;
     table_entry->acmd[5] = lba & 0xFF;
@@ -320,31 +334,12 @@ static int ahci_port_atapi_read(struct ahci_port *port, uint64_t lba, void *buf,
     table_entry->acmd[3] = (lba >> 16) & 0xFF;
     table_entry->acmd[2] = (lba >> 24) & 0xFF;
 
-    for (size_t i = 0, bytes_left = len; i < prd_count; ++i) {
-        size_t prd_size = MIN(AHCI_PRD_MAX_SIZE, len);
-        _assert(prd_size);
-
-        uintptr_t prd_buf_phys = MM_PHYS(buf) + i * AHCI_PRD_MAX_SIZE;
-
-        table_entry->prdt[i].dba = prd_buf_phys;
-        table_entry->prdt[i].dbc = ((prd_size - 1) << 1) | 1;
-
-        //kdebug("PRD%d: %S at %p\n", i, prd_size, prd_buf_phys);
-
-        if (i == prd_count - 1) {
-            // Mark last PRDT entry
-            table_entry->prdt[i].dbc |= 1U << 31;
-        }
-
-        bytes_left -= prd_size;
-    }
-
     // Setup command list entry
     // attr = FIS size in dwords
     list_entry->attr = sizeof(struct ahci_fis_reg_h2d) / sizeof(uint32_t);
     // This is ATAPI command
     list_entry->attr |= (1 << 5);
-    list_entry->prdtl = 1;
+    list_entry->prdtl = prd_count;
     list_entry->prdbc = 0;
 
     // Setup FIS packet
@@ -326,7 +326,7 @@ static void uhci_init_td(struct uhci_td *td, struct uhci_td *prev, uint8_t speed
         td->status |= 1 << 26;
     }
 
-    td->buffer = MM_PHYS(buf);
+    td->buffer = mm_kernel_phys(buf);
 }
 
 static void uhci_device_interrupt(struct usb_device *dev, struct usb_transfer *t) {
@@ -312,6 +312,7 @@ void ext2_inode_to_vnode(struct vnode *vnode, struct ext2_inode *inode, uint32_t
         break;
     case EXT2_IFREG:
         vnode->type = VN_REG;
+        vnode->flags |= VN_PAGED;
         break;
     default:
         panic("Unsupported inode type: %04x\n", inode->mode & 0xF000);
@@ -1,4 +1,5 @@
 #include "user/errno.h"
+#include "fs/pcache.h"
 #include "fs/node.h"
 #include "fs/vfs.h"
 #include "sys/assert.h"
@@ -13,7 +14,8 @@ static struct slab_cache *vnode_cache = NULL;
 
 struct vnode *vnode_create(enum vnode_type t, const char *name) {
     if (!vnode_cache) {
-        vnode_cache = slab_cache_get(sizeof(struct vnode));
+        vnode_cache = slab_cache_create("vnode", sizeof(struct vnode), NULL, NULL);
+        _assert(vnode_cache);
         kdebug("Initialized vnode cache\n");
     }
     struct vnode *node = slab_calloc(vnode_cache);
@@ -31,6 +33,7 @@ struct vnode *vnode_create(enum vnode_type t, const char *name) {
 void vnode_destroy(struct vnode *vn) {
     _assert(vnode_cache);
     _assert(!vn->open_count);
+    pcache_release(vn);
     slab_free(vnode_cache, vn);
 }
 
@@ -10,7 +10,8 @@ struct ofile *ofile_create(void) {
     struct ofile *of;
 
     if (!ofile_cache) {
-        ofile_cache = slab_cache_get(sizeof(struct ofile));
+        ofile_cache = slab_cache_create("ofile", sizeof(struct ofile), NULL, NULL);
+        _assert(ofile_cache);
     }
 
     // Also sets refcount to zero
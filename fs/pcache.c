@@ -0,0 +1,626 @@
+// Cached pages of a file are kept in a radix tree indexed by page
+// number: every level resolves PCACHE_SHIFT bits of the index, the
+// tree only gets taller when a page past its current range is added.
+#include "sys/mem/reclaim.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
+#include "user/stat.h"
+#include "user/errno.h"
+#include "fs/pcache.h"
+#include "fs/ofile.h"
+#include "fs/node.h"
+#include "sys/assert.h"
+#include "sys/string.h"
+#include "sys/debug.h"
+#include "sys/heap.h"
+#include "sys/attr.h"
+#include "sys/spin.h"
+#include "sys/mm.h"
+
+#define PCACHE_SHIFT            6
+#define PCACHE_SLOTS            (1 << PCACHE_SHIFT)
+#define PCACHE_MASK             (PCACHE_SLOTS - 1)
+// Enough levels for any page index
+#define PCACHE_MAX_HEIGHT       ((64 + PCACHE_SHIFT - 1) / PCACHE_SHIFT)
+// Nodes allocated at once when an insertion needs new ones
+#define PCACHE_REFILL           2
+
+struct pcache_node {
+    // Child nodes or, at the lowest level, struct page pointers
+    void *slots[PCACHE_SLOTS];
+    size_t count;
+};
+
+static struct slab_cache *pcache_node_cache = NULL;
+
+// Protects the trees and the list of caches, pages are read and
+// copied unlocked. Nothing is allocated while it is held, so the
+// shrinker can always take it
+static spin_t pcache_lock = 0;
+static LIST_HEAD(pcache_list);
+static size_t pcache_pages = 0;
+
+static struct pcache_node *pcache_node_alloc(void) {
+    if (!pcache_node_cache) {
+        pcache_node_cache = slab_cache_create("pcache_node", sizeof(struct pcache_node), NULL, NULL);
+        _assert(pcache_node_cache);
+    }
+    return slab_calloc(pcache_node_cache);
+}
+
+static void pcache_node_free(struct pcache_node *node) {
+    slab_free(pcache_node_cache, node);
+}
+
+static inline int pcache_fits(int height, size_t index) {
+    return height >= PCACHE_MAX_HEIGHT || !(index >> (height * PCACHE_SHIFT));
+}
+
+static struct page *pcache_lookup(struct page_cache *cache, size_t index) {
+    struct pcache_node *node;
+
+    if (!cache || !cache->root || !pcache_fits(cache->height, index)) {
+        return NULL;
+    }
+
+    node = cache->root;
+    for (int level = cache->height - 1; level > 0; --level) {
+        if (!(node = node->slots[(index >> (level * PCACHE_SHIFT)) & PCACHE_MASK])) {
+            return NULL;
+        }
+    }
+
+    return node->slots[index & PCACHE_MASK];
+}
+
+// Nodes are taken from the caller's pool, -EAGAIN means it has run out
+// and the insertion has to be retried after refilling it. The nodes
+// added so far are left in the tree
+static int pcache_insert(struct page_cache *cache,
+                         size_t index,
+                         struct page *page,
+                         struct pcache_node **pool,
+                         size_t *pooled) {
+    struct pcache_node *node;
+    void **slot;
+
+    if (!cache->root) {
+        cache->height = 1;
+        while (!pcache_fits(cache->height, index)) {
+            ++cache->height;
+        }
+        if (!*pooled) {
+            return -EAGAIN;
+        }
+        cache->root = pool[--*pooled];
+    }
+
+    // Grow the tree, the old root becomes the first child
+    while (!pcache_fits(cache->height, index)) {
+        if (!*pooled) {
+            return -EAGAIN;
+        }
+        node = pool[--*pooled];
+        node->slots[0] = cache->root;
+        node->count = 1;
+        cache->root = node;
+        ++cache->height;
+    }
+
+    node = cache->root;
+    for (int level = cache->height - 1; level > 0; --level) {
+        slot = &node->slots[(index >> (level * PCACHE_SHIFT)) & PCACHE_MASK];
+        if (!*slot) {
+            if (!*pooled) {
+                return -EAGAIN;
+            }
+            *slot = pool[--*pooled];
+            ++node->count;
+        }
+        node = *slot;
+    }
+
+    slot = &node->slots[index & PCACHE_MASK];
+    _assert(!*slot);
+    *slot = page;
+    ++node->count;
+    ++cache->count;
+    ++pcache_pages;
+
+    return 0;
+}
+
+// First dirty page at or after *index
+static struct page *pcache_find_dirty(struct pcache_node *node, int level, size_t base, size_t *index) {
+    size_t span = (size_t) 1 << (level * PCACHE_SHIFT);
+    struct page *page;
+
+    for (size_t i = 0; i < PCACHE_SLOTS; ++i) {
+        size_t first = base + i * span;
+
+        if (!node->slots[i] || first + (span - 1) < *index) {
+            continue;
+        }
+
+        if (level) {
+            if ((page = pcache_find_dirty(node->slots[i], level - 1, first, index))) {
+                return page;
+            }
+        } else {
+            page = node->slots[i];
+            if (page->flags & PG_DIRTY) {
+                *index = first;
+                return page;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void pcache_page_drop(struct page *page) {
+    uintptr_t irq;
+    int release;
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    _assert(page->refcount);
+    release = !__sync_sub_and_fetch(&page->refcount, 1);
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    if (release) {
+        mm_phys_free_page(PAGE2PHYS(page));
+    }
+}
+
+// Drop the cache's references to the pages of a detached tree
+static void pcache_tree_free(struct pcache_node *node, int level) {
+    for (size_t i = 0; i < PCACHE_SLOTS && node->count; ++i) {
+        if (!node->slots[i]) {
+            continue;
+        }
+
+        if (level) {
+            pcache_tree_free(node->slots[i], level - 1);
+        } else {
+            struct page *page = node->slots[i];
+            page->flags &= ~PG_DIRTY;
+            pcache_page_drop(page);
+        }
+
+        node->slots[i] = NULL;
+        --node->count;
+    }
+
+    pcache_node_free(node);
+}
+
+static struct page_cache *pcache_create(struct vnode *vn) {
+    struct page_cache *cache;
+    uintptr_t irq;
+
+    if (vn->pcache) {
+        return vn->pcache;
+    }
+
+    if (!(cache = kmalloc(sizeof(struct page_cache)))) {
+        return NULL;
+    }
+    cache->root = NULL;
+    cache->height = 0;
+    cache->count = 0;
+    cache->size = -1;
+    cache->size_gen = 0;
+    list_head_init(&cache->link);
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    if (!vn->pcache) {
+        vn->pcache = cache;
+        list_add(&cache->link, &pcache_list);
+        cache = NULL;
+    }
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    kfree(cache);
+    return vn->pcache;
+}
+
+// Avoids a stat() of the file on every read
+static int pcache_size(struct vnode *vn, struct page_cache *cache, size_t *size) {
+    struct stat st;
+    size_t gen;
+    uintptr_t irq;
+    int res;
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    if (cache->size >= 0) {
+        *size = cache->size;
+        spin_release_irqrestore(&pcache_lock, &irq);
+        return 0;
+    }
+    gen = cache->size_gen;
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    if ((res = vn->op->stat(vn, &st)) != 0) {
+        return res;
+    }
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    // The file may have been written or truncated meanwhile
+    if (cache->size_gen == gen) {
+        cache->size = st.st_size;
+    }
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    *size = st.st_size;
+    return 0;
+}
+
+static int pcache_fill(struct vnode *vn, size_t index, uintptr_t page) {
+    char *dst = (char *) MM_VIRTUALIZE(page);
+    struct ofile fd;
+    size_t off = 0;
+    ssize_t bread;
+
+    if (!(vn->flags & VN_PAGED) || !vn->op || !vn->op->read) {
+        return -EINVAL;
+    }
+
+    // Filesystem read() only looks at the vnode and position
+    memset(&fd, 0, sizeof(struct ofile));
+    fd.flags = OF_READABLE;
+    fd.file.vnode = vn;
+    fd.file.pos = index * MM_PAGE_SIZE;
+
+    while (off < MM_PAGE_SIZE) {
+        if ((bread = vn->op->read(&fd, dst + off, MM_PAGE_SIZE - off)) < 0) {
+            return bread;
+        }
+        if (!bread) {
+            break;
+        }
+        off += bread;
+    }
+
+    memset(dst + off, 0, MM_PAGE_SIZE - off);
+    return 0;
+}
+
+int pcache_find(struct vnode *vn, size_t index, uintptr_t *phys) {
+    struct page *page;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    if ((page = pcache_lookup(vn->pcache, index))) {
+        __sync_fetch_and_add(&page->refcount, 1);
+    }
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    if (!page) {
+        return -ENOENT;
+    }
+    *phys = PAGE2PHYS(page);
+    return 0;
+}
+
+int pcache_get(struct vnode *vn, size_t index, uintptr_t *phys) {
+    struct pcache_node *pool[PCACHE_REFILL];
+    struct page_cache *cache;
+    struct page *page;
+    size_t pooled = 0;
+    uintptr_t irq;
+    uintptr_t new;
+    int res;
+
+    if (pcache_find(vn, index, phys) == 0) {
+        return 0;
+    }
+
+    if (!(cache = pcache_create(vn))) {
+        return -ENOMEM;
+    }
+    if ((new = mm_phys_alloc_page(PU_CACHE)) == MM_NADDR) {
+        return -ENOMEM;
+    }
+    if ((res = pcache_fill(vn, index, new)) != 0) {
+        mm_phys_free_page(new);
+        return res;
+    }
+
+    while (1) {
+        spin_lock_irqsave(&pcache_lock, &irq);
+        if ((page = pcache_lookup(cache, index))) {
+            // Someone else has read the page meanwhile
+            __sync_fetch_and_add(&page->refcount, 1);
+            res = 1;
+        } else if ((res = pcache_insert(cache, index, PHYS2PAGE(new), pool, &pooled)) == 0) {
+            // One reference is kept by the cache, the other one is the caller's
+            page = PHYS2PAGE(new);
+            page->refcount = 2;
+        }
+        spin_release_irqrestore(&pcache_lock, &irq);
+
+        if (res != -EAGAIN) {
+            break;
+        }
+
+        while (pooled < PCACHE_REFILL) {
+            if (!(pool[pooled] = pcache_node_alloc())) {
+                break;
+            }
+            ++pooled;
+        }
+        if (!pooled) {
+            res = -ENOMEM;
+            break;
+        }
+    }
+
+    while (pooled) {
+        pcache_node_free(pool[--pooled]);
+    }
+
+    if (res < 0) {
+        mm_phys_free_page(new);
+        return res;
+    }
+    if (res > 0) {
+        mm_phys_free_page(new);
+    }
+
+    *phys = PAGE2PHYS(page);
+    return 0;
+}
+
+void pcache_put(uintptr_t phys) {
+    pcache_page_drop(PHYS2PAGE(phys));
+}
+
+ssize_t pcache_read(struct ofile *fd, void *buf, size_t count) {
+    struct vnode *vn = fd->file.vnode;
+    size_t done = 0, off, len;
+    struct page_cache *cache;
+    uintptr_t phys;
+    size_t size;
+    int res;
+
+    _assert(vn && vn->op && vn->op->stat);
+
+    if (!(cache = pcache_create(vn))) {
+        return -ENOMEM;
+    }
+    if ((res = pcache_size(vn, cache, &size)) != 0) {
+        return res;
+    }
+    if (fd->file.pos >= size) {
+        return 0;
+    }
+    count = MIN(count, size - fd->file.pos);
+
+    while (done < count) {
+        off = fd->file.pos & MM_PAGE_OFFSET_MASK;
+        len = MIN(count - done, MM_PAGE_SIZE - off);
+
+        if ((res = pcache_get(vn, fd->file.pos / MM_PAGE_SIZE, &phys)) != 0) {
+            return done ? (ssize_t) done : res;
+        }
+        memcpy((char *) buf + done, (const char *) MM_VIRTUALIZE(phys) + off, len);
+        pcache_put(phys);
+
+        fd->file.pos += len;
+        done += len;
+    }
+
+    return done;
+}
+
+void pcache_update(struct vnode *vn, size_t pos, const void *buf, size_t count) {
+    struct page_cache *cache;
+    struct page *page;
+    size_t off, len;
+    uintptr_t irq;
+
+    if (!(cache = vn->pcache)) {
+        return;
+    }
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    if (cache->size >= 0 && pos + count > (size_t) cache->size) {
+        cache->size = pos + count;
+    }
+    ++cache->size_gen;
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    while (count) {
+        off = pos & MM_PAGE_OFFSET_MASK;
+        len = MIN(count, MM_PAGE_SIZE - off);
+
+        spin_lock_irqsave(&pcache_lock, &irq);
+        if ((page = pcache_lookup(cache, pos / MM_PAGE_SIZE))) {
+            __sync_fetch_and_add(&page->refcount, 1);
+        }
+        spin_release_irqrestore(&pcache_lock, &irq);
+
+        if (page) {
+            memcpy((char *) MM_VIRTUALIZE(PAGE2PHYS(page)) + off, buf, len);
+            pcache_page_drop(page);
+        }
+
+        buf = (const char *) buf + len;
+        pos += len;
+        count -= len;
+    }
+}
+
+int pcache_sync(struct vnode *vn) {
+    struct page_cache *cache;
+    struct page *page;
+    struct ofile fd;
+    size_t index = 0;
+    size_t size;
+    ssize_t bwritten;
+    uintptr_t irq;
+    size_t len;
+    int res;
+
+    if (!vn->pcache || !vn->op || !vn->op->write || !vn->op->stat) {
+        return 0;
+    }
+
+    while (1) {
+        page = NULL;
+
+        spin_lock_irqsave(&pcache_lock, &irq);
+        cache = vn->pcache;
+        if (cache->root) {
+            page = pcache_find_dirty(cache->root, cache->height - 1, 0, &index);
+        }
+        if (page) {
+            // Only referenced by the cache, nobody can modify it now
+            if (page->refcount == 1) {
+                page->flags &= ~PG_DIRTY;
+            }
+            __sync_fetch_and_add(&page->refcount, 1);
+        }
+        spin_release_irqrestore(&pcache_lock, &irq);
+
+        if (!page) {
+            return 0;
+        }
+
+        if ((res = pcache_size(vn, cache, &size)) != 0) {
+            pcache_page_drop(page);
+            return res;
+        }
+
+        // Whatever was written past the end of the file is discarded
+        if (index * MM_PAGE_SIZE < size) {
+            len = MIN(MM_PAGE_SIZE, size - index * MM_PAGE_SIZE);
+
+            memset(&fd, 0, sizeof(struct ofile));
+            fd.flags = OF_WRITABLE;
+            fd.file.vnode = vn;
+            fd.file.pos = index * MM_PAGE_SIZE;
+
+            if ((bwritten = vn->op->write(&fd, (const void *) MM_VIRTUALIZE(PAGE2PHYS(page)), len)) != (ssize_t) len) {
+                pcache_page_drop(page);
+                return bwritten < 0 ? bwritten : -EIO;
+            }
+        }
+
+        pcache_page_drop(page);
+        ++index;
+    }
+}
+
+void pcache_invalidate(struct vnode *vn) {
+    struct page_cache *cache;
+    struct pcache_node *root;
+    uintptr_t irq;
+    int height;
+
+    if (!(cache = vn->pcache)) {
+        return;
+    }
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    root = cache->root;
+    height = cache->height;
+    pcache_pages -= cache->count;
+    cache->root = NULL;
+    cache->height = 0;
+    cache->count = 0;
+    cache->size = -1;
+    ++cache->size_gen;
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    if (root) {
+        pcache_tree_free(root, height - 1);
+    }
+}
+
+void pcache_release(struct vnode *vn) {
+    struct page_cache *cache;
+    uintptr_t irq;
+
+    if (!(cache = vn->pcache)) {
+        return;
+    }
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    list_del(&cache->link);
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    pcache_invalidate(vn);
+    vn->pcache = NULL;
+
+    kfree(cache);
+}
+
+//// Memory pressure
+
+// Release clean pages nobody has mapped
+static size_t pcache_node_shrink(struct page_cache *cache, struct pcache_node *node, int level, size_t nr) {
+    size_t freed = 0;
+    struct page *page;
+
+    for (size_t i = 0; i < PCACHE_SLOTS && freed < nr && node->count; ++i) {
+        if (!node->slots[i]) {
+            continue;
+        }
+
+        if (level) {
+            freed += pcache_node_shrink(cache, node->slots[i], level - 1, nr - freed);
+            continue;
+        }
+
+        page = node->slots[i];
+        // Only referenced by the cache: mappings may be dropping their
+        // references meanwhile, but can't take new ones
+        if ((page->flags & PG_DIRTY) || !__sync_bool_compare_and_swap(&page->refcount, 1, 0)) {
+            continue;
+        }
+
+        node->slots[i] = NULL;
+        --node->count;
+        --cache->count;
+        --pcache_pages;
+
+        mm_phys_free_page(PAGE2PHYS(page));
+        ++freed;
+    }
+
+    return freed;
+}
+
+static size_t pcache_shrink_count(struct shrinker *s) {
+    return pcache_pages;
+}
+
+static size_t pcache_shrink_scan(struct shrinker *s, size_t nr, int flags) {
+    struct page_cache *cache;
+    size_t freed = 0;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&pcache_lock, &irq);
+    list_for_each_entry(cache, &pcache_list, link) {
+        if (freed >= nr) {
+            break;
+        }
+        if (cache->root) {
+            freed += pcache_node_shrink(cache, cache->root, cache->height - 1, nr - freed);
+        }
+    }
+    spin_release_irqrestore(&pcache_lock, &irq);
+
+    return freed;
+}
+
+static struct shrinker pcache_shrinker = {
+    .name = "page cache",
+    .count = pcache_shrink_count,
+    .scan = pcache_shrink_scan
+};
+
+__init(pcache_shrinker_init) {
+    shrinker_register(&pcache_shrinker);
+}
@@ -75,6 +75,9 @@ struct vnode *ram_vnode_create(enum vnode_type t, const char *filename) {
     vn->op = &_ramfs_vnode_op;
     vn->fs_data = priv;
     vn->flags |= VN_MEMORY;
+    if (t == VN_REG) {
+        vn->flags |= VN_PAGED;
+    }
 
     return vn;
 }
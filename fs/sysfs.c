@@ -9,6 +9,7 @@
 #include "sys/string.h"
 #include "sys/thread.h"
 #include "sys/mem/slab.h"
+#include "sys/mem/profile.h"
 #include "sys/mem/phys.h"
 #include "fs/fs.h"
 #include "sys/mod.h"
@@ -335,6 +336,21 @@ static int system_mem_getter(void *ctx, char *buf, size_t lim) {
     return 0;
 }
 
+static int system_numa_getter(void *ctx, char *buf, size_t lim) {
+    struct mm_phys_node_stat st;
+
+    for (size_t i = 0; i < mm_phys_node_count(); ++i) {
+        mm_phys_node_stat(i, &st);
+
+        sysfs_buf_printf(buf, lim, "Node %u:\n", i);
+        sysfs_buf_printf(buf, lim, "  PhysFree:     %u kB\n", st.pages_free * 4);
+        sysfs_buf_printf(buf, lim, "  AllocLocal:   %u\n", st.allocs_local);
+        sysfs_buf_printf(buf, lim, "  AllocRemote:  %u\n", st.allocs_remote);
+    }
+
+    return 0;
+}
+
 static int debug_config_get(void *ctx, char *buf, size_t lim) {
     if (!strcmp(ctx, "serial")) {
         sysfs_buf_printf(buf, lim, "%u\n", kernel_config[CFG_DEBUG] & 0xFF);
@@ -376,7 +392,15 @@ void sysfs_populate(void) {
     sysfs_add_config_endpoint(dir, "smp", SYSFS_MODE_DEFAULT, 16, &sched_ncpus, sysfs_config_int64_getter, NULL);
 
     sysfs_add_config_endpoint(NULL, "mem", SYSFS_MODE_DEFAULT, 512, NULL, system_mem_getter, NULL);
+    sysfs_add_config_endpoint(NULL, "numa", SYSFS_MODE_DEFAULT, 1024, NULL, system_numa_getter, NULL);
+
+    sysfs_add_dir(NULL, "slab", &dir);
+    sysfs_add_config_endpoint(dir, "empty_keep", SYSFS_MODE_DEFAULT, 16, &slab_empty_keep, sysfs_config_int64_getter, slab_empty_limit_set);
+    sysfs_add_config_endpoint(dir, "empty_max", SYSFS_MODE_DEFAULT, 16, &slab_empty_max, sysfs_config_int64_getter, slab_empty_limit_set);
 
+#if defined(ALLOC_PROFILE)
+    sysfs_add_config_endpoint(NULL, "alloc_profile", SYSFS_MODE_DEFAULT, 8192, NULL, alloc_profile_getter, alloc_profile_reset);
+#endif
 }
 
 __init(sysfs_class_init) {
@@ -2,6 +2,7 @@
 #include "user/fcntl.h"
 #include "sys/block/blk.h"
 #include "sys/char/chr.h"
+#include "fs/pcache.h"
 #include "fs/ofile.h"
 #include "fs/node.h"
 #include "sys/thread.h"
@@ -76,7 +77,7 @@ static int vfs_opendir(struct vfs_ioctx *ctx, struct ofile *fd) {
         fd->flags |= OF_MEMDIR | OF_MEMDIR_DOT;
         fd->file.pos = (size_t) node->first_child;
 
-        ++node->open_count;
+        __sync_fetch_and_add(&node->open_count, 1);
 
         return 0;
     } else {
@@ -89,7 +90,7 @@ static int vfs_opendir(struct vfs_ioctx *ctx, struct ofile *fd) {
             return res;
         }
 
-        ++node->open_count;
+        __sync_fetch_and_add(&node->open_count, 1);
 
         return 0;
     }
@@ -231,6 +232,7 @@ int vfs_open_vnode(struct vfs_ioctx *ctx, struct ofile *fd, struct vnode *node,
         if ((res = node->op->truncate(node, 0)) != 0) {
             return res;
         }
+        pcache_invalidate(node);
     }
 
     fd->file.pos = 0;
@@ -264,7 +266,7 @@ int vfs_open_vnode(struct vfs_ioctx *ctx, struct ofile *fd, struct vnode *node,
         }
     }
 
-    ++fd->file.vnode->open_count;
+    __sync_fetch_and_add(&fd->file.vnode->open_count, 1);
 
     return 0;
 }
@@ -488,7 +490,7 @@ void vfs_close(struct vfs_ioctx *ctx, struct ofile *fd) {
     _assert(!(fd->refcount));
     _assert(fd->file.vnode);
 
-    --fd->file.vnode->open_count;
+    __sync_fetch_and_sub(&fd->file.vnode->open_count, 1);
 
     if (fd->file.vnode->op && fd->file.vnode->op->close) {
         fd->file.vnode->op->close(fd);
@@ -596,7 +598,10 @@ int vfs_ftruncate(struct vfs_ioctx *ctx, struct vnode *node, off_t length) {
     }
 
     if (node->op && node->op->truncate) {
-        return node->op->truncate(node, length);
+        pcache_sync(node);
+        int res = node->op->truncate(node, length);
+        pcache_invalidate(node);
+        return res;
     } else {
         return -ENOSYS;
     }
@@ -624,6 +629,10 @@ ssize_t vfs_write(struct vfs_ioctx *ctx, struct ofile *fd, const void *buf, size
     case VN_FIFO:
         _assert(node->op && node->op->write);
         b = node->op->write(fd, buf, count);
+        // Keep the cached pages, and so the mappings, up to date
+        if (b > 0 && (node->flags & VN_PAGED)) {
+            pcache_update(node, fd->file.pos - b, buf, b);
+        }
         return b;
     case VN_CHR:
         _assert(node->dev && ((struct chrdev *) node->dev)->write);
@@ -656,6 +665,9 @@ ssize_t vfs_read(struct vfs_ioctx *ctx, struct ofile *fd, void *buf, size_t coun
     switch (node->type) {
     case VN_REG:
     case VN_FIFO:
+        if (node->flags & VN_PAGED) {
+            return pcache_read(fd, buf, count);
+        }
         _assert(node->op && node->op->read);
         b = node->op->read(fd, buf, count);
         return b;
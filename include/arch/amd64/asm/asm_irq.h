@@ -71,6 +71,7 @@ extern void amd64_irq15();
 
 #if defined(AMD64_MAX_SMP)
 extern void amd64_irq_ipi();
+extern void amd64_irq_ipi_tlb();
 extern void amd64_irq_ipi_panic();
 #endif
 
@@ -3,20 +3,21 @@
 #include "sys/heap.h"
 #include <stdint.h>
 
-#define KERNEL_HEAP     (4 * 512 * 1024)
+// Virtual range reserved for the kernel heap: PML4 entry
+// right below the physical memory mapping
+#define KERNEL_HEAP_BASE    0xFFFFFE8000000000
+#define KERNEL_HEAP_END     0xFFFFFF0000000000
 
 /**
- * @brief Initialize heap instance of size `sz' at `phys_base'
+ * @brief Initialize heap instance in virtual range [base; end). No
+ *        memory is mapped until the first allocation, the heap then
+ *        grows by mapping pages at the top of the range
  * @param heap Heap instance
- * @param phys_base Physical address of the first byte of the heap
- * @param sz Count of bytes available for heap usage
- * @note Physical addresses are used internally for heap because this
- *       allows heap to just MM_VIRTUALIZE allocated pointers no matter
- *       where the kernel heap actually resides, which could be the
- *       problem if we created a separate mapping for kernel heap
- *       memory.
+ * @param base Start of the virtual range, must be within a single
+ *             kernel PML4 entry together with `end'
+ * @param end End of the virtual range
  */
-void amd64_heap_init(heap_t *heap, uintptr_t phys_base, size_t sz);
+void amd64_heap_init(heap_t *heap, uintptr_t base, uintptr_t end);
 
 // Debug info
 /**
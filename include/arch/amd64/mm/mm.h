@@ -4,6 +4,9 @@
 
 /// The place where the kernel pages are virtually mapped to
 #define KERNEL_VIRT_BASE                    0xFFFFFF0000000000
+/// End of the range userspace can access, first PML4 entry past
+/// AMD64_PML4I_USER_END. The kernel heap lies below KERNEL_VIRT_BASE too
+#define USER_VIRT_END                       0x00007F8000000000
 
 /// amd64 standard states that addresses' upper bits are copies of the 47th bit, so these need to be
 ///  stripped down to only 48 bits
@@ -16,6 +19,8 @@
 #define MM_PHYS(a)                          ((uintptr_t) (a) - 0xFFFFFF0000000000)
 
 #define MM_PAGE_SIZE                        0x1000
+#define MM_HUGE_PAGE_SIZE                   0x200000
+#define MM_HUGE_PAGE_COUNT                  (MM_HUGE_PAGE_SIZE / MM_PAGE_SIZE)
 
 #define MM_PTE_INDEX_MASK                   0x1FF
 #define MM_PTE_COUNT                        512
@@ -62,3 +67,5 @@ typedef mm_pml4_t mm_space_t;
 extern mm_space_t mm_kernel;
 
 void amd64_mm_init(void);
+/// Enable PCIDs on this CPU if supported, see arch/amd64/mm/tlb.c
+void amd64_tlb_init(void);
@@ -0,0 +1,5 @@
+#pragma once
+
+/// Read NUMA topology from ACPI SRAT/SLIT and split physical memory
+/// into per-node pools. Requires ACPICA and SMP CPU list to be initialized
+void amd64_numa_init(void);
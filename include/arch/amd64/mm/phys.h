@@ -13,5 +13,20 @@ struct mm_phys_memory_map {
     size_t entry_size;
 };
 
+// Physical memory below this address is direct-mapped by boot code
+#define PHYS_BOOT_DIRECT_LIMIT      0x100000000ULL
+
 //void amd64_phys_memory_map(const struct multiboot_tag_mmap *mmap);
 void amd64_phys_memory_map(const struct mm_phys_memory_map *mmap);
+/// End of the highest usable physical memory range
+uintptr_t amd64_phys_memory_end(void);
+/// Release usable memory above PHYS_BOOT_DIRECT_LIMIT to the allocator,
+/// must be called once direct mapping covers it
+void amd64_phys_memory_map_high(void);
+
+/// NUMA topology setup, see arch/amd64/mm/numa.c
+void amd64_phys_numa_range(uintptr_t begin, uintptr_t end, int node);
+void amd64_phys_numa_cpu(int cpu, int node);
+void amd64_phys_numa_distance(int from, int to, uint8_t distance);
+/// Split free memory into per-node pools
+void amd64_phys_numa_commit(size_t node_count);
@@ -2,6 +2,9 @@
 #include "sys/types.h"
 
 #define IPI_VECTOR_GENERIC      0xF0
+#define IPI_VECTOR_TLB          0xF1
 #define IPI_VECTOR_PANIC        0xF3
 
 void amd64_ipi_send(int cpu, uint8_t vector);
+/// TLB invalidation request handler, see arch/amd64/mm/tlb.c
+void amd64_ipi_tlb(void);
@@ -1,6 +1,9 @@
 #pragma once
 #include "sys/types.h"
 
+// cpu->flags: the CPU has been started
+#define CPU_READY                   (1 << 0)
+
 extern size_t smp_ncpus;
 
 void amd64_smp_bsp_configure(void);
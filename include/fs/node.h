@@ -16,9 +16,13 @@
 // Means the link has different meanings depending on
 // resolving process ID - use target_func instead
 #define VN_PER_PROCESS  (1 << 1)
+// Regular file which can be cached and mapped by pages: its read()
+// and write() only depend on the vnode and position
+#define VN_PAGED        (1 << 2)
 
 struct ofile;
 struct vfs_ioctx;
+struct page_cache;
 struct thread;
 struct vnode;
 struct fs;
@@ -81,6 +85,7 @@ struct vnode {
         vnode_link_getter_t target_func;
     };
 
+    // Open file descriptors and file mappings, updated atomically
     uint32_t open_count;
     uint64_t ino;
 
@@ -96,6 +101,9 @@ struct vnode {
      */
     void *dev;
 
+    // Pages of the file used by mappings, see fs/pcache.h
+    struct page_cache *pcache;
+
     struct vnode_operations *op;
 };
 
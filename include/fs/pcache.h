@@ -0,0 +1,76 @@
+/** vim: set ft=cpp.doxygen :
+ * @file fs/pcache.h
+ * @brief Per-vnode cache of file pages
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/list.h"
+
+struct pcache_node;
+struct ofile;
+struct vnode;
+
+struct page_cache {
+    // Radix tree of cached pages indexed by page number within the file
+    struct pcache_node *root;
+    int height;
+    size_t count;
+    // File size, negative if not known yet. Read by stat() once,
+    // then kept up to date by pcache_update() and pcache_invalidate().
+    // size_gen changes with every such update
+    off_t size;
+    size_t size_gen;
+    // Link in the list of caches scanned on memory pressure
+    struct list_head link;
+};
+
+/**
+ * @brief Get a page of the file, reading it if it's not cached yet.
+ *        Bytes past the end of the file are zero. The page is returned
+ *        with a reference held, see pcache_put()
+ * @param index Page number within the file
+ * @return 0 on success, negative error code otherwise
+ */
+int pcache_get(struct vnode *vn, size_t index, uintptr_t *phys);
+
+/**
+ * @brief Get a page of the file only if it's cached already. Never
+ *        sleeps or allocates memory, so can be called with spinlocks held
+ * @return 0 with a reference to the page held, -ENOENT if the page
+ *         is not cached
+ */
+int pcache_find(struct vnode *vn, size_t index, uintptr_t *phys);
+
+/// Drop the reference taken by pcache_get() or pcache_find()
+void pcache_put(uintptr_t phys);
+
+/**
+ * @brief read() of a VN_PAGED file through its page cache
+ * @return Number of bytes read, negative error code otherwise
+ */
+ssize_t pcache_read(struct ofile *fd, void *buf, size_t count);
+
+/**
+ * @brief Copy the data just written to the file at \p pos to the pages
+ *        which are already cached, so that mappings see it, and extend
+ *        the cached file size
+ */
+void pcache_update(struct vnode *vn, size_t pos, const void *buf, size_t count);
+
+/**
+ * @brief Write the pages modified through shared mappings back to the
+ *        file. Pages which are still mapped stay dirty, as they may be
+ *        modified again
+ * @return 0 on success, negative error code otherwise
+ */
+int pcache_sync(struct vnode *vn);
+
+/**
+ * @brief Drop all the cached pages and the size of the file, called when
+ *        its contents change. Pages still mapped by processes are kept
+ *        by them
+ */
+void pcache_invalidate(struct vnode *vn);
+
+/// Release the cache of a vnode being destroyed
+void pcache_release(struct vnode *vn);
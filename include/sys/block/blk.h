@@ -28,6 +28,7 @@ void blk_set_cache(struct blkdev *blk, size_t capacity);
 void blk_cache_release(struct blkdev *blk);
 void blk_sync(struct blkdev *blk);
 int blk_page_sync(struct blkdev *blk, uintptr_t address, uintptr_t page);
+int blk_page_load(struct blkdev *blk, uintptr_t address, uintptr_t page);
 void blk_sync_all(void);
 
 int blk_mmap(struct blkdev *blk, uintptr_t base, size_t page_count, int prot, int flags);
@@ -1,5 +1,6 @@
 #pragma once
 #include "sys/types.h"
+#include "sys/spin.h"
 
 struct lru_node;
 
@@ -12,6 +13,9 @@ struct lru_hash {
 struct block_cache {
     size_t page_size;
     size_t capacity, size;
+    // Protects LRU queue and index, pages themselves are
+    // written back/released unlocked
+    spin_t lock;
     struct blkdev *blk;
     struct lru_node *queue_head, *queue_tail;
     struct lru_hash index_hash;
@@ -22,5 +26,18 @@ struct block_cache {
 void block_cache_init(struct block_cache *cache, struct blkdev *blk, size_t page_size, size_t page_capacity);
 void block_cache_release(struct block_cache *cache);
 void block_cache_flush(struct block_cache *cache);
+/**
+ * @brief Get the page of a block, reading it from the device if it's
+ *        not cached. The page is kept in the cache until released
+ *        with block_cache_put()
+ * @return 0 on success, negative error code otherwise
+ */
 int block_cache_get(struct block_cache *cache, uintptr_t address, uintptr_t *page);
+void block_cache_put(struct block_cache *cache, uintptr_t address);
 void block_cache_mark_dirty(struct block_cache *cache, uintptr_t address);
+/**
+ * @brief Release up to `count' least recently used pages of the cache
+ * @param sync If zero, dirty pages are kept instead of being written back
+ * @return Number of pages released
+ */
+size_t block_cache_shrink(struct block_cache *cache, size_t count, int sync);
@@ -0,0 +1,38 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/fault.h
+ * @brief Demand paging of userspace memory areas
+ */
+#pragma once
+#include "sys/types.h"
+
+// The faulting access was a write
+#define VM_FAULT_WRITE      (1 << 0)
+
+// vm_fault() result: the page of a file has to be read into its cache
+// first, see vm_fault_fill()
+#define VM_FAULT_MISS       1
+
+struct process;
+
+/**
+ * @brief Populate a page of the process' memory area on first access:
+ *        called for faults on non-present pages and on writes to the
+ *        zero page or file cache pages. Called with the space lock of
+ *        the process held, see tlb_space_lock()
+ * @param flags VM_FAULT_* flags
+ * @return 0 if the page was mapped, -1 if the access is invalid,
+ *         VM_FAULT_MISS if the fault has to be retried after
+ *         vm_fault_fill()
+ */
+int vm_fault(struct process *proc, uintptr_t addr, int flags);
+
+/**
+ * @brief Read the page of the file mapped at \p addr into the file's
+ *        cache. Reading may sleep, so this is called without the space
+ *        lock, before the fault is retried
+ * @param page Set to the page, with a reference held which is dropped
+ *             with pcache_put() once the fault is resolved
+ * @return 0 on success, -1 if \p addr is not in a file mapping or the
+ *         page can't be read
+ */
+int vm_fault_fill(struct process *proc, uintptr_t addr, uintptr_t *page);
@@ -6,15 +6,31 @@
 #include "sys/types.h"
 #include "sys/list.h"
 
-extern struct page *mm_pages;
+// Page metadata is kept in sections of 2^PHYS_SECTION_SHIFT bytes of
+// physical memory, struct page arrays only exist for sections which
+// contain usable memory
+#define PHYS_SECTION_SHIFT      27
+#define PHYS_SECTION_PAGES      (1UL << (PHYS_SECTION_SHIFT - 12))
+// Covers 512GiB of physical address space
+#define PHYS_MAX_SECTIONS       4096
 
-#define PHYS2PAGE(phys) \
-    (&mm_pages[((uintptr_t) (phys)) / MM_PAGE_SIZE])
-#define PAGE2PHYS(page) \
-    (MM_PAGE_SIZE * ((uintptr_t) (phys) - (uintptr_t) pages) / sizeof(struct page))
+extern struct page *mm_sections[PHYS_MAX_SECTIONS];
+
+#define PHYS_MAX_NODES          8
 
 #define PG_ALLOC                (1 << 0)
 #define PG_MMAPED               (1 << 1)
+// Page is the first one of a free buddy block
+#define PG_BUDDY                (1 << 2)
+// Page is the first one of a 2MiB frame, refcount of the
+// whole frame is kept here
+#define PG_HUGE                 (1 << 3)
+// Page of a file cache was modified through a shared mapping
+// and has to be written back
+#define PG_DIRTY                (1 << 4)
+// Upper bits of page flags hold the section number
+#define PG_SECTION_SHIFT        48
+#define PG_SECTION(page)        ((page)->flags >> PG_SECTION_SHIFT)
 
 struct page {
     uint64_t flags;
@@ -29,8 +45,44 @@ struct page {
         _PU_COUNT
     } usage;
     size_t refcount;
+
+    // Buddy allocator: free list link and block order,
+    // only valid for PG_BUDDY pages
+    struct list_head link;
+    union {
+        uint32_t order;
+        // Slab allocator: descriptor of the multi-page slab
+        // this page belongs to
+        struct slab *slab;
+    };
 };
 
+/**
+ * @brief Get page frame metadata for a page frame number
+ * @return NULL if the frame is not in a populated section
+ *         (device memory, holes), page struct pointer otherwise
+ */
+static inline struct page *mm_pfn_page(uintptr_t pfn) {
+    struct page *section;
+    if (pfn >= PHYS_MAX_SECTIONS * PHYS_SECTION_PAGES) {
+        return NULL;
+    }
+    if (!(section = mm_sections[pfn / PHYS_SECTION_PAGES])) {
+        return NULL;
+    }
+    return &section[pfn % PHYS_SECTION_PAGES];
+}
+
+static inline uintptr_t mm_page_pfn(const struct page *page) {
+    uintptr_t sec = PG_SECTION(page);
+    return sec * PHYS_SECTION_PAGES + (uintptr_t) (page - mm_sections[sec]);
+}
+
+#define PHYS2PAGE(phys) \
+    mm_pfn_page(((uintptr_t) (phys)) / MM_PAGE_SIZE)
+#define PAGE2PHYS(page) \
+    (MM_PAGE_SIZE * mm_page_pfn(page))
+
 struct mm_phys_reserved {
     uintptr_t begin, end;
     struct list_head link;
@@ -46,15 +98,55 @@ struct mm_phys_stat {
     size_t pages_used_cache;
 };
 
+struct mm_phys_node_stat {
+    size_t pages_free;
+    size_t allocs_local;
+    size_t allocs_remote;
+};
+
 void mm_phys_reserve(const char *use, struct mm_phys_reserved *res);
 void mm_phys_stat(struct mm_phys_stat *st);
 
 /**
- * @brief Allocate a single physical memory region of MM_PAGE_SIZE bytes
+ * @brief Get the number of NUMA nodes memory is split into
+ *        (1 if the system does not describe its topology)
+ */
+size_t mm_phys_node_count(void);
+void mm_phys_node_stat(int node, struct mm_phys_node_stat *st);
+/// NUMA node a CPU belongs to
+int mm_phys_cpu_node(int cpu);
+/// NUMA node a physical page belongs to
+int mm_phys_node(uintptr_t phys);
+
+/**
+ * @brief Check if free memory is above the high watermark, i.e.
+ *        background reclaim may stop
+ */
+int mm_phys_watermark_ok(void);
+
+/**
+ * @brief Allocate a single physical memory region of MM_PAGE_SIZE bytes.
+ *        Memory is taken from the node of the calling CPU if possible
  * @return MM_NADDR on failure, a page-aligned physical address otherwise
  */
 uintptr_t mm_phys_alloc_page(enum page_usage pu);
 
+/**
+ * @brief Allocate a single physical page filled with zeros. Pages are
+ *        taken from a pool prepared by idle threads if possible
+ * @return MM_NADDR on failure, a page-aligned physical address otherwise
+ */
+uintptr_t mm_phys_alloc_zeroed_page(enum page_usage pu);
+
+/// Page of zeros mapped read-only by demand-zero faults, never released
+extern uintptr_t mm_zero_page;
+
+/**
+ * @brief Refill current CPU's node pool of zeroed pages.
+ *        Called from idle threads
+ */
+void mm_phys_zero_idle(void);
+
 /**
  * @brief Allocates a contiguous physical memory region of MM_PAGE_SIZE * \p count bytes
  * @param count Size of the region in pages
@@ -62,9 +154,28 @@ uintptr_t mm_phys_alloc_page(enum page_usage pu);
  */
 uintptr_t mm_phys_alloc_contiguous(size_t count, enum page_usage pu);
 
+/**
+ * @brief Allocate a 2MiB-aligned frame of MM_HUGE_PAGE_SIZE bytes
+ *        to be mapped as a huge page
+ * @return MM_NADDR on failure, physical address otherwise
+ */
+uintptr_t mm_phys_alloc_huge_page(enum page_usage pu);
+
+/**
+ * @brief Free a frame allocated by mm_phys_alloc_huge_page()
+ */
+void mm_phys_free_huge_page(uintptr_t addr);
+
 /**
  * @brief Free a physical page
  * @param addr Physical memory page address, aligned to page boundary
  */
 void mm_phys_free_page(uintptr_t addr);
 
+/**
+ * @brief Free a contiguous physical memory region of MM_PAGE_SIZE * \p count bytes
+ * @param addr Physical address of the first page of the region
+ * @param count Size of the region in pages
+ */
+void mm_phys_free_contiguous(uintptr_t addr, size_t count);
+
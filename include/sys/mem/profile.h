@@ -0,0 +1,41 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/profile.h
+ * @brief Allocation profiler: per-call-site statistics for heap, slab
+ *        and physical page allocations
+ */
+#pragma once
+#include <config.h>
+#include "sys/types.h"
+
+enum alloc_kind {
+    ALLOC_HEAP = 0,
+    ALLOC_SLAB,
+    ALLOC_PAGE,
+    _ALLOC_KIND_COUNT
+};
+
+#if defined(ALLOC_PROFILE)
+/// Return address of the allocator entry point the macro is used in
+#define alloc_profile_site()    ((uintptr_t) __builtin_return_address(0))
+
+/**
+ * @brief Account an allocation to a call site
+ * @param kind Allocator the object came from
+ * @param tag Static string to tell apart allocations of the same site
+ *            (cache name, page usage), may be NULL
+ * @param site Caller's return address
+ * @param addr Address of the object, NULL/MM_NADDR allocations are ignored
+ * @param size Size requested by the caller
+ */
+void alloc_profile_alloc(enum alloc_kind kind, const char *tag, uintptr_t site, uintptr_t addr, size_t size);
+/// Account a free of an object, unknown addresses are ignored
+void alloc_profile_free(uintptr_t addr);
+
+/// sysfs getter: symbolized per-site statistics sorted by live bytes
+int alloc_profile_getter(void *ctx, char *buf, size_t lim);
+/// sysfs setter: writing anything resets the statistics
+int alloc_profile_reset(void *ctx, const char *value);
+#else
+#define alloc_profile_alloc(kind, tag, site, addr, size)
+#define alloc_profile_free(addr)
+#endif
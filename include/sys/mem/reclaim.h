@@ -0,0 +1,37 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/reclaim.h
+ * @brief Memory pressure handling: shrinker callbacks and background reclaim
+ */
+#pragma once
+#include "sys/types.h"
+
+// Reclaim is performed from the allocation path - the caller may hold
+// locks or be in the middle of some filesystem operation, so shrinkers
+// must not start I/O or release objects that could be referenced
+#define RECLAIM_DIRECT      (1 << 0)
+
+struct shrinker {
+    const char *name;
+    /// Number of pages the subsystem could give back right now
+    size_t (*count) (struct shrinker *s);
+    /// Try to give back `nr' pages, return the number of pages released.
+    /// Called by several reclaiming threads at once
+    size_t (*scan) (struct shrinker *s, size_t nr, int flags);
+    /// Optional: periodically called by the reclaim daemon to release
+    /// memory kept above the subsystem's own limits
+    size_t (*trim) (struct shrinker *s);
+    struct shrinker *next;
+};
+
+void shrinker_register(struct shrinker *s);
+
+/**
+ * @brief Ask registered shrinkers to release up to `nr' pages
+ * @param flags RECLAIM_* flags
+ * @return Number of pages released
+ */
+size_t mm_reclaim(size_t nr, int flags);
+
+/// Notify the reclaim daemon that free memory is below the low watermark
+void mm_reclaim_wakeup(void);
+void mm_reclaim_daemon_start(void);
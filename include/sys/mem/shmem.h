@@ -2,11 +2,21 @@
 #include "sys/types.h"
 #include "sys/list.h"
 #include "sys/spin.h"
+#include "sys/mm.h"
 
 struct thread;
+struct vm_area;
+struct vm_map;
+
+/// Map the page of shmget() segment area containing `virt', see vm_fault()
+int shm_fault(mm_space_t space, struct vm_area *area, uintptr_t virt);
+
+/// Write back files modified through shared mappings in [start, end)
+void mmap_writeback(struct vm_map *map, uintptr_t start, uintptr_t end);
 
 int sys_shmget(size_t size, int flags);
 void *sys_shmat(int id, const void *hint, int flags);
+int sys_shmdt(const void *addr);
 
 void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t offset);
 int sys_munmap(void *addr, size_t length);
@@ -10,20 +10,59 @@ struct slab_stat {
 
 struct slab_cache;
 
+/**
+ * @brief Get a general-purpose cache for objects of up to \p obj_size bytes
+ */
 struct slab_cache *slab_cache_get(size_t obj_size);
 
+/**
+ * @brief Create a named cache of exactly-sized objects
+ * @param name Cache name, must outlive the cache
+ * @param size Object size, up to 64KiB
+ * @param ctor If not NULL, called for every object when its slab is
+ *             created. Objects are then handed out by slab_alloc() in
+ *             constructed state and must be returned to that state
+ *             before being freed
+ * @param dtor If not NULL, called for every object when its slab is
+ *             released
+ * @return NULL on failure
+ */
+struct slab_cache *slab_cache_create(const char *name,
+                                     size_t size,
+                                     void (*ctor) (void *),
+                                     void (*dtor) (void *));
+/**
+ * @brief Destroy a cache created by slab_cache_create(). All of its
+ *        objects must be freed
+ */
+void slab_cache_destroy(struct slab_cache *cp);
+
 void slab_stat(struct slab_stat *st);
 
+// Empty slabs retained per cache: up to slab_empty_keep are kept until
+// memory pressure, the rest up to slab_empty_max until the next periodic
+// trim. Tunable through /sys/slab
+extern int64_t slab_empty_keep;
+extern int64_t slab_empty_max;
+/// sysfs setter for the limits above, ctx points to the limit
+int slab_empty_limit_set(void *ctx, const char *value);
+
 #if defined(SLAB_TRACE_ALLOC)
+#define slab_alloc(cp)      slab_alloc_trace(__FILE__, __LINE__, cp)
 #define slab_calloc(cp)     slab_calloc_trace(__FILE__, __LINE__, cp)
 #define slab_free(cp, ptr)  slab_free_trace(__FILE__, __LINE__, cp, ptr)
 
+void *slab_alloc_trace(const char *filename, int line, struct slab_cache *cp);
 void *slab_calloc_trace(const char *filename, int line, struct slab_cache *cp);
 void slab_free_trace(const char *filename, int line, struct slab_cache *cp, void *ptr);
 #else
+#define slab_alloc(cp)      slab_alloc_int(cp)
 #define slab_calloc(cp)     slab_calloc_int(cp)
 #define slab_free(cp, ptr)  slab_free_int(cp, ptr)
 #endif
 
+/// Allocate an object, constructed if the cache has a constructor
+void *slab_alloc_int(struct slab_cache *cp);
+/// Allocate a zeroed object from a cache without constructor
 void *slab_calloc_int(struct slab_cache *cp);
 void slab_free_int(struct slab_cache *cp, void *ptr);
@@ -0,0 +1,76 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/tlb.h
+ * @brief TLB invalidation across CPUs
+ */
+#pragma once
+#include "sys/types.h"
+
+struct process;
+
+// Ranges of more pages than this are invalidated by flushing the whole TLB
+#define TLB_FLUSH_MAX_PAGES     32
+// Pages a batch may hold before it has to be flushed
+#define TLB_BATCH_PAGES         64
+
+/**
+ * Collects the ranges unmapped or write-protected in an address space
+ * and the pages released by that, so that other CPUs get a single
+ * invalidation request for all of them. Pages are only freed once no
+ * CPU can reach them through a stale TLB entry
+ */
+struct tlb_batch {
+    const struct process *proc;
+    // [start, end) covers all the ranges added, empty if start >= end
+    uintptr_t start, end;
+    size_t count;
+    // Physical addresses, bit 0 is set for 2MiB pages
+    uintptr_t pages[TLB_BATCH_PAGES];
+};
+
+/**
+ * @brief Load the address space of a process about to run on this CPU,
+ *        called by the scheduler before switching threads. Kernel
+ *        threads keep using the space which is already loaded
+ * @param to Process switched to, NULL for the idle threads
+ */
+void tlb_switch(struct process *to);
+
+/**
+ * @brief Make the CPUs which still have the space of a process loaded
+ *        switch to the kernel one and forget the PCIDs of the space,
+ *        must be called before the process' page tables are freed or
+ *        handed over to another process. The process must not be running
+ *        on other CPUs
+ */
+void tlb_release(struct process *proc);
+
+/**
+ * @brief Invalidate [start, end) of the address space on all the CPUs
+ *        which have it loaded, including this one. Other CPUs are sent
+ *        an IPI and waited for
+ * @param proc Process owning the space, NULL for the kernel one, which
+ *             is invalidated on every CPU
+ */
+void tlb_shootdown(const struct process *proc, uintptr_t start, uintptr_t end);
+
+/**
+ * @brief Take the lock of the process' space, see struct process. Other
+ *        CPUs' invalidation requests are served while waiting, as the
+ *        holder may be sending one. Interrupts are disabled until
+ *        tlb_space_unlock()
+ */
+void tlb_space_lock(struct process *proc, uintptr_t *rflags);
+void tlb_space_unlock(struct process *proc, uintptr_t *rflags);
+
+void tlb_batch_init(struct tlb_batch *batch, const struct process *proc);
+/// Add [start, end) to the range invalidated by tlb_batch_flush()
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t start, uintptr_t end);
+/**
+ * @brief Free a page unmapped from the address space once the TLBs are
+ *        flushed. If no other CPU has the space loaded, the page is
+ *        freed right away, the caller must have unmapped it already
+ * @param huge Nonzero if \p phys is a 2MiB page
+ */
+void tlb_batch_free(struct tlb_batch *batch, uintptr_t phys, int huge);
+/// Invalidate the range collected so far and free the pages
+void tlb_batch_flush(struct tlb_batch *batch);
@@ -0,0 +1,97 @@
+/** vim: set ft=cpp.doxygen :
+ * @file sys/mem/vma.h
+ * @brief Per-process virtual memory areas
+ */
+#pragma once
+#include "sys/types.h"
+#include "sys/spin.h"
+
+// Area was created by mmap() and may be removed by munmap()
+#define VMA_MMAPED          (1 << 0)
+// Modifications are visible to other mappings of the object
+#define VMA_SHARED          (1 << 1)
+
+enum vma_type {
+    VMA_ANON = 1,           // Private zero-filled memory
+    VMA_SHM,                // shmget() segment, object is the chunk
+    VMA_DEVICE,             // Block device mapping, object is the device
+    VMA_FILE,               // Regular file mapping, object is the vnode,
+                            // which is kept open by the area
+    VMA_STACK,              // Thread user stack
+};
+
+struct vm_area {
+    // [start, end), page-aligned
+    uintptr_t start, end;
+    // PROT_* bits
+    int prot;
+    // VMA_* flags
+    int flags;
+    enum vma_type type;
+    // Backing object and offset of the area's start in it, bytes
+    void *object;
+    size_t offset;
+
+    // Tree linkage, see sys/mem/vma.c
+    struct vm_area *left, *right;
+    int height;
+    // Unmapped space between the previous area and this one
+    uintptr_t gap;
+    // Largest gap in the subtree
+    uintptr_t max_gap;
+};
+
+// A zeroed map is a valid empty one
+struct vm_map {
+    struct vm_area *root;
+    size_t count;
+    spin_t lock;
+};
+
+/**
+ * @brief Add an area at a fixed address
+ * @return 0 on success, -EEXIST if the range overlaps an existing area,
+ *         -ENOMEM if the area could not be allocated
+ */
+int vma_insert(struct vm_map *map,
+               uintptr_t start,
+               uintptr_t end,
+               int prot,
+               int flags,
+               enum vma_type type,
+               void *object,
+               size_t offset);
+
+/**
+ * @brief Find a free range of \p npages pages aligned to \p align pages
+ *        within [from, to) and add an area there
+ * @return Start of the area or MM_NADDR on failure
+ */
+uintptr_t vma_alloc(struct vm_map *map,
+                    uintptr_t from,
+                    uintptr_t to,
+                    size_t npages,
+                    size_t align,
+                    int prot,
+                    int flags,
+                    enum vma_type type,
+                    void *object,
+                    size_t offset);
+
+/**
+ * @brief Remove [start, end) from the map, trimming and splitting
+ *        areas crossing its boundaries
+ * @return 0 on success, -ENOMEM if an area had to be split and
+ *         the new part could not be allocated
+ */
+int vma_remove(struct vm_map *map, uintptr_t start, uintptr_t end);
+
+/// Area containing \p addr or NULL
+struct vm_area *vma_lookup(struct vm_map *map, uintptr_t addr);
+/// Area containing \p addr or the lowest one above it, NULL if none
+struct vm_area *vma_next(struct vm_map *map, uintptr_t addr);
+
+/// Copy all the areas of \p src to the empty map \p dst
+int vma_fork(struct vm_map *dst, struct vm_map *src);
+/// Remove all the areas
+void vma_clear(struct vm_map *map);
@@ -10,6 +10,7 @@
 #include "arch/amd64/mm/mm.h"
 #endif
 
+struct tlb_batch;
 struct process;
 
 /// An invalid address analogous to NULL
@@ -18,6 +19,11 @@ struct process;
 #define MM_CLONE_FLG_KERNEL     (1 << 0)
 #define MM_CLONE_FLG_USER       (1 << 1)
 
+/// mm_umap_single() page size checks
+#define MM_UMAP_ANY             0
+#define MM_UMAP_4K              1
+#define MM_UMAP_2M              2
+
 #define userspace
 
 mm_space_t mm_space_create(void);
@@ -28,8 +34,46 @@ void mm_space_free(struct process *proc);
 
 void mm_describe(const mm_space_t pd);
 
+/**
+ * @brief Map a page at `virt_page'. If `flags' contain MM_PAGE_HUGE,
+ *        a 2MiB page is mapped, both addresses must be aligned to
+ *        MM_HUGE_PAGE_SIZE then
+ */
 int mm_map_single(mm_space_t pd, uintptr_t virt_page, uintptr_t phys_page, uint64_t flags);
+/**
+ * @brief Unmap a page, checking that its size matches `size'
+ *        (MM_UMAP_4K, MM_UMAP_2M or MM_UMAP_ANY)
+ * @return Physical address of the page, MM_NADDR if there's
+ *         no mapping or size does not match
+ */
 uintptr_t mm_umap_single(mm_space_t pd, uintptr_t virt_page, uint32_t size);
+/**
+ * @brief Same as mm_umap_single(), but the page (or the pages of a 2MiB
+ *        frame) is also freed through `batch' if the mapping was the
+ *        last reference to it. Unlike checking the refcount after
+ *        mm_umap_single(), only one of the concurrent unmappers frees it
+ */
+uintptr_t mm_umap_release(mm_space_t pd, uintptr_t virt_page, uint32_t size, struct tlb_batch *batch);
+/**
+ * @brief Replace a 2MiB mapping containing `virt' with 4KiB ones.
+ *        If a private frame is mapped by someone else as well, the
+ *        mapping gets its own copy. Shared frames are mapped as they
+ *        are, their pages are referenced separately from then on
+ * @return 0 on success or if the mapping is not huge, -1 if there's
+ *         no mapping or no memory for the page table or the copy
+ */
+int mm_map_split(mm_space_t pd, uintptr_t virt);
+/**
+ * @brief Check if a 2MiB page can be mapped at `virt': nothing is mapped
+ *        in the range and there's no page table for it
+ */
+int mm_map_huge_avail(mm_space_t pd, uintptr_t virt);
 uintptr_t mm_map_get(mm_space_t pd, uintptr_t virt, uint64_t *rflags);
+/**
+ * @brief Get physical address of a kernel pointer. Unlike MM_PHYS(), also
+ *        works for memory outside of the physical memory mapping (kernel
+ *        heap), which is only physically contiguous within a page
+ */
+uintptr_t mm_kernel_phys(const void *ptr);
 
 void userptr_check(const void *ptr);
@@ -1,14 +1,37 @@
 #pragma once
 #include "sys/types.h"
 
+struct spawn_action;
 struct user_stack;
 
+// Registers of the caller saved by the fork()/vfork() entry stub
+struct sys_fork_frame {
+    uint64_t rdi, rsi, rdx, rcx;
+    uint64_t r8, r9, r10, r11;
+    uint64_t rbx;
+    uint64_t rbp;
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
+    uint64_t rsp;
+    uint64_t rflags;
+    uint64_t rip;
+};
+
 int sys_kill(pid_t pid, int signum);
 void sys_exit(int status);
 void sys_sigentry(uintptr_t entry);
 void sys_sigreturn(void);
 int sys_clone(int (*entry) (void *), void *stack, int flags, void *arg);
 int sys_execve(const char *path, const char **argp, const char **envp);
+int sys_fork(struct sys_fork_frame *frame);
+int sys_vfork(struct sys_fork_frame *frame);
+int sys_spawn(const char *path,
+              const char **argp,
+              const char **envp,
+              const struct spawn_action *actions,
+              size_t action_count);
 pid_t sys_getpid(void);
 pid_t sys_getppid(void);
 pid_t sys_setsid(void);
@@ -4,6 +4,7 @@
 #include "arch/amd64/cpu.h"
 #endif
 #include "user/signum.h"
+#include "sys/mem/vma.h"
 #include "sys/wait.h"
 #include "sys/list.h"
 #include "fs/vfs.h"
@@ -16,6 +17,7 @@
 #define THREAD_USTACK_BEGIN     0x10000000
 #define THREAD_USTACK_END       0xF0000000
 
+struct sys_fork_frame;
 struct ofile;
 
 enum thread_state {
@@ -35,6 +37,10 @@ enum process_state {
 #define PROC_EMPTY              (1 << 1)
 #define THREAD_FPU_SAVED        (1 << 2)
 #define THREAD_IDLE             (1 << 3)
+// The space is lent to a vfork() child, signals are left pending
+#define PROC_VFORK              (1 << 4)
+// Thread is running a reclaim pass, see mm_reclaim()
+#define THREAD_RECLAIM          (1 << 5)
 
 #define xxx_signal_clear(thr, signum) \
     (thr)->sigq &= ~(1ULL << ((signum) - 1))
@@ -73,11 +79,23 @@ struct thread {
 
     // Scheduler
     int cpu;
+    // NUMA node thread's kernel stack resides on, preferred when
+    // choosing a CPU queue
+    int node;
     struct thread *sched_prev, *sched_next;
 };
 
 struct process {
     mm_space_t space;
+    // CPUs which have the space loaded, their count and the PCID of
+    // the space on each of them, see arch/amd64/mm/tlb.c
+    uint64_t space_cpus;
+    int space_refs;
+    uint64_t space_pcid[AMD64_MAX_SMP];
+    // Serializes changes to the mappings and areas of the space (page
+    // faults, mmap(), munmap()), see tlb_space_lock()
+    spin_t space_lock;
+    struct vm_map vmas;
     size_t image_end;
     size_t brk;
 
@@ -96,6 +114,10 @@ struct process {
 
     // Wait
     struct io_notify pid_notify;
+    // Set while the space of the parent is lent to this process by
+    // vfork(), the parent waits on its vfork_notify for it back
+    struct process *vfork_parent;
+    struct io_notify vfork_notify;
 
     // Signal
     uint64_t sigq;
@@ -127,6 +149,9 @@ struct thread *process_first_thread(struct process *proc);
 #define THR_INIT_USER           (1 << 0)
 #define THR_INIT_STACK_SET      (1 << 1)
 int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags);
+/// Allocate a zeroed thread struct
+struct thread *thread_alloc(void);
+void thread_free(struct thread *thr);
 void thread_dump(int level, struct thread *thr);
 
 void proc_add_entry(struct process *proc);
@@ -135,6 +160,19 @@ void proc_del_entry(struct process *proc);
 struct process *process_child(struct process *of, pid_t pid);
 void process_unchild(struct process *proc);
 void process_free(struct process *proc);
+/// Allocate a child of the current process with a copy of its descriptors
+/// and a single thread, its space is left for the caller to set up
+struct process *process_fork_alloc(struct thread **thr);
+/// Queue the child to return to userspace with the registers of \p frame
+void process_fork_enter(struct process *dst, struct thread *thr, const struct sys_fork_frame *frame);
+/// Destroy a child allocated by process_fork_alloc() which was not started
+void process_fork_abort(struct process *dst);
+/// Give the space lent by vfork() back to the parent and wake it up
+void process_vfork_release(struct process *proc);
+/// Allocate a zeroed process struct
+struct process *process_alloc(void);
+/// Free a process struct which has not been started
+void process_dealloc(struct process *proc);
 
 struct process *process_find(pid_t pid);
 int thread_check_signal(struct thread *thr, int ret);
@@ -8,3 +8,4 @@
 
 #define PROT_READ           (1 << 0)
 #define PROT_WRITE          (1 << 1)
+#define PROT_EXEC           (1 << 2)
@@ -0,0 +1,20 @@
+#pragma once
+#include "sys/types.h"
+
+// File actions applied to the descriptors of the child in order,
+// before the image is loaded
+#define SPAWN_OPEN              1
+#define SPAWN_CLOSE             2
+#define SPAWN_DUP2              3
+
+struct spawn_action {
+    int type;
+    // Descriptor of the child opened, closed or duplicated to
+    int fd;
+    // SPAWN_DUP2: descriptor of the child duplicated
+    int src_fd;
+    // SPAWN_OPEN
+    int flags;
+    mode_t mode;
+    const char *path;
+};
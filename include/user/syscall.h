@@ -48,6 +48,7 @@
 #define SYSCALL_NR_GETPID           39
 #define SYSCALL_NR_CLONE            56
 #define SYSCALL_NR_FORK             57
+#define SYSCALL_NR_VFORK            58
 #define SYSCALL_NR_EXECVE           59
 #define SYSCALL_NR_EXIT             60
 #define SYSCALL_NR_KILL             62
@@ -61,6 +62,7 @@
 #define SYSCALL_NR_GETPGID          121
 #define SYSCALL_NR_SIGALTSTACK      131
 #define SYSCALL_NRX_WAITPID         247
+#define SYSCALL_NRX_SPAWN           251
 
 #define SYSCALL_NR_SOCKET           41
 #define SYSCALL_NR_CONNECT          42
@@ -1,4 +1,5 @@
 #include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
 #include "arch/amd64/cpu.h"
 #include "user/socket.h"
 #include "sys/thread.h"
@@ -17,6 +18,7 @@
 
 //static struct thread netd_thread = {0};
 static struct packet_queue g_rxq;
+static struct slab_cache *packet_qh_cache = NULL;
 
 static void packet_free(struct packet *p);
 
@@ -44,7 +46,7 @@ static inline void net_handle_packet(struct packet *p) {
 //}
 
 static inline struct packet_qh *packet_qh_create(struct packet *p) {
-    struct packet_qh *qh = kmalloc(sizeof(struct packet_qh));
+    struct packet_qh *qh = slab_alloc(packet_qh_cache);
     _assert(qh);
     qh->packet = p;
     return qh;
@@ -77,11 +79,18 @@ struct packet *packet_queue_pop(struct packet_queue *pq) {
     }
     spin_release_irqrestore(&pq->lock, &irq);
     struct packet *p = qh->packet;
-    kfree(qh);
+    slab_free(packet_qh_cache, qh);
     return p;
 }
 
 void packet_queue_init(struct packet_queue *pq) {
+    // Queues are pushed to from interrupt handlers, so create
+    // the cache beforehand
+    if (!packet_qh_cache) {
+        packet_qh_cache = slab_cache_create("packet_qh", sizeof(struct packet_qh), NULL, NULL);
+        _assert(packet_qh_cache);
+    }
+
     pq->lock = 0;
     pq->head = NULL;
     pq->tail = NULL;
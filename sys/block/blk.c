@@ -1,4 +1,5 @@
 #include "sys/block/part_gpt.h"
+#include "sys/mem/reclaim.h"
 #include "user/errno.h"
 #include "sys/block/blk.h"
 #include "fs/node.h"
@@ -8,6 +9,7 @@
 #include "fs/fs.h"
 #include "sys/debug.h"
 #include "sys/heap.h"
+#include "sys/attr.h"
 #include "sys/dev.h"
 #include "sys/mm.h"
 
@@ -69,6 +71,35 @@ void blk_sync_all(void) {
     }
 }
 
+//// Memory pressure
+
+static size_t blk_cache_shrink_count(struct shrinker *s) {
+    size_t count = 0;
+    for (struct block_cache *cache = g_cache_head; cache; cache = cache->g_next) {
+        count += cache->size;
+    }
+    return count;
+}
+
+static size_t blk_cache_shrink_scan(struct shrinker *s, size_t nr, int flags) {
+    size_t freed = 0;
+    for (struct block_cache *cache = g_cache_head; cache && freed < nr; cache = cache->g_next) {
+        // Dirty pages are only written back from the reclaim daemon
+        freed += block_cache_shrink(cache, nr - freed, !(flags & RECLAIM_DIRECT));
+    }
+    return freed;
+}
+
+static struct shrinker blk_cache_shrinker = {
+    .name = "block cache",
+    .count = blk_cache_shrink_count,
+    .scan = blk_cache_shrink_scan
+};
+
+__init(blk_cache_shrinker_init) {
+    shrinker_register(&blk_cache_shrinker);
+}
+
 int blk_mmap(struct blkdev *blk, uintptr_t base, size_t page_count, int prot, int flags) {
     _assert(blk);
     if (blk->mmap) {
@@ -102,15 +133,13 @@ ssize_t blk_read(struct blkdev *blk, void *buf, size_t off, size_t lim) {
             size_t blk_off = off % page_size;
             size_t can = MIN(page_size - blk_off, rem);
 
-            if (block_cache_get(&blk->cache, index * page_size, &page) != 0) {
-                // Fetch page from device
-                if ((err = blk_read_really(blk, (void *) MM_VIRTUALIZE(page), index * page_size, page_size)) < 0) {
-                    kerror("Read failed: %s\n", kstrerror(err));
-                    panic("TODO: deal with to-cache reads\n");
-                }
+            if ((err = block_cache_get(&blk->cache, index * page_size, &page)) != 0) {
+                kerror("Read failed: %s\n", kstrerror(err));
+                return bread ? (ssize_t) bread : err;
             }
 
             memcpy(buf, (void *) MM_VIRTUALIZE(page + blk_off), can);
+            block_cache_put(&blk->cache, index * page_size);
 
             rem -= can;
             buf += can;
@@ -142,6 +171,16 @@ int blk_page_sync(struct blkdev *blk, uintptr_t block_address, uintptr_t page) {
     }
 }
 
+int blk_page_load(struct blkdev *blk, uintptr_t block_address, uintptr_t page) {
+    ssize_t res = blk_read_really(blk, (void *) MM_VIRTUALIZE(page), block_address, blk->cache.page_size);
+    if (res < 0) {
+        return res;
+    }
+    // The last page of the device may be a partial one
+    memset((void *) MM_VIRTUALIZE(page + res), 0, blk->cache.page_size - res);
+    return 0;
+}
+
 ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t lim) {
     _assert(blk);
     if (blk->flags & BLK_CACHE) {
@@ -156,16 +195,14 @@ ssize_t blk_write(struct blkdev *blk, const void *buf, size_t off, size_t lim) {
             size_t blk_off = off % page_size;
             size_t can = MIN(page_size - blk_off, rem);
 
-            if (block_cache_get(&blk->cache, index * page_size, &page) != 0) {
-                // Fetch page
-                if ((err = blk_read_really(blk, (void *) MM_VIRTUALIZE(page), index * page_size, page_size)) < 0) {
-                    kerror("Read failed: %s\n", kstrerror(err));
-                    panic("TODO: deal with to-cache reads\n");
-                }
+            if ((err = block_cache_get(&blk->cache, index * page_size, &page)) != 0) {
+                kerror("Read failed: %s\n", kstrerror(err));
+                return bwritten ? (ssize_t) bwritten : err;
             }
 
             memcpy((void *) MM_VIRTUALIZE(page + blk_off), buf, can);
             block_cache_mark_dirty(&blk->cache, index * page_size);
+            block_cache_put(&blk->cache, index * page_size);
 
             rem -= can;
             buf += can;
@@ -1,9 +1,10 @@
-// TODO: SMP/thread safety
 #include "sys/block/cache.h"
 #include "sys/block/blk.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
 #include "sys/string.h"
 #include "sys/assert.h"
+#include "user/errno.h"
 #include "sys/debug.h"
 #include "sys/heap.h"
 #include "sys/mm.h"
@@ -17,9 +18,28 @@ struct lru_node {
         uintptr_t page;             // For LRU
         struct lru_node *index;     // For index hash
     };
+    // For LRU: number of block_cache_get() callers copying from or
+    // to the page, which is not released until they're done
+    size_t refs;
     struct lru_node *prev, *next;
 };
 
+static struct slab_cache *lru_node_cache = NULL;
+
+// Constructed nodes are unlinked and unpinned
+static void lru_node_ctor(void *objp) {
+    struct lru_node *node = objp;
+
+    node->refs = 0;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void lru_node_free(struct lru_node *node) {
+    lru_node_ctor(node);
+    slab_free(lru_node_cache, node);
+}
+
 ////
 
 static inline size_t lru_hash_reference(uintptr_t address) {
@@ -38,9 +58,10 @@ static struct lru_node *lru_hash_lookup(struct lru_hash *hash, uintptr_t address
     return NULL;
 }
 
-static int lru_hash_insert(struct lru_hash *hash, uintptr_t address, struct lru_node *index) {
+// Hash nodes are allocated by the caller, so that no allocation
+// happens while the cache is locked
+static int lru_hash_insert(struct lru_hash *hash, uintptr_t address, struct lru_node *node, struct lru_node *index) {
     size_t bucket_index = lru_hash_reference(address) % hash->bucket_count;
-    struct lru_node *node = kmalloc(sizeof(struct lru_node));
     _assert(node);
 
     node->block_address = address;
@@ -79,7 +100,7 @@ static int lru_hash_remove(struct lru_hash *hash, uintptr_t address) {
         hash->bucket_tails[bucket_index] = prev;
     }
 
-    kfree(node);
+    lru_node_free(node);
 
     return 0;
 }
@@ -96,11 +117,17 @@ static void lru_hash_init(struct lru_hash *hash, size_t capacity) {
 ////
 
 void block_cache_init(struct block_cache *cache, struct blkdev *blk, size_t page_size, size_t capacity) {
+    if (!lru_node_cache) {
+        lru_node_cache = slab_cache_create("lru_node", sizeof(struct lru_node), lru_node_ctor, NULL);
+        _assert(lru_node_cache);
+    }
+
     cache->page_size = page_size;
     cache->capacity = capacity;
     cache->queue_head = NULL;
     cache->queue_tail = NULL;
     cache->size = 0;
+    cache->lock = 0;
     cache->blk = blk;
     lru_hash_init(&cache->index_hash, 32);
 }
@@ -125,29 +152,6 @@ static void block_cache_queue_push_node(struct block_cache *cache, struct lru_no
     ++cache->size;
 }
 
-static void block_cache_queue_pop_tail(struct block_cache *cache) {
-    struct lru_node *last = cache->queue_tail;
-    _assert(last);
-    _assert(lru_hash_remove(&cache->index_hash, last->block_address) == 0);
-    cache->queue_tail = last->prev;
-    if (cache->queue_tail) {
-        cache->queue_tail->next = NULL;
-    } else {
-        _assert(cache->size == 1);
-        cache->queue_head = NULL;
-    }
-    --cache->size;
-}
-
-static struct lru_node *block_cache_queue_push_head(struct block_cache *cache, uintptr_t address, uintptr_t page) {
-    struct lru_node *node = kmalloc(sizeof(struct lru_node));
-    node->block_address = address;
-    node->page = page;
-    _assert(node);
-    block_cache_queue_push_node(cache, node);
-    return node;
-}
-
 static void block_cache_queue_erase(struct block_cache *cache, struct lru_node *node) {
     struct lru_node *prev = node->prev;
     struct lru_node *next = node->next;
@@ -166,12 +170,59 @@ static void block_cache_queue_erase(struct block_cache *cache, struct lru_node *
     --cache->size;
 }
 
-static void block_cache_page_release(struct block_cache *cache, uintptr_t address, uintptr_t page) {
-    if (page & LRU_PAGE_DIRTY) {
-        kdebug("Block cache: write page %p\n", page & LRU_PAGE_MASK);
-        _assert(blk_page_sync(cache->blk, address * cache->page_size, page & LRU_PAGE_MASK) == 0);
+// Pick the least recently used page nobody is using right now. Clean
+// pages are detached right away. Dirty ones stay indexed and pinned
+// until written back by block_cache_evict_finish(), so that lookups
+// meanwhile find the data which is not on the device yet
+static struct lru_node *block_cache_queue_evict(struct block_cache *cache, int sync, int *writeback) {
+    struct lru_node *node;
+
+    for (node = cache->queue_tail; node; node = node->prev) {
+        // Writeback is not allowed, only clean pages can be dropped
+        if (!node->refs && (sync || !(node->page & LRU_PAGE_DIRTY))) {
+            break;
+        }
+    }
+
+    if (node) {
+        if ((*writeback = !!(node->page & LRU_PAGE_DIRTY))) {
+            node->page &= ~LRU_PAGE_DIRTY;
+            ++node->refs;
+        } else {
+            _assert(lru_hash_remove(&cache->index_hash, node->block_address) == 0);
+            block_cache_queue_erase(cache, node);
+        }
+    }
+
+    return node;
+}
+
+// Called unlocked for a node picked by block_cache_queue_evict().
+// Returns 1 if the page was released, 0 if it was used or modified
+// again while being written back and so stays in the cache
+static int block_cache_evict_finish(struct block_cache *cache, struct lru_node *node, int writeback) {
+    uintptr_t irq;
+
+    if (writeback) {
+        kdebug("Block cache: write page %p\n", node->page & LRU_PAGE_MASK);
+        _assert(blk_page_sync(cache->blk,
+                              node->block_address * cache->page_size,
+                              node->page & LRU_PAGE_MASK) == 0);
+
+        spin_lock_irqsave(&cache->lock, &irq);
+        _assert(node->refs);
+        if (--node->refs || (node->page & LRU_PAGE_DIRTY)) {
+            spin_release_irqrestore(&cache->lock, &irq);
+            return 0;
+        }
+        _assert(lru_hash_remove(&cache->index_hash, node->block_address) == 0);
+        block_cache_queue_erase(cache, node);
+        spin_release_irqrestore(&cache->lock, &irq);
     }
-    mm_phys_free_page(page & LRU_PAGE_MASK);
+
+    mm_phys_free_page(node->page & LRU_PAGE_MASK);
+    lru_node_free(node);
+    return 1;
 }
 
 static uintptr_t block_cache_page_alloc(struct block_cache *cache) {
@@ -181,10 +232,14 @@ static uintptr_t block_cache_page_alloc(struct block_cache *cache) {
 }
 
 void block_cache_mark_dirty(struct block_cache *cache, uintptr_t address) {
+    uintptr_t irq;
+
     // Convert address to block index
     _assert((address % cache->page_size) == 0);
     address /= cache->page_size;
 
+    spin_lock_irqsave(&cache->lock, &irq);
+
     // Lookup index in cache
     struct lru_node *index = lru_hash_lookup(&cache->index_hash, address);
     // Must be present in cache
@@ -193,56 +248,162 @@ void block_cache_mark_dirty(struct block_cache *cache, uintptr_t address) {
     _assert(node);
 
     node->page |= LRU_PAGE_DIRTY;
+
+    spin_release_irqrestore(&cache->lock, &irq);
+}
+
+// Take a reference to the page of a cached block
+static void block_cache_hit(struct block_cache *cache, struct lru_node *index, uintptr_t *page) {
+    struct lru_node *node = index->index;
+    _assert(node);
+    _assert(node->block_address == index->block_address);
+    *page = node->page & LRU_PAGE_MASK;
+    ++node->refs;
+
+    // Put reference to the head
+    block_cache_queue_erase(cache, node);
+    block_cache_queue_push_node(cache, node);
 }
 
 int block_cache_get(struct block_cache *cache, uintptr_t address, uintptr_t *page) {
+    struct lru_node *node, *index, *victim = NULL;
+    int writeback = 0;
+    uintptr_t result;
+    uintptr_t irq;
+    int res;
+
     // Convert address to block index
     _assert((address % cache->page_size) == 0);
     address /= cache->page_size;
 
+    spin_lock_irqsave(&cache->lock, &irq);
+
     // Lookup index in cache
-    struct lru_node *index = lru_hash_lookup(&cache->index_hash, address);
+    if ((index = lru_hash_lookup(&cache->index_hash, address)) != NULL) {
+        block_cache_hit(cache, index, page);
+        spin_release_irqrestore(&cache->lock, &irq);
+        return 0;
+    }
+
+    // Remove the least recently used element
+    if (cache->size >= cache->capacity) {
+        victim = block_cache_queue_evict(cache, 1, &writeback);
+    }
+
+    spin_release_irqrestore(&cache->lock, &irq);
 
-    if (!index) {
-        // Remove the least recently used element
-        if (cache->capacity == cache->size) {
-            _assert(cache->queue_tail);
-            uintptr_t old_page = cache->queue_tail->page;
-            block_cache_page_release(cache, cache->queue_tail->block_address, cache->queue_tail->page);
-            block_cache_queue_pop_tail(cache);
+    // Page release may write the page back, allocation may reclaim
+    // memory from this very cache and the page is read from the
+    // device, so do all of it unlocked
+    if (victim) {
+        block_cache_evict_finish(cache, victim, writeback);
+    }
+
+    if ((result = block_cache_page_alloc(cache)) == MM_NADDR) {
+        return -ENOMEM;
+    }
+    if ((res = blk_page_load(cache->blk, address * cache->page_size, result)) != 0) {
+        mm_phys_free_page(result);
+        return res;
+    }
+    node = slab_alloc(lru_node_cache);
+    index = slab_alloc(lru_node_cache);
+    if (!node || !index) {
+        if (node) {
+            lru_node_free(node);
+        }
+        if (index) {
+            lru_node_free(index);
         }
+        mm_phys_free_page(result);
+        return -ENOMEM;
+    }
+
+    node->block_address = address;
+    node->page = result;
+    node->refs = 1;
+
+    spin_lock_irqsave(&cache->lock, &irq);
+    if ((victim = lru_hash_lookup(&cache->index_hash, address)) != NULL) {
+        // Someone else has read the block meanwhile, use their page,
+        // which may have been modified since
+        block_cache_hit(cache, victim, page);
+        spin_release_irqrestore(&cache->lock, &irq);
+
+        lru_node_free(node);
+        lru_node_free(index);
+        mm_phys_free_page(result);
+        return 0;
+    }
 
-        uintptr_t result = block_cache_page_alloc(cache);
-        _assert(result != MM_NADDR);
+    // Insert a new reference
+    block_cache_queue_push_node(cache, node);
+    lru_hash_insert(&cache->index_hash, address, index, node);
+    spin_release_irqrestore(&cache->lock, &irq);
 
-        // Insert a new reference
-        struct lru_node *node = block_cache_queue_push_head(cache, address, result);
-        _assert(node);
-        lru_hash_insert(&cache->index_hash, address, node);
+    *page = result;
+    return 0;
+}
 
-        *page = result;
-        return -1;
-    } else {
-        // Put reference to the head
-        struct lru_node *node = index->index;
-        _assert(node);
-        _assert(node->block_address == index->block_address);
-        *page = node->page & LRU_PAGE_MASK;
+void block_cache_put(struct block_cache *cache, uintptr_t address) {
+    struct lru_node *index;
+    uintptr_t irq;
 
-        block_cache_queue_erase(cache, node);
-        block_cache_queue_push_node(cache, node);
+    _assert((address % cache->page_size) == 0);
+    address /= cache->page_size;
 
-        return 0;
+    spin_lock_irqsave(&cache->lock, &irq);
+    index = lru_hash_lookup(&cache->index_hash, address);
+    _assert(index && index->index && index->index->refs);
+    --index->index->refs;
+    spin_release_irqrestore(&cache->lock, &irq);
+}
+
+size_t block_cache_shrink(struct block_cache *cache, size_t count, int sync) {
+    struct lru_node *node;
+    size_t released = 0;
+    uintptr_t irq;
+    int writeback;
+
+    // Pages kept after a writeback count as tries too, so that
+    // a page modified over and over can't keep us here
+    for (size_t i = 0; i < count; ++i) {
+        spin_lock_irqsave(&cache->lock, &irq);
+        node = block_cache_queue_evict(cache, sync, &writeback);
+        spin_release_irqrestore(&cache->lock, &irq);
+
+        if (!node) {
+            break;
+        }
+
+        released += block_cache_evict_finish(cache, node, writeback);
     }
+
+    return released;
 }
 
 void block_cache_flush(struct block_cache *cache) {
     // Write all "dirty" pages and release the whole cache to force
     // reload from disk
     struct lru_node *node;
+    uintptr_t irq;
+    int writeback;
+
+    while (1) {
+        spin_lock_irqsave(&cache->lock, &irq);
+        if (!cache->queue_tail) {
+            spin_release_irqrestore(&cache->lock, &irq);
+            break;
+        }
+        // Pages still in use are only held for a copy,
+        // wait for them to be released
+        node = block_cache_queue_evict(cache, 1, &writeback);
+        spin_release_irqrestore(&cache->lock, &irq);
+
+        if (!node) {
+            continue;
+        }
 
-    while ((node = cache->queue_tail) != NULL) {
-        block_cache_page_release(cache, node->block_address, node->page);
-        block_cache_queue_pop_tail(cache);
+        block_cache_evict_finish(cache, node, writeback);
     }
 }
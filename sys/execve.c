@@ -1,12 +1,15 @@
 #include "arch/amd64/mm/pool.h"
 #include "arch/amd64/context.h"
 #include "arch/amd64/mm/map.h"
-#include "sys/mem/vmalloc.h"
+#include "sys/mem/vma.h"
 #include "sys/binfmt_elf.h"
 #include "sys/sys_proc.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
 #include "user/errno.h"
 #include "user/fcntl.h"
+#include "user/mman.h"
+#include "user/spawn.h"
 #include "sys/assert.h"
 #include "sys/string.h"
 #include "sys/thread.h"
@@ -114,21 +117,21 @@ static int procv_setup(const char *const argv[],
 #undef PTRS_PER_PAGE
 }
 
-int sys_execve(const char *path, const char **argv, const char **envp) {
-    struct thread *thr = thread_self;
-    _assert(thr);
-    struct process *proc = thr->proc;
-    _assert(proc);
+// Load the image of path into proc and set up its thread to enter it.
+// If proc is the current process, its old space is dropped, otherwise it's
+// a spawned one, the space of which is still empty
+static int exec_load(struct process *proc,
+                     struct thread *thr,
+                     const char *path,
+                     const char **argv,
+                     const char **envp,
+                     uintptr_t *entry_arg,
+                     uintptr_t *entry) {
+    int self = (proc == thread_self->proc);
     char shebang[128];
 
-    if (proc->thread_count > 1) {
-        panic("XXX: execve() in multithreaded process\n");
-    }
-
     struct ofile fd = {0};
     struct stat st;
-    uintptr_t entry;
-    size_t argc;
     int res;
     int was_kernel = 0;
 
@@ -144,7 +147,9 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
 
     if ((res = vfs_read(&proc->ioctx, &fd, shebang, sizeof(shebang))) <= 0) {
         kerror("%s: %s\n", path, kstrerror(res));
-        return res;
+        vfs_close(&proc->ioctx, &fd);
+        // Nothing to load from an empty file
+        return res ? res : -ENOEXEC;
     }
 
     if (!binfmt_is_elf(shebang, res)) {
@@ -171,7 +176,7 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
             }
             argv_new[argc] = NULL;
 
-            return sys_execve(shebang + 2, argv_new, envp);
+            return exec_load(proc, thr, shebang + 2, argv_new, envp, entry_arg, entry);
         }
     } else {
         int is_dynamic = 0;
@@ -195,7 +200,7 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
             }
             argv_new[argc + 2] = NULL;
 
-            return sys_execve(argv_new[0], argv_new, envp);
+            return exec_load(proc, thr, argv_new[0], argv_new, envp, entry_arg, entry);
         }
     }
 
@@ -257,16 +262,27 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
 
         thr->data.cr3 = MM_PHYS(proc->space);
         // Switch CR3 to the newly allocated space!
-        asm volatile ("movq %0, %%rax; movq %%rax, %%cr3"::"a"(thr->data.cr3));
+        tlb_switch(proc);
         asm volatile ("sti");
-    } else {
+    } else if (proc->vfork_parent) {
+        // The space belongs to the parent, give it back instead
+        process_vfork_release(proc);
+        tlb_switch(proc);
+    } else if (self) {
         mm_space_release(proc);
     }
 
-    if ((res = elf_load(proc, &proc->ioctx, &fd, &entry)) != 0) {
+    if ((res = elf_load(proc, &proc->ioctx, &fd, entry)) != 0) {
         vfs_close(&proc->ioctx, &fd);
 
         kerror("elf load failed: %s\n", kstrerror(res));
+        if (!self) {
+            // Not mapped yet
+            for (size_t i = 0; i < procv_page_count; ++i) {
+                mm_phys_free_page(procv_phys_pages[i]);
+            }
+            return res;
+        }
         sys_exit(-1);
 
         panic("This code shouldn't run\n");
@@ -283,7 +299,16 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
     }
 
     // Allocate a virtual address to map argp page
-    uintptr_t procv_virt = vmfind(proc->space, 0x100000, 0xF0000000, procv_page_count);
+    uintptr_t procv_virt = vma_alloc(&proc->vmas,
+                                     0x100000,
+                                     0xF0000000,
+                                     procv_page_count,
+                                     1,
+                                     PROT_READ | PROT_WRITE,
+                                     0,
+                                     VMA_ANON,
+                                     NULL,
+                                     0);
     _assert(procv_virt != MM_NADDR);
     for (size_t i = 0; i < procv_page_count; ++i) {
         _assert(mm_map_single(proc->space,
@@ -311,13 +336,18 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
     thr->data.rsp0 = thr->data.rsp0_top;
 
     // Allocate a new user stack
-    uintptr_t ustack = vmfind(proc->space, THREAD_USTACK_BEGIN, THREAD_USTACK_END, THREAD_USTACK_PAGES);
+    uintptr_t ustack = vma_alloc(&proc->vmas,
+                                 THREAD_USTACK_BEGIN,
+                                 THREAD_USTACK_END,
+                                 THREAD_USTACK_PAGES,
+                                 1,
+                                 PROT_READ | PROT_WRITE,
+                                 0,
+                                 VMA_STACK,
+                                 NULL,
+                                 0);
+    // Stack pages are allocated on first access
     _assert(ustack != MM_NADDR);
-    for (size_t i = 0; i < THREAD_USTACK_PAGES; ++i) {
-        uintptr_t phys = mm_phys_alloc_page(PU_PRIVATE);
-        _assert(phys != MM_NADDR);
-        mm_map_single(proc->space, ustack + i * MM_PAGE_SIZE, phys, MM_PAGE_WRITE | MM_PAGE_USER);
-    }
 
     thr->data.rsp3_base = ustack;
     thr->data.rsp3_size = MM_PAGE_SIZE * THREAD_USTACK_PAGES;
@@ -329,9 +359,117 @@ int sys_execve(const char *path, const char **argv, const char **envp) {
     // Up to 4095 argc and envc
     _assert(procv_vecp[0] < 4096);
     _assert(procv_vecp[2] < 4096);
-    uintptr_t arg = procv_vecp[0] | (procv_vecp[2] << 12) | ((uintptr_t) argv_fixup << 12);
+    *entry_arg = procv_vecp[0] | (procv_vecp[2] << 12) | ((uintptr_t) argv_fixup << 12);
+
+    return 0;
+}
+
+int sys_execve(const char *path, const char **argv, const char **envp) {
+    struct thread *thr = thread_self;
+    _assert(thr);
+    struct process *proc = thr->proc;
+    _assert(proc);
+    uintptr_t entry, arg;
+    int res;
+
+    if (proc->thread_count > 1) {
+        panic("XXX: execve() in multithreaded process\n");
+    }
+
+    if ((res = exec_load(proc, thr, path, argv, envp, &arg, &entry)) != 0) {
+        return res;
+    }
+
     context_exec_enter(arg, thr, thr->data.rsp3_base + thr->data.rsp3_size - 8, entry);
 
     panic("This code shouldn't run\n");
 }
 
+static int spawn_action(struct process *proc, const struct spawn_action *act) {
+    struct ofile *ofile;
+    int res;
+
+    if (act->fd < 0 || act->fd >= THREAD_MAX_FDS) {
+        return -EBADF;
+    }
+
+    switch (act->type) {
+    case SPAWN_OPEN:
+        userptr_check(act->path);
+        ofile = ofile_create();
+
+        if ((res = vfs_openat(&proc->ioctx, ofile, NULL, act->path, act->flags, act->mode)) != 0) {
+            ofile_destroy(ofile);
+            return res;
+        }
+        break;
+    case SPAWN_CLOSE:
+        ofile = NULL;
+        break;
+    case SPAWN_DUP2:
+        if (act->src_fd < 0 || act->src_fd >= THREAD_MAX_FDS || !proc->fds[act->src_fd]) {
+            return -EBADF;
+        }
+        if (act->src_fd == act->fd) {
+            return 0;
+        }
+        ofile = proc->fds[act->src_fd];
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (proc->fds[act->fd]) {
+        ofile_close(&proc->ioctx, proc->fds[act->fd]);
+    }
+    proc->fds[act->fd] = ofile ? ofile_dup(ofile) : NULL;
+
+    return 0;
+}
+
+// fork() + execve() without ever copying the space of the caller: the
+// child gets an empty space which the image and the arguments are loaded
+// into right here, and starts at the entry point of the image
+int sys_spawn(const char *path,
+              const char **argv,
+              const char **envp,
+              const struct spawn_action *actions,
+              size_t action_count) {
+    struct sys_fork_frame frame = {0};
+    struct thread *dst_thread;
+    struct process *dst;
+    uintptr_t entry, arg;
+    int res;
+
+    userptr_check(path);
+    if (action_count) {
+        userptr_check(actions);
+    }
+
+    dst = process_fork_alloc(&dst_thread);
+    dst->space = amd64_mm_pool_alloc();
+    _assert(dst->space);
+    mm_space_clone(dst->space, mm_kernel, MM_CLONE_FLG_KERNEL);
+
+    for (size_t i = 0; i < action_count; ++i) {
+        if ((res = spawn_action(dst, &actions[i])) != 0) {
+            process_fork_abort(dst);
+            return res;
+        }
+    }
+
+    if ((res = exec_load(dst, dst_thread, path, argv, envp, &arg, &entry)) != 0) {
+        process_fork_abort(dst);
+        return res;
+    }
+
+    // Same entry state as context_exec_enter() sets up
+    frame.rip = entry;
+    frame.rsp = dst_thread->data.rsp3_base + dst_thread->data.rsp3_size - 8;
+    frame.rflags = 0x200;
+    frame.rdi = arg;
+    process_fork_enter(dst, dst_thread, &frame);
+
+    return dst->pid;
+}
+
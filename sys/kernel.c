@@ -2,6 +2,7 @@
 #include "arch/amd64/syscall.h"
 #include "drivers/pci/pci.h"
 #include "drivers/usb/usb.h"
+#include "sys/mem/reclaim.h"
 #include "sys/char/tty.h"
 #include "sys/console.h"
 #include "sys/display.h"
@@ -42,6 +43,7 @@ void main(void) {
 
     syscall_init();
     sched_init();
+    mm_reclaim_daemon_start();
 
 #if defined(ENABLE_NET)
     net_init();
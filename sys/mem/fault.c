@@ -0,0 +1,187 @@
+#include "sys/mem/shmem.h"
+#include "sys/mem/fault.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/vma.h"
+#include "sys/mem/tlb.h"
+#include "fs/pcache.h"
+#include "fs/node.h"
+#include "sys/assert.h"
+#include "user/mman.h"
+#include "sys/string.h"
+#include "sys/thread.h"
+#include "sys/debug.h"
+#include "sys/mm.h"
+
+// Private zero-filled memory: reads map the shared zero page, the first
+// write replaces it with a page of the process' own
+static int vm_fault_anon(struct process *proc, struct vm_area *area, uintptr_t virt, int flags) {
+    mm_space_t space = proc->space;
+    uintptr_t huge_virt = virt & ~MM_PAGE_L2_OFFSET_MASK;
+    uintptr_t phys, old;
+
+    old = mm_map_get(space, virt, NULL);
+
+    if (!(flags & VM_FAULT_WRITE)) {
+        _assert(old == MM_NADDR);
+        return mm_map_single(space, virt, mm_zero_page, MM_PAGE_USER);
+    }
+
+    // Large mmap()ed regions get 2MiB pages for the aligned blocks
+    // touched while nothing is mapped there yet
+    if ((area->flags & VMA_MMAPED) &&
+        huge_virt >= area->start &&
+        huge_virt + MM_HUGE_PAGE_SIZE <= area->end &&
+        mm_map_huge_avail(space, huge_virt) &&
+        (phys = mm_phys_alloc_huge_page(PU_PRIVATE)) != MM_NADDR) {
+        memset((void *) MM_VIRTUALIZE(phys), 0, MM_HUGE_PAGE_SIZE);
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+
+        return mm_map_single(space, huge_virt, phys, MM_PAGE_USER | MM_PAGE_WRITE | MM_PAGE_HUGE);
+    }
+
+    if ((phys = mm_phys_alloc_zeroed_page(PU_PRIVATE)) == MM_NADDR) {
+        return -1;
+    }
+    if (area->flags & VMA_MMAPED) {
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+    }
+
+    if (old == mm_zero_page) {
+        _assert(mm_umap_single(space, virt, MM_UMAP_4K) == old);
+        _assert(mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
+        // Other threads may still be reading the zero page there
+        tlb_shootdown(proc, virt, virt + MM_PAGE_SIZE);
+        return 0;
+    }
+
+    _assert(old == MM_NADDR);
+    return mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE);
+}
+
+// File mapping: pages of the file's cache are mapped read-only and
+// shared by everyone. A write to a private mapping copies the page,
+// a write to a shared one marks the cached page dirty. Pages which
+// are not cached yet are read by vm_fault_fill() without the space
+// lock held
+static int vm_fault_file(struct process *proc, struct vm_area *area, uintptr_t virt, int flags) {
+    mm_space_t space = proc->space;
+    size_t index = (area->offset + virt - area->start) / MM_PAGE_SIZE;
+    uint64_t map_flags = MM_PAGE_USER;
+    struct tlb_batch batch;
+    uintptr_t phys, old;
+    int res;
+
+    old = mm_map_get(space, virt, NULL);
+    tlb_batch_init(&batch, proc);
+
+    if (!(flags & VM_FAULT_WRITE) || (area->flags & VMA_SHARED)) {
+        if (pcache_find(area->object, index, &phys) != 0) {
+            return VM_FAULT_MISS;
+        }
+
+        if (old != MM_NADDR) {
+            // Write to a page mapped on read, which may be a stale one
+            // if the cache has been invalidated since
+            _assert(flags & VM_FAULT_WRITE);
+            _assert(mm_umap_release(space, virt, MM_UMAP_4K, &batch) == old);
+        }
+
+        if (flags & VM_FAULT_WRITE) {
+            PHYS2PAGE(phys)->flags |= PG_DIRTY;
+            map_flags |= MM_PAGE_WRITE;
+        }
+
+        res = mm_map_single(space, virt, phys, map_flags);
+        pcache_put(phys);
+
+        if (old != MM_NADDR && old != phys) {
+            tlb_batch_add(&batch, virt, virt + MM_PAGE_SIZE);
+        }
+        tlb_batch_flush(&batch);
+        return res;
+    }
+
+    if ((phys = mm_phys_alloc_page(PU_PRIVATE)) == MM_NADDR) {
+        return -1;
+    }
+    if (area->flags & VMA_MMAPED) {
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+    }
+
+    if (old != MM_NADDR) {
+        // Copy what the process has seen so far, the cache may have
+        // been invalidated since the page was mapped
+        memcpy((void *) MM_VIRTUALIZE(phys), (const void *) MM_VIRTUALIZE(old), MM_PAGE_SIZE);
+        _assert(mm_umap_release(space, virt, MM_UMAP_4K, &batch) == old);
+        _assert(mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE) == 0);
+        // Other threads may still be reading the page of the cache
+        tlb_batch_add(&batch, virt, virt + MM_PAGE_SIZE);
+        tlb_batch_flush(&batch);
+        return 0;
+    }
+
+    uintptr_t page;
+    if (pcache_find(area->object, index, &page) != 0) {
+        mm_phys_free_page(phys);
+        return VM_FAULT_MISS;
+    }
+    memcpy((void *) MM_VIRTUALIZE(phys), (const void *) MM_VIRTUALIZE(page), MM_PAGE_SIZE);
+    pcache_put(page);
+
+    return mm_map_single(space, virt, phys, MM_PAGE_USER | MM_PAGE_WRITE);
+}
+
+int vm_fault(struct process *proc, uintptr_t addr, int flags) {
+    uintptr_t virt = addr & MM_PAGE_MASK;
+    struct vm_area *area;
+
+    if (!(area = vma_lookup(&proc->vmas, addr))) {
+        return -1;
+    }
+
+    if (!(area->prot & (PROT_READ | PROT_WRITE))) {
+        return -1;
+    }
+    if ((flags & VM_FAULT_WRITE) && !(area->prot & PROT_WRITE)) {
+        return -1;
+    }
+
+    switch (area->type) {
+    case VMA_ANON:
+    case VMA_STACK:
+        return vm_fault_anon(proc, area, virt, flags);
+    case VMA_SHM:
+        return shm_fault(proc->space, area, virt);
+    case VMA_FILE:
+        return vm_fault_file(proc, area, virt, flags);
+    default:
+        // Other kinds of areas are populated when created
+        return -1;
+    }
+}
+
+int vm_fault_fill(struct process *proc, uintptr_t addr, uintptr_t *page) {
+    struct vm_area *area;
+    struct vnode *vn = NULL;
+    size_t index = 0;
+    uintptr_t irq;
+    int res;
+
+    // The area may be unmapped while the page is read, keep the file
+    // open meanwhile
+    tlb_space_lock(proc, &irq);
+    if ((area = vma_lookup(&proc->vmas, addr)) && area->type == VMA_FILE && (vn = area->object)) {
+        index = (area->offset + (addr & MM_PAGE_MASK) - area->start) / MM_PAGE_SIZE;
+        __sync_fetch_and_add(&vn->open_count, 1);
+    }
+    tlb_space_unlock(proc, &irq);
+
+    if (!vn) {
+        return -1;
+    }
+
+    res = pcache_get(vn, index, page);
+    __sync_fetch_and_sub(&vn->open_count, 1);
+
+    return res == 0 ? 0 : -1;
+}
@@ -0,0 +1,246 @@
+#include "sys/mem/profile.h"
+#include "sys/snprintf.h"
+#include "sys/string.h"
+#include "sys/debug.h"
+#include "sys/spin.h"
+#include "sys/syms.h"
+#include "fs/sysfs.h"
+#include "sys/mm.h"
+
+#if defined(ALLOC_PROFILE)
+// Distinct (call site, kind, tag) triples, power of two
+#define PROFILE_SITES           1024
+// Live objects remembered to account their frees, power of two
+#define PROFILE_OBJECTS         32768
+#define PROFILE_BUCKETS         (PROFILE_OBJECTS / 4)
+// Sites listed in the sysfs report
+#define PROFILE_REPORT          64
+
+struct alloc_site {
+    uintptr_t caller;
+    const char *tag;
+    enum alloc_kind kind;
+
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+    // Only tracked objects are counted as live
+    size_t live;
+    size_t live_bytes;
+};
+
+// Object links are table indices + 1, so that zeroed tables are empty
+struct alloc_object {
+    uintptr_t addr;
+    uint32_t size;
+    uint32_t next;
+    uint32_t site;
+};
+
+static const char *const alloc_kind_names[_ALLOC_KIND_COUNT] = {
+    [ALLOC_HEAP] = "heap",
+    [ALLOC_SLAB] = "slab",
+    [ALLOC_PAGE] = "page",
+};
+
+// The profiler is called by the allocators themselves, so it
+// never allocates and only takes its own lock
+static spin_t profile_lock = 0;
+static struct alloc_site profile_sites[PROFILE_SITES];
+static struct alloc_object profile_objects[PROFILE_OBJECTS];
+static uint32_t profile_buckets[PROFILE_BUCKETS];
+static uint32_t profile_free_objects = 0;
+static size_t profile_objects_used = 0;
+// Allocations not accounted because of full tables
+static size_t profile_dropped = 0;
+static size_t profile_untracked = 0;
+
+static inline size_t profile_hash(uintptr_t value) {
+    return (value * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static struct alloc_site *profile_site_get(enum alloc_kind kind, const char *tag, uintptr_t caller) {
+    size_t index = profile_hash(caller ^ (uintptr_t) tag ^ kind);
+
+    for (size_t i = 0; i < PROFILE_SITES; ++i) {
+        struct alloc_site *site = &profile_sites[(index + i) & (PROFILE_SITES - 1)];
+
+        if (!site->caller) {
+            site->caller = caller;
+            site->kind = kind;
+            site->tag = tag;
+            return site;
+        }
+        if (site->caller == caller && site->kind == kind && site->tag == tag) {
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+static struct alloc_object *profile_object_new(void) {
+    struct alloc_object *obj;
+
+    if (profile_free_objects) {
+        obj = &profile_objects[profile_free_objects - 1];
+        profile_free_objects = obj->next;
+        return obj;
+    }
+    if (profile_objects_used < PROFILE_OBJECTS) {
+        return &profile_objects[profile_objects_used++];
+    }
+
+    return NULL;
+}
+
+void alloc_profile_alloc(enum alloc_kind kind, const char *tag, uintptr_t caller, uintptr_t addr, size_t size) {
+    struct alloc_object *obj;
+    struct alloc_site *site;
+    uintptr_t irq;
+    size_t bucket;
+
+    if (!addr || addr == MM_NADDR) {
+        return;
+    }
+
+    spin_lock_irqsave(&profile_lock, &irq);
+
+    if (!(site = profile_site_get(kind, tag, caller))) {
+        ++profile_dropped;
+        spin_release_irqrestore(&profile_lock, &irq);
+        return;
+    }
+
+    ++site->allocs;
+    site->bytes += size;
+
+    if ((obj = profile_object_new()) != NULL) {
+        bucket = profile_hash(addr) & (PROFILE_BUCKETS - 1);
+
+        obj->addr = addr;
+        obj->size = size;
+        obj->site = site - profile_sites;
+        obj->next = profile_buckets[bucket];
+        profile_buckets[bucket] = obj - profile_objects + 1;
+
+        ++site->live;
+        site->live_bytes += size;
+    } else {
+        ++profile_untracked;
+    }
+
+    spin_release_irqrestore(&profile_lock, &irq);
+}
+
+void alloc_profile_free(uintptr_t addr) {
+    struct alloc_object *obj;
+    struct alloc_site *site;
+    uint32_t *link;
+    uintptr_t irq;
+
+    if (!addr || addr == MM_NADDR) {
+        return;
+    }
+
+    spin_lock_irqsave(&profile_lock, &irq);
+
+    link = &profile_buckets[profile_hash(addr) & (PROFILE_BUCKETS - 1)];
+    while (*link) {
+        obj = &profile_objects[*link - 1];
+
+        if (obj->addr == addr) {
+            site = &profile_sites[obj->site];
+            ++site->frees;
+            --site->live;
+            site->live_bytes -= obj->size;
+
+            *link = obj->next;
+            obj->next = profile_free_objects;
+            profile_free_objects = obj - profile_objects + 1;
+            break;
+        }
+
+        link = &obj->next;
+    }
+
+    spin_release_irqrestore(&profile_lock, &irq);
+}
+
+// Site ordering for the report: by live bytes, then by table index
+static inline int profile_site_before(size_t a, size_t b) {
+    return profile_sites[a].live_bytes > profile_sites[b].live_bytes ||
+           (profile_sites[a].live_bytes == profile_sites[b].live_bytes && a < b);
+}
+
+int alloc_profile_getter(void *ctx, char *buf, size_t lim) {
+    const char *name;
+    uintptr_t base;
+    size_t last = PROFILE_SITES;
+
+    sysfs_buf_printf(buf, lim, "Dropped: %u, untracked: %u\n", profile_dropped, profile_untracked);
+    sysfs_buf_puts(buf, lim, "  LiveBytes     Live   Allocs    Frees      Bytes Kind Tag          Site\n");
+
+    // The counters are read without the lock - this is a statistics
+    // report, and keeping interrupts disabled while symbolizing and
+    // sorting would hurt much more than a slightly torn snapshot.
+    // Select the next site in order on every pass instead of sorting
+    // the table, so that nothing has to be allocated
+    for (size_t n = 0; n < PROFILE_REPORT; ++n) {
+        size_t best = PROFILE_SITES;
+
+        for (size_t i = 0; i < PROFILE_SITES; ++i) {
+            if (!profile_sites[i].caller) {
+                continue;
+            }
+            if (last != PROFILE_SITES && !profile_site_before(last, i)) {
+                continue;
+            }
+            if (best == PROFILE_SITES || profile_site_before(i, best)) {
+                best = i;
+            }
+        }
+
+        if (best == PROFILE_SITES) {
+            break;
+        }
+        last = best;
+
+        struct alloc_site *site = &profile_sites[best];
+        sysfs_buf_printf(buf, lim, "%11u %8u %8u %8u %10u %-4s %-12s ",
+                         site->live_bytes,
+                         site->live,
+                         site->allocs,
+                         site->frees,
+                         site->bytes,
+                         alloc_kind_names[site->kind],
+                         site->tag ? site->tag : "-");
+
+        if (ksym_find_location(site->caller, &name, &base) == 0) {
+            sysfs_buf_printf(buf, lim, "%s+%x\n", name, site->caller - base);
+        } else {
+            sysfs_buf_printf(buf, lim, "%p\n", site->caller);
+        }
+    }
+
+    return 0;
+}
+
+int alloc_profile_reset(void *ctx, const char *value) {
+    uintptr_t irq;
+
+    spin_lock_irqsave(&profile_lock, &irq);
+
+    memset(profile_sites, 0, sizeof(profile_sites));
+    memset(profile_buckets, 0, sizeof(profile_buckets));
+    profile_free_objects = 0;
+    profile_objects_used = 0;
+    profile_dropped = 0;
+    profile_untracked = 0;
+
+    spin_release_irqrestore(&profile_lock, &irq);
+
+    kdebug("Allocation profile reset\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,166 @@
+#include "arch/amd64/hw/timer.h"
+#include "sys/mem/reclaim.h"
+#include "sys/mem/phys.h"
+#include "sys/thread.h"
+#include "sys/assert.h"
+#include "sys/sched.h"
+#include "sys/debug.h"
+#include "sys/panic.h"
+#include "user/time.h"
+#include "sys/wait.h"
+#include "sys/spin.h"
+
+// Pages the daemon tries to release in one pass
+#define RECLAIM_BATCH           64
+// Delay before retrying when caches have nothing to give back
+#define RECLAIM_BACKOFF         100000000ULL
+// Interval between shrinker trim passes
+#define RECLAIM_TRIM_PERIOD     5000000000ULL
+
+static struct process reclaimd = {0};
+static struct io_notify reclaim_notify;
+static int reclaim_started = 0;
+static int reclaim_pending = 0;
+
+static struct shrinker *shrinkers = NULL;
+static spin_t shrinker_lock = 0;
+
+void shrinker_register(struct shrinker *s) {
+    uintptr_t irq;
+    _assert(s && s->count && s->scan);
+
+    spin_lock_irqsave(&shrinker_lock, &irq);
+    s->next = shrinkers;
+    shrinkers = s;
+    spin_release_irqrestore(&shrinker_lock, &irq);
+
+    kdebug("Registered shrinker: %s\n", s->name);
+}
+
+size_t mm_reclaim(size_t nr, int flags) {
+    struct thread *thr = thread_self;
+    size_t total = 0, freed = 0;
+
+    // Shrinkers may allocate memory themselves, don't recurse into
+    // reclaim from there. Passes of different threads run side by
+    // side, shrinkers lock their own structures, so an allocation
+    // never fails just because someone else is reclaiming
+    if (!thr || (thr->flags & THREAD_RECLAIM)) {
+        return 0;
+    }
+    thr->flags |= THREAD_RECLAIM;
+
+    for (struct shrinker *s = shrinkers; s; s = s->next) {
+        total += s->count(s);
+    }
+
+    if (total) {
+        // Make every cache give back its share first
+        for (struct shrinker *s = shrinkers; s && freed < nr; s = s->next) {
+            size_t count = s->count(s);
+            size_t share = (nr * count + total - 1) / total;
+
+            if (share) {
+                freed += s->scan(s, share, flags);
+            }
+        }
+
+        // Some of the caches might have been unable to release
+        // everything asked, take the rest from any cache
+        for (struct shrinker *s = shrinkers; s && freed < nr; s = s->next) {
+            if (s->count(s)) {
+                freed += s->scan(s, nr - freed, flags);
+            }
+        }
+    }
+
+    thr->flags &= ~THREAD_RECLAIM;
+
+    if (freed) {
+        kdebug("Reclaimed %u of %u pages%s\n", freed, nr, (flags & RECLAIM_DIRECT) ? " (direct)" : "");
+    }
+
+    return freed;
+}
+
+void mm_reclaim_wakeup(void) {
+    if (!reclaim_started || __sync_lock_test_and_set(&reclaim_pending, 1)) {
+        return;
+    }
+
+    thread_notify_io(&reclaim_notify);
+}
+
+static void reclaim_trim(struct thread *thr) {
+    size_t freed = 0;
+
+    thr->flags |= THREAD_RECLAIM;
+    for (struct shrinker *s = shrinkers; s; s = s->next) {
+        if (s->trim) {
+            freed += s->trim(s);
+        }
+    }
+    thr->flags &= ~THREAD_RECLAIM;
+
+    if (freed) {
+        kdebug("Trimmed %u pages\n", freed);
+    }
+}
+
+// Wait for a wakeup, returns non-zero if the trim period
+// has passed instead
+static int reclaim_wait(struct thread *thr) {
+    struct io_notify *result;
+    int res;
+
+    thread_wait_io_add(thr, &reclaim_notify);
+    thr->sleep_deadline = system_time + RECLAIM_TRIM_PERIOD;
+    thread_wait_io_add(thr, &thr->sleep_notify);
+    timer_add_sleep(thr);
+
+    res = thread_wait_io_any(thr, &result);
+    timer_remove_sleep(thr);
+    thread_wait_io_clear(thr);
+
+    return res == 0 && result == &thr->sleep_notify;
+}
+
+static void *reclaim_daemon(void *arg) {
+    struct thread *thr = thread_self;
+    kinfo("Reclaim daemon started\n");
+
+    while (1) {
+        size_t freed = 0, res;
+
+        if (reclaim_wait(thr)) {
+            reclaim_trim(thr);
+            continue;
+        }
+
+        while (!mm_phys_watermark_ok()) {
+            if (!(res = mm_reclaim(RECLAIM_BATCH, 0))) {
+                break;
+            }
+            freed += res;
+        }
+
+        if (!freed) {
+            // Nothing left to reclaim, don't let every allocation
+            // below the watermark wake us up again right away
+            thread_sleep(thr, system_time + RECLAIM_BACKOFF, NULL);
+        }
+
+        __sync_lock_release(&reclaim_pending);
+    }
+
+    panic("This code should not run\n");
+}
+
+void mm_reclaim_daemon_start(void) {
+    thread_wait_io_init(&reclaim_notify);
+
+    _assert(process_init_thread(&reclaimd, (uintptr_t) reclaim_daemon, NULL, 0) == 0);
+    sched_queue(process_first_thread(&reclaimd));
+
+    reclaim_started = 1;
+}
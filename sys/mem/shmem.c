@@ -1,13 +1,16 @@
-#include "sys/mem/vmalloc.h"
+#include "sys/mem/vma.h"
 #include "sys/mem/shmem.h"
 #include "sys/block/blk.h"
 #include "sys/mem/phys.h"
 #include "sys/mem/slab.h"
+#include "sys/mem/tlb.h"
 #include "user/errno.h"
 #include "sys/thread.h"
+#include "sys/string.h"
 #include "sys/assert.h"
 #include "user/mman.h"
 #include "sys/debug.h"
+#include "fs/pcache.h"
 #include "fs/ofile.h"
 #include "sys/heap.h"
 #include "sys/attr.h"
@@ -18,6 +21,9 @@
 struct shm_chunk {
     int id;
     struct list_head link;
+    // Protects pages[], which are allocated on first access.
+    // The chunk holds a reference to each of its pages
+    spin_t lock;
     size_t page_count;
     uintptr_t pages[];
 };
@@ -26,32 +32,64 @@ static LIST_HEAD(g_shm_chunks);
 
 static int sys_mmap_anon(mm_space_t space, uintptr_t base, size_t page_count, int prot, int flags) {
     uint64_t map_flags = MM_PAGE_USER;
-    int map_usage = PU_PRIVATE;
+    int map_usage = PU_SHARED;
 
+    if (!(flags & MAP_SHARED)) {
+        // Private pages are allocated on first access, see vm_fault()
+        return 0;
+    }
+
+    // Shared pages must be the same for the children forked before
+    // they're touched, so allocate them right away
     if (prot & PROT_WRITE) {
         map_flags |= MM_PAGE_WRITE;
     }
-    if (flags & MAP_SHARED) {
-        map_usage = PU_SHARED;
-    }
 
     // Map pages
     for (size_t i = 0; i < page_count; ++i) {
-        uintptr_t phys = mm_phys_alloc_page(map_usage);
+        uintptr_t virt = base + i * MM_PAGE_SIZE;
+
+        // Use 2MiB pages for aligned parts of large regions
+        if (!(virt & MM_PAGE_L2_OFFSET_MASK) && page_count - i >= MM_HUGE_PAGE_COUNT) {
+            uintptr_t phys = mm_phys_alloc_huge_page(map_usage);
+
+            if (phys != MM_NADDR) {
+                memset((void *) MM_VIRTUALIZE(phys), 0, MM_HUGE_PAGE_SIZE);
+                PHYS2PAGE(phys)->flags |= PG_MMAPED;
+                _assert(mm_map_single(space, virt, phys, map_flags | MM_PAGE_HUGE) == 0);
+
+                i += MM_HUGE_PAGE_COUNT - 1;
+                continue;
+            }
+        }
+
+        uintptr_t phys = mm_phys_alloc_zeroed_page(map_usage);
         _assert(phys != MM_NADDR);
         struct page *page = PHYS2PAGE(phys);
         _assert(page);
 
         page->flags |= PG_MMAPED;
-        _assert(mm_map_single(space, base + i * MM_PAGE_SIZE, phys, map_flags) == 0);
+        _assert(mm_map_single(space, virt, phys, map_flags) == 0);
     }
 
     return 0;
 }
 
-static uintptr_t mmap_findmem(mm_space_t space, void *hint, size_t page_count, int flags) {
+static uintptr_t mmap_findmem(struct vm_map *map,
+                              void *hint,
+                              size_t page_count,
+                              int prot,
+                              int flags,
+                              enum vma_type type,
+                              void *object,
+                              size_t offset) {
+    int vma_flags = VMA_MMAPED;
     uintptr_t virt_base;
 
+    if (flags & MAP_SHARED) {
+        vma_flags |= VMA_SHARED;
+    }
+
     if (flags & MAP_FIXED) {
         virt_base = (uintptr_t) hint;
 
@@ -59,52 +97,62 @@ static uintptr_t mmap_findmem(mm_space_t space, void *hint, size_t page_count, i
         if (virt_base == 0 || (virt_base & MM_PAGE_OFFSET_MASK)) {
             return MM_NADDR;
         }
+        if (virt_base + page_count * MM_PAGE_SIZE > USER_VIRT_END ||
+            virt_base + page_count * MM_PAGE_SIZE < virt_base) {
+            return MM_NADDR;
+        }
 
-        // TODO: check for hint + page_count * PAGE_SIZE overflow
-        // Check that any of the pages in that range are already taken
-        for (size_t i = 0; i < page_count; ++i) {
-            if (mm_map_get(space, virt_base + i * MM_PAGE_SIZE, 0) != MM_NADDR) {
-                return MM_NADDR;
-            }
+        // Fails if any of the pages in that range are already taken
+        if (vma_insert(map,
+                       virt_base,
+                       virt_base + page_count * MM_PAGE_SIZE,
+                       prot,
+                       vma_flags,
+                       type,
+                       object,
+                       offset) != 0) {
+            return MM_NADDR;
         }
-        // Good to proceed
     } else {
-        virt_base = vmfind(space, 0x100000000, 0x400000000, page_count);
-        _assert(virt_base != MM_NADDR);
+        // Large regions are aligned so they can be mapped with huge pages
+        virt_base = vma_alloc(map,
+                              0x100000000,
+                              0x400000000,
+                              page_count,
+                              page_count >= MM_HUGE_PAGE_COUNT ? MM_HUGE_PAGE_COUNT : 1,
+                              prot,
+                              vma_flags,
+                              type,
+                              object,
+                              offset);
     }
 
     return virt_base;
 }
 
 void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t off) {
+    struct vnode *vn = NULL;
+    struct vm_map *map;
     size_t page_count;
     mm_space_t space;
     uintptr_t base;
+    uintptr_t irq;
     long res;
 
     _assert(thread_self && thread_self->proc);
     space = thread_self->proc->space;
+    map = &thread_self->proc->vmas;
     _assert(space);
 
     if (length & MM_PAGE_OFFSET_MASK) {
         return (void *) -EINVAL;
     }
     page_count = length / MM_PAGE_SIZE;
-
-    // Allocate the virtual pages first
-    base = mmap_findmem(space, hint, page_count, flags);
-
-    if (base == MM_NADDR) {
-        return (void *) -ENOMEM;
+    if (!page_count) {
+        return (void *) -EINVAL;
     }
 
-    if (flags & MAP_ANONYMOUS) {
-        // Anonymous mapping
-        if ((res = sys_mmap_anon(space, base, page_count, prot, flags)) != 0) {
-            return (void *) res;
-        }
-        return (void *) base;
-    } else {
+    if (!(flags & MAP_ANONYMOUS)) {
         // File/device-backed mapping
         if (fd < 0 || fd >= THREAD_MAX_FDS) {
             return (void *) -EBADF;
@@ -119,65 +167,126 @@ void *sys_mmap(void *hint, size_t length, int prot, int flags, int fd, off_t off
             return (void *) -EINVAL;
         }
 
-        struct vnode *vn = of->file.vnode;
+        vn = of->file.vnode;
         _assert(vn);
 
         switch (vn->type) {
         case VN_BLK:
-            {
-                struct blkdev *blk = vn->dev;
-                if ((res = blk_mmap(blk, base, page_count, prot, flags)) != 0) {
-                    return (void *) res;
-                }
-                return (void *) base;
+            break;
+        case VN_REG:
+            // Pages are faulted in from the file's cache, see vm_fault()
+            if (!(vn->flags & VN_PAGED)) {
+                return (void *) -ENODEV;
             }
+            if (off < 0 || (off & MM_PAGE_OFFSET_MASK)) {
+                return (void *) -EINVAL;
+            }
+            if (!(of->flags & OF_READABLE)) {
+                return (void *) -EACCES;
+            }
+            if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !(of->flags & OF_WRITABLE)) {
+                return (void *) -EACCES;
+            }
+            break;
         default:
             return (void *) -EINVAL;
         }
     }
-}
 
-int sys_munmap(void *ptr, size_t len) {
-    uintptr_t addr = (uintptr_t) ptr;
-    struct thread *thr;
+    // Other threads may be faulting or mapping in the space
+    tlb_space_lock(thread_self->proc, &irq);
 
-    thr = thread_self;
-    _assert(thr);
+    // Allocate the virtual pages first
+    if (vn && vn->type == VN_REG) {
+        base = mmap_findmem(map, hint, page_count, prot, flags, VMA_FILE, vn, off);
+    } else if (vn) {
+        base = mmap_findmem(map, hint, page_count, prot, flags, VMA_DEVICE, vn->dev, off);
+    } else {
+        base = mmap_findmem(map, hint, page_count, prot, flags, VMA_ANON, NULL, 0);
+    }
 
-    if (addr & MM_PAGE_OFFSET_MASK) {
-        kwarn("Misaligned address\n");
-        return -EINVAL;
+    if (base == MM_NADDR) {
+        tlb_space_unlock(thread_self->proc, &irq);
+        return (void *) -ENOMEM;
     }
 
-    if (addr >= KERNEL_VIRT_BASE) {
-        kwarn("Don't even try\n");
-        return -EACCES;
+    if (vn && vn->type == VN_REG) {
+        res = 0;
+    } else if (vn) {
+        res = blk_mmap(vn->dev, base, page_count, prot, flags);
+    } else {
+        // Anonymous mapping
+        res = sys_mmap_anon(space, base, page_count, prot, flags);
     }
 
-    if (len & MM_PAGE_OFFSET_MASK) {
-        kwarn("Misaligned size\n");
-        return -EINVAL;
+    if (res != 0) {
+        vma_remove(map, base, base + page_count * MM_PAGE_SIZE);
     }
+    tlb_space_unlock(thread_self->proc, &irq);
 
-    len /= MM_PAGE_SIZE;
+    return res != 0 ? (void *) res : (void *) base;
+}
 
+static int munmap_pages(struct tlb_batch *batch, mm_space_t space, uintptr_t addr, size_t len) {
     // TODO: If it's a device mapping, notify device a page was unmapped
 
+    tlb_batch_add(batch, addr, addr + len * MM_PAGE_SIZE);
+
     for (size_t i = 0; i < len; ++i) {
         uint64_t flags;
-        uintptr_t phys = mm_map_get(thr->proc->space, addr + i * MM_PAGE_SIZE, &flags);
+        uintptr_t virt = addr + i * MM_PAGE_SIZE;
+        uintptr_t phys = mm_map_get(space, virt, &flags);
 
         if (phys == MM_NADDR) {
             continue;
         }
 
+        if (phys == mm_zero_page) {
+            _assert(mm_umap_single(space, virt, MM_UMAP_4K) == phys);
+            continue;
+        }
+
+        if (flags & MM_PAGE_HUGE) {
+            if (!(virt & MM_PAGE_L2_OFFSET_MASK) && len - i >= MM_HUGE_PAGE_COUNT) {
+                // Whole 2MiB page is unmapped
+                struct page *page = PHYS2PAGE(phys);
+                _assert(page);
+
+                if (!(page->flags & PG_MMAPED)) {
+                    panic("Tried to unmap non-mmapped page\n");
+                }
+
+                _assert(mm_umap_release(space, virt, MM_UMAP_2M, batch) == phys);
+
+                i += MM_HUGE_PAGE_COUNT - 1;
+                continue;
+            }
+
+            // Only a part of it is, continue with 4KiB pages. The rest
+            // of the frame gets remapped, so the whole of it has to be
+            // invalidated
+            if (mm_map_split(space, virt) != 0) {
+                return -ENOMEM;
+            }
+            tlb_batch_add(batch, virt & ~MM_PAGE_L2_OFFSET_MASK, (virt & ~MM_PAGE_L2_OFFSET_MASK) + MM_HUGE_PAGE_SIZE);
+            phys = mm_map_get(space, virt, &flags);
+            _assert(phys != MM_NADDR);
+        }
+
         struct page *page = PHYS2PAGE(phys);
         _assert(page);
 
         // TODO: FIX THIS
         if (page->usage == PU_DEVICE) {
             _assert(page->refcount);
-            _assert(mm_umap_single(thr->proc->space, addr + i * MM_PAGE_SIZE, 1) == phys);
+            _assert(mm_umap_single(space, addr + i * MM_PAGE_SIZE, 1) == phys);
+
+            continue;
+        }
+
+        if (page->usage == PU_CACHE) {
+            // Page of a file mapping, normally still referenced by the cache
+            _assert(mm_umap_release(space, virt, MM_UMAP_4K, batch) == phys);
 
             continue;
         }
@@ -185,23 +294,154 @@ int sys_munmap(void *ptr, size_t len) {
         if (!(page->flags & PG_MMAPED)) {
             panic("Tried to unmap non-mmapped page\n");
         }
+        if (page->usage != PU_SHARED && page->usage != PU_PRIVATE) {
+            panic("Unhandled page type: %d (%p -> %p)\n", page->usage, virt, phys);
+        }
 
-        _assert(page->refcount);
-        _assert(mm_umap_single(thr->proc->space, addr + i * MM_PAGE_SIZE, 1) == phys);
+        _assert(mm_umap_release(space, virt, MM_UMAP_4K, batch) == phys);
+    }
 
-        if (page->usage == PU_SHARED || page->usage == PU_PRIVATE) {
-            if (!page->refcount) {
-                //kdebug("Free page %p\n", phys);
-                mm_phys_free_page(phys);
-            }
-        } else {
-            panic("Unhandled page type: %d (%p -> %p)\n", page->usage, addr + i * MM_PAGE_SIZE, phys);
+    return 0;
+}
+
+// Files of the shared mappings removed by munmap_range(). They are
+// kept open and written back by mmap_files_sync() once the space lock
+// is released, as filesystem I/O can't be done under it
+struct mmap_files {
+    size_t count;
+    struct vnode **nodes;
+};
+
+static int mmap_files_collect(struct mmap_files *files, struct vm_map *map, uintptr_t start, uintptr_t end) {
+    struct vm_area *area;
+    size_t count = 0;
+
+    for (area = vma_next(map, start); area && area->start < end; area = vma_next(map, area->end)) {
+        if (area->type == VMA_FILE && (area->flags & VMA_SHARED)) {
+            ++count;
+        }
+    }
+    if (!count) {
+        return 0;
+    }
+
+    if (!(files->nodes = kmalloc(count * sizeof(struct vnode *)))) {
+        return -ENOMEM;
+    }
+    for (area = vma_next(map, start); area && area->start < end; area = vma_next(map, area->end)) {
+        if (area->type == VMA_FILE && (area->flags & VMA_SHARED)) {
+            __sync_fetch_and_add(&((struct vnode *) area->object)->open_count, 1);
+            files->nodes[files->count++] = area->object;
         }
     }
 
     return 0;
 }
 
+static void mmap_sync_file(struct vnode *vn) {
+    int res;
+
+    if ((res = pcache_sync(vn)) != 0) {
+        kwarn("mmap: failed to write back %s: %s\n", vn->name, kstrerror(res));
+    }
+}
+
+static void mmap_files_sync(struct mmap_files *files) {
+    for (size_t i = 0; i < files->count; ++i) {
+        mmap_sync_file(files->nodes[i]);
+        _assert(__sync_fetch_and_sub(&files->nodes[i]->open_count, 1));
+    }
+    kfree(files->nodes);
+}
+
+// Called with the space lock of the process held. The files to write
+// back are returned in `files' even on failure, see mmap_files_sync()
+static int munmap_range(struct process *proc, uintptr_t addr, uintptr_t end, struct mmap_files *files) {
+    struct tlb_batch batch;
+    struct vm_area *area;
+    int res;
+
+    files->count = 0;
+    files->nodes = NULL;
+
+    // Only regions created by mmap()/shmat() can be unmapped
+    for (area = vma_next(&proc->vmas, addr); area && area->start < end; area = vma_next(&proc->vmas, area->end)) {
+        if (!(area->flags & VMA_MMAPED)) {
+            return -EINVAL;
+        }
+    }
+
+    if ((res = mmap_files_collect(files, &proc->vmas, addr, end)) != 0) {
+        return res;
+    }
+
+    // Pages outside of any area are not mapped, skip them
+    tlb_batch_init(&batch, proc);
+    for (area = vma_next(&proc->vmas, addr); area && area->start < end; area = vma_next(&proc->vmas, area->end)) {
+        uintptr_t from = MAX(area->start, addr);
+        uintptr_t to = MIN(area->end, end);
+
+        if ((res = munmap_pages(&batch, proc->space, from, (to - from) / MM_PAGE_SIZE)) != 0) {
+            // No memory to split a 2MiB mapping, the areas are left
+            // as they are
+            tlb_batch_flush(&batch);
+            return res;
+        }
+    }
+    tlb_batch_flush(&batch);
+
+    return vma_remove(&proc->vmas, addr, end);
+}
+
+int sys_munmap(void *ptr, size_t len) {
+    uintptr_t addr = (uintptr_t) ptr;
+    struct mmap_files files;
+    struct thread *thr;
+    uintptr_t end, irq;
+    int res;
+
+    thr = thread_self;
+    _assert(thr);
+
+    if (addr & MM_PAGE_OFFSET_MASK) {
+        kwarn("Misaligned address\n");
+        return -EINVAL;
+    }
+
+    if (addr >= USER_VIRT_END) {
+        kwarn("Don't even try\n");
+        return -EACCES;
+    }
+
+    if (len & MM_PAGE_OFFSET_MASK) {
+        kwarn("Misaligned size\n");
+        return -EINVAL;
+    }
+
+    end = addr + len;
+    if (end > USER_VIRT_END || end < addr) {
+        return -EINVAL;
+    }
+
+    tlb_space_lock(thr->proc, &irq);
+    res = munmap_range(thr->proc, addr, end, &files);
+    tlb_space_unlock(thr->proc, &irq);
+
+    mmap_files_sync(&files);
+
+    return res;
+}
+
+void mmap_writeback(struct vm_map *map, uintptr_t start, uintptr_t end) {
+    struct vm_area *area;
+
+    for (area = vma_next(map, start); area && area->start < end; area = vma_next(map, area->end)) {
+        if (area->type == VMA_FILE && (area->flags & VMA_SHARED)) {
+            mmap_sync_file(area->object);
+        }
+    }
+}
+
 int sys_shmget(size_t size, int flags) {
     static int shmid = 0;
     size = (size + MM_PAGE_SIZE - 1) / MM_PAGE_SIZE;
@@ -211,11 +451,12 @@ int sys_shmget(size_t size, int flags) {
 
     chunk->page_count = size;
     chunk->id = ++shmid;
+    chunk->lock = 0;
     list_head_init(&chunk->link);
 
+    // Pages are allocated on first access, see shm_fault()
     for (size_t i = 0; i < size; ++i) {
-        chunk->pages[i] = mm_phys_alloc_page(PU_SHARED);
-        _assert(chunk->pages[i] != MM_NADDR);
+        chunk->pages[i] = MM_NADDR;
     }
 
     list_add(&chunk->link, &g_shm_chunks);
@@ -223,10 +464,77 @@ int sys_shmget(size_t size, int flags) {
     return chunk->id;
 }
 
+static int shm_block_empty(struct shm_chunk *chunk, size_t block) {
+    if (chunk->page_count - block < MM_HUGE_PAGE_COUNT) {
+        return 0;
+    }
+    for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+        if (chunk->pages[block + i] != MM_NADDR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Allocate the page of the chunk at `index' if it's not there yet
+static uintptr_t shm_page_get(struct shm_chunk *chunk, size_t index) {
+    size_t block = index & ~(MM_HUGE_PAGE_COUNT - 1);
+    uintptr_t phys;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&chunk->lock, &irq);
+
+    if ((phys = chunk->pages[index]) != MM_NADDR) {
+        spin_release_irqrestore(&chunk->lock, &irq);
+        return phys;
+    }
+
+    // Whole 2MiB blocks of the chunk use 2MiB frames where possible,
+    // sys_shmat() aligns the regions so that they're mapped as such
+    if (shm_block_empty(chunk, block) && (phys = mm_phys_alloc_huge_page(PU_SHARED)) != MM_NADDR) {
+        memset((void *) MM_VIRTUALIZE(phys), 0, MM_HUGE_PAGE_SIZE);
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+        ++PHYS2PAGE(phys)->refcount;
+        for (size_t i = 0; i < MM_HUGE_PAGE_COUNT; ++i) {
+            chunk->pages[block + i] = phys + i * MM_PAGE_SIZE;
+        }
+    } else if ((phys = mm_phys_alloc_zeroed_page(PU_SHARED)) != MM_NADDR) {
+        PHYS2PAGE(phys)->flags |= PG_MMAPED;
+        ++PHYS2PAGE(phys)->refcount;
+        chunk->pages[index] = phys;
+    }
+
+    spin_release_irqrestore(&chunk->lock, &irq);
+    return chunk->pages[index];
+}
+
+int shm_fault(mm_space_t space, struct vm_area *area, uintptr_t virt) {
+    struct shm_chunk *chunk = area->object;
+    size_t index = (virt - area->start + area->offset) / MM_PAGE_SIZE;
+    size_t block = index & ~(MM_HUGE_PAGE_COUNT - 1);
+    uintptr_t phys, head;
+
+    _assert(chunk && index < chunk->page_count);
+
+    if ((phys = shm_page_get(chunk, index)) == MM_NADDR) {
+        return -1;
+    }
+
+    head = chunk->pages[block];
+    if (head != MM_NADDR && (PHYS2PAGE(head)->flags & PG_HUGE)) {
+        // The page is a part of 2MiB frame, map the whole frame
+        uintptr_t block_virt = virt & ~MM_PAGE_L2_OFFSET_MASK;
+        _assert(block_virt >= area->start && block_virt + MM_HUGE_PAGE_SIZE <= area->end);
+
+        return mm_map_single(space, block_virt, head, MM_PAGE_WRITE | MM_PAGE_USER | MM_PAGE_HUGE);
+    }
+
+    return mm_map_single(space, virt, phys, MM_PAGE_WRITE | MM_PAGE_USER);
+}
+
 void *sys_shmat(int id, const void *hint, int flags) {
-    uintptr_t virt_base;
-    mm_space_t space;
     struct shm_chunk *chunk, *iter;
+    uintptr_t virt_base, irq;
 
     chunk = NULL;
     list_for_each_entry(iter, &g_shm_chunks, link) {
@@ -239,19 +547,46 @@ void *sys_shmat(int id, const void *hint, int flags) {
         return (void *) -ENOENT;
     }
 
-    space = thread_self->proc->space;
-
     // TODO: use hint
-    virt_base = vmfind(space, 0x100000000, 0x400000000, chunk->page_count);
-    _assert(virt_base != MM_NADDR);
-
-    for (size_t i = 0; i < chunk->page_count; ++i) {
-        _assert(PHYS2PAGE(chunk->pages[i])->usage == PU_SHARED);
-        mm_map_single(space,
-                      virt_base + i * MM_PAGE_SIZE,
-                      chunk->pages[i],
-                      MM_PAGE_WRITE | MM_PAGE_USER);
+    // Nothing is mapped here, pages are mapped on first access
+    tlb_space_lock(thread_self->proc, &irq);
+    virt_base = vma_alloc(&thread_self->proc->vmas,
+                          0x100000000,
+                          0x400000000,
+                          chunk->page_count,
+                          chunk->page_count >= MM_HUGE_PAGE_COUNT ? MM_HUGE_PAGE_COUNT : 1,
+                          PROT_READ | PROT_WRITE,
+                          VMA_MMAPED | VMA_SHARED,
+                          VMA_SHM,
+                          chunk,
+                          0);
+    tlb_space_unlock(thread_self->proc, &irq);
+    if (virt_base == MM_NADDR) {
+        return (void *) -ENOMEM;
     }
 
     return (void *) virt_base;
 }
+
+int sys_shmdt(const void *ptr) {
+    uintptr_t addr = (uintptr_t) ptr;
+    struct process *proc = thread_self->proc;
+    struct mmap_files files;
+    struct vm_area *area;
+    uintptr_t irq;
+    int res;
+
+    tlb_space_lock(proc, &irq);
+    area = vma_lookup(&proc->vmas, addr);
+    if (!area || area->type != VMA_SHM || area->start != addr) {
+        tlb_space_unlock(proc, &irq);
+        return -EINVAL;
+    }
+    // The chunk keeps its pages, they're only unmapped here
+    res = munmap_range(proc, area->start, area->end, &files);
+    tlb_space_unlock(proc, &irq);
+
+    mmap_files_sync(&files);
+
+    return res;
+}
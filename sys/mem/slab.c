@@ -1,10 +1,17 @@
+#include "sys/mem/reclaim.h"
+#include "sys/mem/profile.h"
+#include "arch/amd64/cpu.h"
 #include "sys/mem/phys.h"
 #include "sys/mem/slab.h"
+#include "user/errno.h"
 #include "sys/assert.h"
 #include "sys/string.h"
+#include "sys/sched.h"
 #include "sys/debug.h"
+#include "sys/heap.h"
 #include "sys/list.h"
 #include "sys/attr.h"
+#include "sys/spin.h"
 #include "sys/mm.h"
 
 typedef uint32_t bufctl_t;
@@ -16,11 +23,66 @@ typedef uint32_t bufctl_t;
     { 1ULL << ((i) + 4), &predefined_caches[i] }
 #define CACHE_SIZE_END \
     { 0, NULL }
-#define PREALLOC_COUNT  6
+#define PREALLOC_COUNT  13
+// Objects up to this size are kept in single-page slabs which hold
+// their own descriptor
+#define SLAB_SMALL_MAX          512
+#define SLAB_OBJECT_MAX         65536
+// Larger objects are kept in slabs of up to 2^SLAB_MAX_ORDER pages,
+// enough to hold at least SLAB_MIN_OBJECTS of them if possible
+#define SLAB_MAX_ORDER          5
+#define SLAB_MIN_OBJECTS        4
+// Slab descriptor and bufctl array are allocated separately
+#define SLAB_OFF_SLAB           (1 << 0)
+// Number of objects a magazine holds
+#define SLAB_MAGAZINE_SIZE      15
+// Magazines of large object caches are limited to this many bytes
+#define SLAB_MAGAZINE_BYTES     32768
+
+// A stack of free objects, either owned by a CPU or sitting
+// in the depot of the cache
+struct slab_magazine {
+    struct slab_magazine *next;
+    size_t rounds;
+    void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab_cpu {
+    spin_t lock;
+    // Objects are taken from/put to the loaded magazine. The previous
+    // one is always either full or empty, so that a CPU alternating
+    // allocations and frees around a magazine boundary doesn't have
+    // to go to the depot every time
+    struct slab_magazine *loaded, *previous;
+};
 
 struct slab_cache {
+    const char *name;
+    // Objects are constructed once, when their slab is created, and
+    // destroyed when the slab is released
+    void (*ctor) (void *objp);
+    void (*dtor) (void *objp);
+    // Link in slab_caches. The shrinker pins caches it works on
+    // without slab_caches_lock held, so that they stay on the list
+    struct list_head link;
+    size_t pins;
+
     struct list_head slabs_empty, slabs_partial, slabs_full;
     size_t object_size, objects_per_slab;
+    // Slabs are 2^order pages
+    size_t order;
+    size_t magazine_size;
+    int flags;
+    // Empty slabs are kept for reuse until memory reclaim asks
+    // for them
+    size_t empty_count;
+    spin_t lock;
+
+    // Magazine layer
+    struct slab_cpu cpus[AMD64_MAX_SMP];
+    struct slab_magazine *depot_full, *depot_empty;
+    size_t depot_full_count;
+    spin_t depot_lock;
 };
 
 struct slab {
@@ -35,7 +97,30 @@ struct cache_size {
     struct slab_cache *cp;
 };
 
+// Empty slabs above slab_empty_keep per cache are released by periodic
+// trimming, those above slab_empty_max right away
+int64_t slab_empty_keep = 1;
+int64_t slab_empty_max = 8;
+
+static LIST_HEAD(slab_caches);
+static spin_t slab_caches_lock = 0;
+
 struct slab_cache predefined_caches[PREALLOC_COUNT];
+static const char *predefined_cache_names[PREALLOC_COUNT] = {
+    "size-16",
+    "size-32",
+    "size-64",
+    "size-128",
+    "size-256",
+    "size-512",
+    "size-1024",
+    "size-2048",
+    "size-4096",
+    "size-8192",
+    "size-16384",
+    "size-32768",
+    "size-65536"
+};
 struct cache_size predefined_cache_sizes[PREALLOC_COUNT + 1] = {
     CACHE_SIZE(0),
     CACHE_SIZE(1),
@@ -43,27 +128,86 @@ struct cache_size predefined_cache_sizes[PREALLOC_COUNT + 1] = {
     CACHE_SIZE(3),
     CACHE_SIZE(4),
     CACHE_SIZE(5),
+    CACHE_SIZE(6),
+    CACHE_SIZE(7),
+    CACHE_SIZE(8),
+    CACHE_SIZE(9),
+    CACHE_SIZE(10),
+    CACHE_SIZE(11),
+    CACHE_SIZE(12),
     CACHE_SIZE_END
 };
 
-static void slab_init_cache(struct slab_cache *cp, size_t object_size) {
+static void slab_init_cache(struct slab_cache *cp,
+                            const char *name,
+                            size_t object_size,
+                            void (*ctor) (void *),
+                            void (*dtor) (void *)) {
+    uintptr_t irq;
+
+    cp->name = name;
+    cp->ctor = ctor;
+    cp->dtor = dtor;
     cp->object_size = object_size;
+    cp->empty_count = 0;
+    cp->lock = 0;
+    cp->pins = 0;
+    memset(cp->cpus, 0, sizeof(cp->cpus));
+    cp->depot_full = NULL;
+    cp->depot_empty = NULL;
+    cp->depot_full_count = 0;
+    cp->depot_lock = 0;
     list_head_init(&cp->slabs_empty);
     list_head_init(&cp->slabs_partial);
     list_head_init(&cp->slabs_full);
 
-    // Reserve space for slab descriptor
-    cp->objects_per_slab = (MM_PAGE_SIZE - sizeof(struct slab)) / cp->object_size;
-    // Reserve space for bufctl
-    size_t bufctl_array_size = cp->objects_per_slab * sizeof(bufctl_t);
-    cp->objects_per_slab -= (bufctl_array_size + cp->object_size - 1) / cp->object_size;
+    if (object_size <= SLAB_SMALL_MAX) {
+        cp->flags = 0;
+        cp->order = 0;
+
+        // Reserve space for slab descriptor
+        cp->objects_per_slab = (MM_PAGE_SIZE - sizeof(struct slab)) / cp->object_size;
+        // Reserve space for bufctl
+        size_t bufctl_array_size = cp->objects_per_slab * sizeof(bufctl_t);
+        cp->objects_per_slab -= (bufctl_array_size + cp->object_size - 1) / cp->object_size;
+    } else {
+        cp->flags = SLAB_OFF_SLAB;
+
+        // Pick the smallest slab which wastes no more than 1/8 of its size
+        for (cp->order = 0; cp->order < SLAB_MAX_ORDER; ++cp->order) {
+            size_t slab_size = MM_PAGE_SIZE << cp->order;
+            size_t count = slab_size / object_size;
+
+            if (count >= SLAB_MIN_OBJECTS && (slab_size - count * object_size) * 8 <= slab_size) {
+                break;
+            }
+        }
+
+        cp->objects_per_slab = (MM_PAGE_SIZE << cp->order) / object_size;
+    }
+    _assert(cp->objects_per_slab);
+
+    cp->magazine_size = SLAB_MAGAZINE_BYTES / object_size;
+    if (cp->magazine_size > SLAB_MAGAZINE_SIZE) {
+        cp->magazine_size = SLAB_MAGAZINE_SIZE;
+    } else if (!cp->magazine_size) {
+        cp->magazine_size = 1;
+    }
+
+    spin_lock_irqsave(&slab_caches_lock, &irq);
+    list_add(&cp->link, &slab_caches);
+    spin_release_irqrestore(&slab_caches_lock, &irq);
 }
 
+static struct shrinker slab_shrinker;
+
 __init(slab_init_caches) {
     for (size_t i = 0; i < PREALLOC_COUNT; ++i) {
         kdebug("Initializing predefined cache: %u\n", 1UL << (i + 4));
-        slab_init_cache(&predefined_caches[i], 1UL << (i + 4));
+        slab_init_cache(&predefined_caches[i], predefined_cache_names[i], 1UL << (i + 4), NULL, NULL);
     }
+
+    shrinker_register(&slab_shrinker);
 }
 
 struct slab_cache *slab_cache_get(size_t size) {
@@ -78,19 +222,62 @@ struct slab_cache *slab_cache_get(size_t size) {
     panic("Tried to get cache of invalid size: %u\n", size);
 }
 
-////
+struct slab_cache *slab_cache_create(const char *name,
+                                     size_t size,
+                                     void (*ctor) (void *),
+                                     void (*dtor) (void *)) {
+    struct slab_cache *cp;
 
-static struct slab *slab_create(struct slab_cache *cp) {
-    uintptr_t page_phys = mm_phys_alloc_page(PU_KERNEL);
+    // Keep objects 8-byte aligned
+    size = (size + 7) & ~7;
+    if (!size || size > SLAB_OBJECT_MAX) {
+        panic("Tried to create cache \"%s\" of invalid size: %u\n", name, size);
+    }
 
-    if (page_phys == MM_NADDR) {
+    if (!(cp = kmalloc(sizeof(struct slab_cache)))) {
         return NULL;
     }
 
-    struct slab *slab = (struct slab *) MM_VIRTUALIZE(page_phys);
+    kdebug("Creating cache: %s, %u B\n", name, size);
+    slab_init_cache(cp, name, size, ctor, dtor);
+
+    return cp;
+}
+
+////
+
+static struct slab *slab_create(struct slab_cache *cp) {
+    size_t pages = 1UL << cp->order;
+    uintptr_t page_phys;
+    struct slab *slab;
+
+    if (cp->flags & SLAB_OFF_SLAB) {
+        // Slab pages only hold the objects
+        if (!(slab = kmalloc(sizeof(struct slab) + sizeof(bufctl_t) * cp->objects_per_slab))) {
+            return NULL;
+        }
+        if ((page_phys = mm_phys_alloc_contiguous(pages, PU_KERNEL)) == MM_NADDR) {
+            kfree(slab);
+            return NULL;
+        }
+
+        // Let slab_free() find the descriptor by object address
+        for (size_t i = 0; i < pages; ++i) {
+            PHYS2PAGE(page_phys + i * MM_PAGE_SIZE)->slab = slab;
+        }
+
+        slab->base = (void *) MM_VIRTUALIZE(page_phys);
+    } else {
+        if ((page_phys = mm_phys_alloc_page(PU_KERNEL)) == MM_NADDR) {
+            return NULL;
+        }
+
+        slab = (struct slab *) MM_VIRTUALIZE(page_phys);
+
+        slab->base = ((void *) &slab[1]) + sizeof(bufctl_t) * cp->objects_per_slab;
+        slab->base = (void *) (((uintptr_t) slab->base + 0x7) & ~0x7);
+    }
 
-    slab->base = ((void *) &slab[1]) + sizeof(bufctl_t) * cp->objects_per_slab;
-    slab->base = (void *) (((uintptr_t) slab->base + 0x7) & ~0x7);
     list_head_init(&slab->list);
     slab->inuse = 0;
     slab->free = 0;
@@ -99,7 +286,12 @@ static struct slab *slab_create(struct slab_cache *cp) {
         slab_bufctl(slab)[i] = i + 1;
     }
     slab_bufctl(slab)[cp->objects_per_slab - 1] = BUFCTL_END;
-    list_add(&slab->list, &cp->slabs_empty);
+
+    if (cp->ctor) {
+        for (size_t i = 0; i < cp->objects_per_slab; ++i) {
+            cp->ctor(slab->base + i * cp->object_size);
+        }
+    }
 
     kdebug("Created slab of %u x %u B\n", cp->objects_per_slab, cp->object_size);
 
@@ -107,9 +299,45 @@ static struct slab *slab_create(struct slab_cache *cp) {
 }
 
 static void slab_destroy(struct slab_cache *cp, struct slab *slabp) {
-    _assert(!((uintptr_t) slabp & 0xFFF));
+    _assert(!slabp->inuse);
+
+    if (cp->dtor) {
+        for (size_t i = 0; i < cp->objects_per_slab; ++i) {
+            cp->dtor(slabp->base + i * cp->object_size);
+        }
+    }
+
     kdebug("Destoyed slab of %u x %u B\n", cp->objects_per_slab, cp->object_size);
-    mm_phys_free_page(MM_PHYS(slabp));
+
+    if (cp->flags & SLAB_OFF_SLAB) {
+        size_t pages = 1UL << cp->order;
+        uintptr_t page_phys = MM_PHYS(slabp->base);
+
+        for (size_t i = 0; i < pages; ++i) {
+            PHYS2PAGE(page_phys + i * MM_PAGE_SIZE)->slab = NULL;
+        }
+
+        mm_phys_free_contiguous(page_phys, pages);
+        kfree(slabp);
+    } else {
+        _assert(!((uintptr_t) slabp & 0xFFF));
+        mm_phys_free_page(MM_PHYS(slabp));
+    }
+}
+
+// Find the slab an object belongs to
+static inline struct slab *slab_of(struct slab_cache *cp, void *objp) {
+    struct page *page;
+
+    if (cp->flags & SLAB_OFF_SLAB) {
+        page = PHYS2PAGE(MM_PHYS(objp));
+        _assert(page && page->slab);
+        return page->slab;
+    }
+
+    // slab descriptor is on the same page objp points to
+    _assert((uintptr_t) objp & 0xFFF);
+    return (struct slab *) ((uintptr_t) objp & ~(MM_PAGE_SIZE - 1));
 }
 
 static inline void *slab_alloc_from(struct slab_cache *cp, struct slab *slabp) {
@@ -126,13 +354,18 @@ static inline void *slab_alloc_from(struct slab_cache *cp, struct slab *slabp) {
         list_add(&slabp->list, &cp->slabs_full);
     }
 
-    memset(objp, 0, cp->object_size);
     return objp;
 }
 
-void *slab_calloc_int(struct slab_cache *cp) {
+//// Slab layer
+
+static void *slab_layer_alloc(struct slab_cache *cp) {
     struct list_head *slabs_partial, *slabs_empty, *entry;
     struct slab *slabp;
+    uintptr_t irq;
+    void *objp;
+
+    spin_lock_irqsave(&cp->lock, &irq);
 try_again:
 
     // Check if there is any partial slab to use
@@ -146,32 +379,39 @@ try_again:
         if (slabs_empty == entry) {
             // Have to allocate a new slab - no free objects are available
             // After that, just try allocation again
-            //printf("No partial/empty slabs, allocating a new one\n");
+            // Page allocation may reclaim memory from this very cache,
+            // so the lock is dropped meanwhile
+            spin_release_irqrestore(&cp->lock, &irq);
 
-            if (!slab_create(cp)) {
+            if (!(slabp = slab_create(cp))) {
                 return NULL;
             }
+
+            spin_lock_irqsave(&cp->lock, &irq);
+            list_add(&slabp->list, &cp->slabs_empty);
+            ++cp->empty_count;
             goto try_again;
         }
 
         list_del(entry);
         list_add(entry, slabs_partial);
+        --cp->empty_count;
     }
 
     slabp = list_entry(entry, struct slab, list);
-    return slab_alloc_from(cp, slabp);
+    objp = slab_alloc_from(cp, slabp);
+
+    spin_release_irqrestore(&cp->lock, &irq);
+    return objp;
 }
 
-void slab_free_int(struct slab_cache *cp, void *objp) {
-    struct slab *slabp;
-    // Get page-aligned address
-    uintptr_t page = (uintptr_t) objp;
-    _assert(page & 0xFFF);
-    page /= MM_PAGE_SIZE;
-    page *= MM_PAGE_SIZE;
+// Return an object to its slab. Returns the number of pages given
+// back to physical memory allocator
+static size_t slab_layer_free(struct slab_cache *cp, void *objp) {
+    struct slab *slabp = slab_of(cp, objp), *release = NULL;
+    uintptr_t irq;
 
-    // slab descriptor is on the same page objp points to
-    slabp = (struct slab *) page;
+    spin_lock_irqsave(&cp->lock, &irq);
 
     unsigned int obj_number = (objp - slabp->base) / cp->object_size;
     slab_bufctl(slabp)[obj_number] = slabp->free;
@@ -181,56 +421,491 @@ void slab_free_int(struct slab_cache *cp, void *objp) {
 
     if (!--slabp->inuse) {
         // Was partial or full, now empty
-        // Free the slab
         list_del(&slabp->list);
-        slab_destroy(cp, slabp);
+
+        // Keep some empty slabs so that a cache oscillating
+        // around slab boundary doesn't allocate and free pages
+        // each time
+        if (cp->empty_count < (size_t) slab_empty_max) {
+            list_add(&slabp->list, &cp->slabs_empty);
+            ++cp->empty_count;
+        } else {
+            release = slabp;
+        }
     } else if (inuse == cp->objects_per_slab) {
         // Was full, now partial
         list_del_init(&slabp->list);
         list_add(&slabp->list, &cp->slabs_partial);
     }
+
+    spin_release_irqrestore(&cp->lock, &irq);
+
+    if (release) {
+        slab_destroy(cp, release);
+        return 1UL << cp->order;
+    }
+    return 0;
+}
+
+//// Magazine layer
+
+static inline int slab_cpu_ready(void) {
+    // CPU data is only available once the scheduler is ready
+    return sched_ready;
+}
+
+static inline void slab_magazine_push(struct slab_magazine **list, struct slab_magazine *mag) {
+    if (mag) {
+        mag->next = *list;
+        *list = mag;
+    }
+}
+
+static inline void slab_magazine_swap(struct slab_cpu *cpu) {
+    struct slab_magazine *mag = cpu->loaded;
+    cpu->loaded = cpu->previous;
+    cpu->previous = mag;
+}
+
+static void *slab_cpu_alloc(struct slab_cache *cp) {
+    struct slab_cpu *cpu = &cp->cpus[get_cpu()->processor_id];
+    struct slab_magazine *mag;
+    void *objp = NULL;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&cpu->lock, &irq);
+
+    if (!cpu->loaded || !cpu->loaded->rounds) {
+        if (cpu->previous && cpu->previous->rounds) {
+            slab_magazine_swap(cpu);
+        } else {
+            // Trade the empty magazine for a full one from the depot
+            spin_lock(&cp->depot_lock);
+            if ((mag = cp->depot_full) != NULL) {
+                cp->depot_full = mag->next;
+                --cp->depot_full_count;
+
+                slab_magazine_push(&cp->depot_empty, cpu->previous);
+                cpu->previous = cpu->loaded;
+                cpu->loaded = mag;
+            }
+            spin_release(&cp->depot_lock);
+        }
+    }
+
+    if (cpu->loaded && cpu->loaded->rounds) {
+        objp = cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+
+    spin_release_irqrestore(&cpu->lock, &irq);
+    return objp;
+}
+
+static int slab_cpu_free(struct slab_cache *cp, void *objp) {
+    struct slab_cpu *cpu = &cp->cpus[get_cpu()->processor_id];
+    struct slab_magazine *mag;
+    uintptr_t irq;
+    int res = -1;
+
+    spin_lock_irqsave(&cpu->lock, &irq);
+
+    if (!cpu->loaded || cpu->loaded->rounds == cp->magazine_size) {
+        if (cpu->previous && !cpu->previous->rounds) {
+            slab_magazine_swap(cpu);
+        } else {
+            // Trade the full magazine for an empty one from the depot
+            spin_lock(&cp->depot_lock);
+            if ((mag = cp->depot_empty) != NULL) {
+                cp->depot_empty = mag->next;
+
+                if (cpu->previous) {
+                    slab_magazine_push(&cp->depot_full, cpu->previous);
+                    ++cp->depot_full_count;
+                }
+                cpu->previous = cpu->loaded;
+                cpu->loaded = mag;
+            }
+            spin_release(&cp->depot_lock);
+        }
+    }
+
+    if (cpu->loaded && cpu->loaded->rounds != cp->magazine_size) {
+        cpu->loaded->objs[cpu->loaded->rounds++] = objp;
+        res = 0;
+    }
+
+    spin_release_irqrestore(&cpu->lock, &irq);
+    return res;
+}
+
+// Called when the depot runs out of full magazines. slab_free() may be
+// called with any lock held and must not allocate memory, so empty
+// magazines for it to fill are made here
+static void slab_depot_grow(struct slab_cache *cp) {
+    struct slab_magazine *mag;
+    uintptr_t irq;
+
+    if (cp->depot_empty) {
+        return;
+    }
+
+    if (!(mag = kmalloc(sizeof(struct slab_magazine)))) {
+        return;
+    }
+    mag->rounds = 0;
+
+    spin_lock_irqsave(&cp->depot_lock, &irq);
+    slab_magazine_push(&cp->depot_empty, mag);
+    spin_release_irqrestore(&cp->depot_lock, &irq);
+}
+
+// Give objects of the magazines back to their slabs and free
+// the magazines themselves. Returns the number of slab pages released
+static size_t slab_magazine_release(struct slab_cache *cp, struct slab_magazine *list) {
+    struct slab_magazine *mag;
+    size_t freed = 0;
+
+    while ((mag = list) != NULL) {
+        list = mag->next;
+
+        while (mag->rounds) {
+            freed += slab_layer_free(cp, mag->objs[--mag->rounds]);
+        }
+        kfree(mag);
+    }
+
+    return freed;
+}
+
+// Objects cached in magazines of the cache
+static size_t slab_cache_cached(struct slab_cache *cp) {
+    size_t count;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&cp->depot_lock, &irq);
+    count = cp->depot_full_count * cp->magazine_size;
+    spin_release_irqrestore(&cp->depot_lock, &irq);
+
+    for (size_t i = 0; i < AMD64_MAX_SMP; ++i) {
+        struct slab_cpu *cpu = &cp->cpus[i];
+
+        spin_lock_irqsave(&cpu->lock, &irq);
+        if (cpu->loaded) {
+            count += cpu->loaded->rounds;
+        }
+        if (cpu->previous) {
+            count += cpu->previous->rounds;
+        }
+        spin_release_irqrestore(&cpu->lock, &irq);
+    }
+
+    return count;
+}
+
+// Give objects cached in the depot (and CPUs' magazines if `cpus' is
+// set) back to their slabs. Returns the number of slab pages released
+static size_t slab_cache_flush(struct slab_cache *cp, int cpus) {
+    struct slab_magazine *list, *mag;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&cp->depot_lock, &irq);
+    list = cp->depot_empty;
+    while ((mag = cp->depot_full) != NULL) {
+        cp->depot_full = mag->next;
+        slab_magazine_push(&list, mag);
+    }
+    cp->depot_empty = NULL;
+    cp->depot_full_count = 0;
+    spin_release_irqrestore(&cp->depot_lock, &irq);
+
+    for (size_t i = 0; cpus && i < AMD64_MAX_SMP; ++i) {
+        struct slab_cpu *cpu = &cp->cpus[i];
+
+        spin_lock_irqsave(&cpu->lock, &irq);
+        slab_magazine_push(&list, cpu->loaded);
+        slab_magazine_push(&list, cpu->previous);
+        cpu->loaded = NULL;
+        cpu->previous = NULL;
+        spin_release_irqrestore(&cpu->lock, &irq);
+    }
+
+    return slab_magazine_release(cp, list);
+}
+
+////
+
+void slab_cache_destroy(struct slab_cache *cp) {
+    struct slab *slabp;
+    uintptr_t irq;
+
+    _assert(cp < predefined_caches || cp >= predefined_caches + PREALLOC_COUNT);
+
+    // Wait for the shrinker to move on to the next cache
+    while (1) {
+        spin_lock_irqsave(&slab_caches_lock, &irq);
+        if (!cp->pins) {
+            list_del(&cp->link);
+            spin_release_irqrestore(&slab_caches_lock, &irq);
+            break;
+        }
+        spin_release_irqrestore(&slab_caches_lock, &irq);
+        asm volatile ("pause");
+    }
+
+    slab_cache_flush(cp, 1);
+
+    if (!list_empty(&cp->slabs_full) || !list_empty(&cp->slabs_partial)) {
+        panic("Cache \"%s\" destroyed with objects still in use\n", cp->name);
+    }
+
+    while (!list_empty(&cp->slabs_empty)) {
+        slabp = list_first_entry(&cp->slabs_empty, struct slab, list);
+        list_del(&slabp->list);
+        slab_destroy(cp, slabp);
+    }
+
+    kdebug("Destroyed cache: %s\n", cp->name);
+    kfree(cp);
+}
+
+static void *slab_alloc_obj(struct slab_cache *cp) {
+    void *objp = NULL;
+
+    if (slab_cpu_ready()) {
+        if ((objp = slab_cpu_alloc(cp)) != NULL) {
+            return objp;
+        }
+        slab_depot_grow(cp);
+    }
+
+    return slab_layer_alloc(cp);
+}
+
+void *slab_alloc_int(struct slab_cache *cp) {
+    void *objp = slab_alloc_obj(cp);
+    alloc_profile_alloc(ALLOC_SLAB, cp->name, alloc_profile_site(), (uintptr_t) objp, cp->object_size);
+    return objp;
+}
+
+void *slab_calloc_int(struct slab_cache *cp) {
+    void *objp;
+
+    // Zeroing would destroy the constructed state
+    _assert(!cp->ctor);
+
+    if ((objp = slab_alloc_obj(cp)) != NULL) {
+        memset(objp, 0, cp->object_size);
+    }
+    alloc_profile_alloc(ALLOC_SLAB, cp->name, alloc_profile_site(), (uintptr_t) objp, cp->object_size);
+    return objp;
+}
+
+void slab_free_int(struct slab_cache *cp, void *objp) {
+    alloc_profile_free((uintptr_t) objp);
+
+    if (slab_cpu_ready() && slab_cpu_free(cp, objp) == 0) {
+        return;
+    }
+
+    slab_layer_free(cp, objp);
 }
 
 void slab_stat(struct slab_stat *st) {
+    struct slab_cache *cp;
+    uintptr_t list_irq;
+
     st->alloc_bytes = 0;
     st->alloc_objects = 0;
     st->alloc_pages = 0;
 
-    for (size_t i = 0; i < PREALLOC_COUNT; ++i) {
-        struct slab_cache *cp = &predefined_caches[i];
+    spin_lock_irqsave(&slab_caches_lock, &list_irq);
+    list_for_each_entry(cp, &slab_caches, link) {
+        size_t inuse = 0, cached;
         struct slab *slab;
+        uintptr_t irq;
+
+        // Objects sitting in magazines are free from the user's
+        // point of view
+        cached = slab_cache_cached(cp);
+
+        spin_lock_irqsave(&cp->lock, &irq);
 
         list_for_each_entry(slab, &cp->slabs_full, list) {
             _assert(slab->inuse == cp->objects_per_slab);
-            st->alloc_objects += slab->inuse;
-            st->alloc_bytes += slab->inuse * cp->object_size;
-            ++st->alloc_pages;
+            inuse += slab->inuse;
+            st->alloc_pages += 1UL << cp->order;
         }
 
         list_for_each_entry(slab, &cp->slabs_partial, list) {
             _assert(slab->inuse && slab->inuse != cp->objects_per_slab);
-            st->alloc_objects += slab->inuse;
-            st->alloc_bytes += slab->inuse * cp->object_size;
-            ++st->alloc_pages;
+            inuse += slab->inuse;
+            st->alloc_pages += 1UL << cp->order;
         }
 
         list_for_each_entry(slab, &cp->slabs_empty, list) {
-            panic("This list should be empty, slabs are freed once they're empty\n");
+            _assert(!slab->inuse);
+            st->alloc_pages += 1UL << cp->order;
+        }
+
+        spin_release_irqrestore(&cp->lock, &irq);
+
+        // Magazines are not locked together with the slabs
+        inuse = inuse > cached ? inuse - cached : 0;
+        st->alloc_objects += inuse;
+        st->alloc_bytes += inuse * cp->object_size;
+    }
+    spin_release_irqrestore(&slab_caches_lock, &list_irq);
+}
+
+//// Memory pressure
+
+static size_t slab_shrink_count(struct shrinker *s) {
+    struct slab_cache *cp;
+    size_t count = 0;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&slab_caches_lock, &irq);
+    list_for_each_entry(cp, &slab_caches, link) {
+        // Full magazines in the depot may pin partial slabs
+        count += cp->empty_count << cp->order;
+        count += (cp->depot_full_count * cp->magazine_size / cp->objects_per_slab) << cp->order;
+    }
+    spin_release_irqrestore(&slab_caches_lock, &irq);
+
+    return count;
+}
+
+// Release empty slabs of the cache until `keep' remain or `nr' pages
+// are released. Returns the number of pages released
+static size_t slab_cache_release_empty(struct slab_cache *cp, size_t keep, size_t nr) {
+    struct slab *slabp;
+    size_t freed = 0;
+    uintptr_t irq;
+
+    while (freed < nr) {
+        spin_lock_irqsave(&cp->lock, &irq);
+        if (cp->empty_count <= keep) {
+            spin_release_irqrestore(&cp->lock, &irq);
+            break;
+        }
+        slabp = list_first_entry(&cp->slabs_empty, struct slab, list);
+        list_del(&slabp->list);
+        --cp->empty_count;
+        spin_release_irqrestore(&cp->lock, &irq);
+
+        slab_destroy(cp, slabp);
+        freed += 1UL << cp->order;
+    }
+
+    return freed;
+}
+
+// Unpin `cp' and pin the cache following it, or the first one if
+// `cp' is NULL. Flushing caches and releasing slabs is done without
+// slab_caches_lock held, so caches can be created and listed meanwhile
+static struct slab_cache *slab_cache_next_pinned(struct slab_cache *cp) {
+    struct list_head *next;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&slab_caches_lock, &irq);
+    if (cp) {
+        _assert(cp->pins);
+        --cp->pins;
+        next = cp->link.next;
+    } else {
+        next = slab_caches.next;
+    }
+    if (next != &slab_caches) {
+        cp = list_entry(next, struct slab_cache, link);
+        ++cp->pins;
+    } else {
+        cp = NULL;
+    }
+    spin_release_irqrestore(&slab_caches_lock, &irq);
+
+    return cp;
+}
+
+static void slab_cache_unpin(struct slab_cache *cp) {
+    uintptr_t irq;
+
+    spin_lock_irqsave(&slab_caches_lock, &irq);
+    _assert(cp->pins);
+    --cp->pins;
+    spin_release_irqrestore(&slab_caches_lock, &irq);
+}
+
+static size_t slab_shrink_scan(struct shrinker *s, size_t nr, int flags) {
+    struct slab_cache *cp;
+    size_t freed = 0;
+
+    for (cp = slab_cache_next_pinned(NULL); cp; cp = slab_cache_next_pinned(cp)) {
+        if (freed >= nr) {
+            slab_cache_unpin(cp);
+            break;
         }
+
+        // CPUs' own magazines are left alone so that their
+        // fast path stays warm
+        freed += slab_cache_flush(cp, 0);
+        freed += slab_cache_release_empty(cp, 0, nr - MIN(freed, nr));
     }
+
+    return freed;
+}
+
+static size_t slab_shrink_trim(struct shrinker *s) {
+    size_t keep = slab_empty_keep;
+    struct slab_cache *cp;
+    size_t freed = 0;
+
+    for (cp = slab_cache_next_pinned(NULL); cp; cp = slab_cache_next_pinned(cp)) {
+        freed += slab_cache_release_empty(cp, keep, (size_t) -1);
+    }
+
+    return freed;
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+    .trim = slab_shrink_trim
+};
+
+int slab_empty_limit_set(void *ctx, const char *value) {
+    int64_t limit = atoi(value);
+
+    if (limit < 0) {
+        return -EINVAL;
+    }
+    // Can't keep more slabs than allowed
+    if ((ctx == &slab_empty_keep && limit > slab_empty_max) ||
+        (ctx == &slab_empty_max && limit < slab_empty_keep)) {
+        return -EINVAL;
+    }
+
+    *(int64_t *) ctx = limit;
+    return 0;
 }
 
 // Tracing
 #if defined(SLAB_TRACE_ALLOC)
 
+void *slab_alloc_trace(const char *filename, int line, struct slab_cache *cp) {
+    void *objp = slab_alloc_int(cp);
+    debugf(DEBUG_DEFAULT, "\033[43;30m%s:%d: slab allocate %s = %p\033[0m\n", filename, line, cp->name, objp);
+    return objp;
+}
+
 void *slab_calloc_trace(const char *filename, int line, struct slab_cache *cp) {
     void *objp = slab_calloc_int(cp);
-    debugf(DEBUG_DEFAULT, "\033[43;30m%s:%d: slab allocate %u = %p\033[0m\n", filename, line, cp->object_size, objp);
+    debugf(DEBUG_DEFAULT, "\033[43;30m%s:%d: slab allocate %s = %p\033[0m\n", filename, line, cp->name, objp);
     return objp;
 }
 
 void slab_free_trace(const char *filename, int line, struct slab_cache *cp, void *ptr) {
-    debugf(DEBUG_DEFAULT, "\033[44;32m%s:%d: slab free     %p (%u)\033[0m\n", filename, line, ptr, cp->object_size);
+    debugf(DEBUG_DEFAULT, "\033[44;32m%s:%d: slab free     %p (%s)\033[0m\n", filename, line, ptr, cp->name);
     slab_free_int(cp, ptr);
 }
 
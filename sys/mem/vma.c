@@ -0,0 +1,520 @@
+// Virtual memory areas are kept in an AVL tree ordered by start
+// address. Every area also remembers the size of the unmapped gap
+// preceding it, and every node - the largest gap in its subtree,
+// so free range search can skip subtrees which have no large
+// enough holes.
+#include "sys/mem/slab.h"
+#include "sys/mem/vma.h"
+#include "user/errno.h"
+#include "fs/node.h"
+#include "sys/assert.h"
+#include "sys/debug.h"
+#include "sys/mm.h"
+
+static struct slab_cache *vma_cache = NULL;
+
+// Constructed areas are unlinked and hold no object. Everything
+// else is filled in by the allocating code or on linking, so areas
+// are not zeroed on every allocation
+static void vma_area_ctor(void *objp) {
+    struct vm_area *area = objp;
+
+    area->object = NULL;
+    area->left = NULL;
+    area->right = NULL;
+}
+
+static struct vm_area *vma_area_alloc(void) {
+    if (!vma_cache) {
+        vma_cache = slab_cache_create("vm_area", sizeof(struct vm_area), vma_area_ctor, NULL);
+        _assert(vma_cache);
+    }
+    return slab_alloc(vma_cache);
+}
+
+static void vma_area_free(struct vm_area *area) {
+    vma_area_ctor(area);
+    slab_free(vma_cache, area);
+}
+
+// Areas backed by a file keep it open, so the vnode and its page
+// cache stay around while pages can still be faulted in from it.
+// Other processes open and map the file under their own locks, so
+// the count is updated atomically
+static void vma_object_ref(struct vm_area *area) {
+    if (area->type == VMA_FILE && area->object) {
+        __sync_fetch_and_add(&((struct vnode *) area->object)->open_count, 1);
+    }
+}
+
+static void vma_object_unref(struct vm_area *area) {
+    struct vnode *vn;
+
+    if (area->type == VMA_FILE && (vn = area->object)) {
+        _assert(__sync_fetch_and_sub(&vn->open_count, 1));
+    }
+}
+
+static inline int vma_height(struct vm_area *n) {
+    return n ? n->height : 0;
+}
+
+static inline uintptr_t vma_max_gap(struct vm_area *n) {
+    return n ? n->max_gap : 0;
+}
+
+static void vma_update(struct vm_area *n) {
+    int hl = vma_height(n->left), hr = vma_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+
+    n->max_gap = n->gap;
+    if (vma_max_gap(n->left) > n->max_gap) {
+        n->max_gap = n->left->max_gap;
+    }
+    if (vma_max_gap(n->right) > n->max_gap) {
+        n->max_gap = n->right->max_gap;
+    }
+}
+
+static struct vm_area *vma_rotate_left(struct vm_area *n) {
+    struct vm_area *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vma_update(n);
+    vma_update(r);
+    return r;
+}
+
+static struct vm_area *vma_rotate_right(struct vm_area *n) {
+    struct vm_area *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vma_update(n);
+    vma_update(l);
+    return l;
+}
+
+static struct vm_area *vma_balance(struct vm_area *n) {
+    int bf;
+
+    vma_update(n);
+    bf = vma_height(n->left) - vma_height(n->right);
+
+    if (bf > 1) {
+        if (vma_height(n->left->left) < vma_height(n->left->right)) {
+            n->left = vma_rotate_left(n->left);
+        }
+        return vma_rotate_right(n);
+    }
+    if (bf < -1) {
+        if (vma_height(n->right->right) < vma_height(n->right->left)) {
+            n->right = vma_rotate_right(n->right);
+        }
+        return vma_rotate_left(n);
+    }
+
+    return n;
+}
+
+// Gaps of the area and of its successor must be set by the caller,
+// the successor is always on the path to the new leaf
+static struct vm_area *vma_tree_insert(struct vm_area *n, struct vm_area *area) {
+    if (!n) {
+        area->left = NULL;
+        area->right = NULL;
+        vma_update(area);
+        return area;
+    }
+
+    if (area->start < n->start) {
+        n->left = vma_tree_insert(n->left, area);
+    } else {
+        n->right = vma_tree_insert(n->right, area);
+    }
+
+    return vma_balance(n);
+}
+
+static struct vm_area *vma_tree_remove_min(struct vm_area *n, struct vm_area **min) {
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+
+    n->left = vma_tree_remove_min(n->left, min);
+    return vma_balance(n);
+}
+
+static struct vm_area *vma_tree_remove(struct vm_area *n, struct vm_area *area) {
+    struct vm_area *min, *right;
+    _assert(n);
+
+    if (area->start < n->start) {
+        n->left = vma_tree_remove(n->left, area);
+        return vma_balance(n);
+    }
+    if (area->start > n->start) {
+        n->right = vma_tree_remove(n->right, area);
+        return vma_balance(n);
+    }
+
+    _assert(n == area);
+    if (!n->left) {
+        // The only child is a leaf and is also the successor,
+        // its gap has changed
+        if (n->right) {
+            vma_update(n->right);
+        }
+        return n->right;
+    }
+    if (!n->right) {
+        return n->left;
+    }
+
+    // Replace the node with its successor
+    right = vma_tree_remove_min(n->right, &min);
+    min->left = n->left;
+    min->right = right;
+    return vma_balance(min);
+}
+
+// Last area starting below addr and first one starting at or above it
+static void vma_neighbours(struct vm_map *map, uintptr_t addr, struct vm_area **prev, struct vm_area **next) {
+    struct vm_area *n = map->root;
+
+    *prev = NULL;
+    *next = NULL;
+
+    while (n) {
+        if (n->start < addr) {
+            *prev = n;
+            n = n->right;
+        } else {
+            *next = n;
+            n = n->left;
+        }
+    }
+}
+
+static struct vm_area *vma_next_locked(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *prev, *next;
+
+    vma_neighbours(map, addr, &prev, &next);
+    if (prev && prev->end > addr) {
+        return prev;
+    }
+    return next;
+}
+
+static void vma_link(struct vm_map *map, struct vm_area *area) {
+    struct vm_area *prev, *next;
+
+    vma_neighbours(map, area->start, &prev, &next);
+    _assert(!prev || prev->end <= area->start);
+    _assert(!next || next->start >= area->end);
+
+    area->gap = area->start - (prev ? prev->end : 0);
+    if (next) {
+        next->gap = next->start - area->end;
+    }
+
+    map->root = vma_tree_insert(map->root, area);
+    ++map->count;
+}
+
+static void vma_unlink(struct vm_map *map, struct vm_area *area) {
+    struct vm_area *prev, *next;
+
+    vma_neighbours(map, area->start, &prev, &next);
+    _assert(next == area);
+    next = vma_next_locked(map, area->end);
+
+    if (next) {
+        next->gap = next->start - (prev ? prev->end : 0);
+    }
+
+    map->root = vma_tree_remove(map->root, area);
+    --map->count;
+}
+
+// Lowest address in both [lo, hi) and [from, to) where an aligned
+// range of size bytes fits
+static inline uintptr_t vma_fit(uintptr_t lo,
+                                uintptr_t hi,
+                                uintptr_t from,
+                                uintptr_t to,
+                                size_t size,
+                                size_t align) {
+    if (lo < from) {
+        lo = from;
+    }
+    if (hi > to) {
+        hi = to;
+    }
+    lo = (lo + align - 1) / align * align;
+
+    if (lo < hi && hi - lo >= size) {
+        return lo;
+    }
+    return MM_NADDR;
+}
+
+static uintptr_t vma_find_gap(struct vm_area *n, uintptr_t from, uintptr_t to, size_t size, size_t align) {
+    uintptr_t res;
+
+    if (!n || n->max_gap < size) {
+        return MM_NADDR;
+    }
+
+    // Gaps of the left subtree and of the node itself end at or
+    // below its start
+    if (n->start > from) {
+        if ((res = vma_find_gap(n->left, from, to, size, align)) != MM_NADDR) {
+            return res;
+        }
+        if ((res = vma_fit(n->start - n->gap, n->start, from, to, size, align)) != MM_NADDR) {
+            return res;
+        }
+    }
+
+    // Gaps of the right subtree start at or above its end
+    if (n->end < to) {
+        return vma_find_gap(n->right, from, to, size, align);
+    }
+
+    return MM_NADDR;
+}
+
+int vma_insert(struct vm_map *map,
+               uintptr_t start,
+               uintptr_t end,
+               int prot,
+               int flags,
+               enum vma_type type,
+               void *object,
+               size_t offset) {
+    struct vm_area *area, *prev, *next;
+    uintptr_t irq;
+
+    _assert(start < end);
+    _assert(!(start & MM_PAGE_OFFSET_MASK) && !(end & MM_PAGE_OFFSET_MASK));
+
+    if (!(area = vma_area_alloc())) {
+        return -ENOMEM;
+    }
+
+    area->start = start;
+    area->end = end;
+    area->prot = prot;
+    area->flags = flags;
+    area->type = type;
+    area->object = object;
+    area->offset = offset;
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    vma_neighbours(map, start, &prev, &next);
+    if ((prev && prev->end > start) || (next && next->start < end)) {
+        spin_release_irqrestore(&map->lock, &irq);
+        vma_area_free(area);
+        return -EEXIST;
+    }
+
+    vma_link(map, area);
+    vma_object_ref(area);
+
+    spin_release_irqrestore(&map->lock, &irq);
+    return 0;
+}
+
+uintptr_t vma_alloc(struct vm_map *map,
+                    uintptr_t from,
+                    uintptr_t to,
+                    size_t npages,
+                    size_t align,
+                    int prot,
+                    int flags,
+                    enum vma_type type,
+                    void *object,
+                    size_t offset) {
+    size_t size = npages * MM_PAGE_SIZE;
+    struct vm_area *area, *last;
+    uintptr_t irq;
+    uintptr_t res;
+
+    _assert(npages && align);
+    align *= MM_PAGE_SIZE;
+
+    if (!(area = vma_area_alloc())) {
+        return MM_NADDR;
+    }
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    if ((res = vma_find_gap(map->root, from, to, size, align)) == MM_NADDR) {
+        // The space above the last area is not a gap of any node
+        for (last = map->root; last && last->right; last = last->right);
+        res = vma_fit(last ? last->end : 0, to, from, to, size, align);
+    }
+
+    if (res == MM_NADDR) {
+        spin_release_irqrestore(&map->lock, &irq);
+        vma_area_free(area);
+        return MM_NADDR;
+    }
+
+    area->start = res;
+    area->end = res + size;
+    area->prot = prot;
+    area->flags = flags;
+    area->type = type;
+    area->object = object;
+    area->offset = offset;
+
+    vma_link(map, area);
+    vma_object_ref(area);
+
+    spin_release_irqrestore(&map->lock, &irq);
+    return res;
+}
+
+int vma_remove(struct vm_map *map, uintptr_t start, uintptr_t end) {
+    struct vm_area *area, *tail;
+    uintptr_t irq;
+
+    _assert(start <= end);
+
+    // At most one area can cross both boundaries
+    if (!(tail = vma_area_alloc())) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&map->lock, &irq);
+
+    while ((area = vma_next_locked(map, start)) && area->start < end) {
+        vma_unlink(map, area);
+
+        if (area->start < start && area->end > end) {
+            // Split the area in two
+            *tail = *area;
+            tail->offset += end - area->start;
+            tail->start = end;
+            area->end = start;
+
+            vma_link(map, area);
+            vma_link(map, tail);
+            vma_object_ref(tail);
+            tail = NULL;
+            break;
+        }
+
+        if (area->start < start) {
+            area->end = start;
+            vma_link(map, area);
+        } else if (area->end > end) {
+            area->offset += end - area->start;
+            area->start = end;
+            vma_link(map, area);
+        } else {
+            vma_object_unref(area);
+            vma_area_free(area);
+        }
+    }
+
+    spin_release_irqrestore(&map->lock, &irq);
+
+    if (tail) {
+        vma_area_free(tail);
+    }
+    return 0;
+}
+
+struct vm_area *vma_lookup(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *area;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    area = vma_next_locked(map, addr);
+    if (area && area->start > addr) {
+        area = NULL;
+    }
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return area;
+}
+
+struct vm_area *vma_next(struct vm_map *map, uintptr_t addr) {
+    struct vm_area *area;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    area = vma_next_locked(map, addr);
+    spin_release_irqrestore(&map->lock, &irq);
+
+    return area;
+}
+
+// The copy has exactly the same shape, so balance and gaps stay valid
+static struct vm_area *vma_tree_copy(struct vm_area *n, int *err) {
+    struct vm_area *copy;
+
+    if (!n || *err) {
+        return NULL;
+    }
+
+    if (!(copy = vma_area_alloc())) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    *copy = *n;
+    vma_object_ref(copy);
+    copy->left = vma_tree_copy(n->left, err);
+    copy->right = vma_tree_copy(n->right, err);
+
+    return copy;
+}
+
+static void vma_tree_free(struct vm_area *n) {
+    if (n) {
+        vma_tree_free(n->left);
+        vma_tree_free(n->right);
+        vma_object_unref(n);
+        vma_area_free(n);
+    }
+}
+
+int vma_fork(struct vm_map *dst, struct vm_map *src) {
+    struct vm_area *root;
+    uintptr_t irq;
+    int err = 0;
+
+    _assert(!dst->root);
+
+    spin_lock_irqsave(&src->lock, &irq);
+    root = vma_tree_copy(src->root, &err);
+    if (!err) {
+        dst->count = src->count;
+    }
+    spin_release_irqrestore(&src->lock, &irq);
+
+    if (err) {
+        vma_tree_free(root);
+        return err;
+    }
+
+    dst->root = root;
+    return 0;
+}
+
+void vma_clear(struct vm_map *map) {
+    struct vm_area *root;
+    uintptr_t irq;
+
+    spin_lock_irqsave(&map->lock, &irq);
+    root = map->root;
+    map->root = NULL;
+    map->count = 0;
+    spin_release_irqrestore(&map->lock, &irq);
+
+    vma_tree_free(root);
+}
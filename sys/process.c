@@ -2,6 +2,9 @@
 #include "arch/amd64/mm/pool.h"
 #include "sys/snprintf.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
+#include "sys/mem/tlb.h"
+#include "sys/sys_proc.h"
 #include "sys/thread.h"
 #include "sys/string.h"
 #include "user/errno.h"
@@ -11,20 +14,6 @@
 #include "sys/heap.h"
 #include "fs/ofile.h"
 
-struct sys_fork_frame {
-    uint64_t rdi, rsi, rdx, rcx;
-    uint64_t r8, r9, r10, r11;
-    uint64_t rbx;
-    uint64_t rbp;
-    uint64_t r12;
-    uint64_t r13;
-    uint64_t r14;
-    uint64_t r15;
-    uint64_t rsp;
-    uint64_t rflags;
-    uint64_t rip;
-};
-
 ////
 
 LIST_HEAD(proc_all_head);
@@ -236,6 +225,21 @@ void process_cleanup(struct process *proc) {
     mm_space_release(proc);
 }
 
+static struct slab_cache *process_cache = NULL;
+
+struct process *process_alloc(void) {
+    if (!process_cache) {
+        process_cache = slab_cache_create("process", sizeof(struct process), NULL, NULL);
+        _assert(process_cache);
+    }
+    return slab_calloc(process_cache);
+}
+
+void process_dealloc(struct process *proc) {
+    _assert(process_cache);
+    slab_free(process_cache, proc);
+}
+
 void process_free(struct process *proc) {
     // Make sure all the threads of the process have stopped -
     // only main remains
@@ -257,10 +261,13 @@ void process_free(struct process *proc) {
 
     // Free page directory (if not mm_kernel)
     if (proc->space != mm_kernel) {
+        // CPUs running kernel threads may still be borrowing the space
+        tlb_release(proc);
+
         // Make sure we don't shoot a leg off
         uintptr_t cr3;
         asm volatile ("movq %%cr3, %0":"=a"(cr3));
-        _assert(MM_VIRTUALIZE(cr3) != (uintptr_t) proc->space);
+        _assert(MM_VIRTUALIZE(cr3 & MM_PAGE_MASK) != (uintptr_t) proc->space);
 
         mm_space_free(proc);
     }
@@ -269,16 +276,17 @@ void process_free(struct process *proc) {
 
     // Free thread itself
     memset(thr, 0, sizeof(struct thread));
-    kfree(thr);
+    thread_free(thr);
     // Free the process
     memset(proc, 0, sizeof(struct process));
-    kfree(proc);
+    process_dealloc(proc);
 }
 
 int process_init_thread(struct process *proc, uintptr_t entry, void *arg, int user) {
     list_head_init(&proc->g_link);
     list_head_init(&proc->shm_list);
     thread_wait_io_init(&proc->pid_notify);
+    thread_wait_io_init(&proc->vfork_notify);
 
     proc->name[0] = 0;
     proc->flags = user ? 0 : THREAD_KERNEL;
@@ -290,7 +298,7 @@ int process_init_thread(struct process *proc, uintptr_t entry, void *arg, int us
         proc->space = mm_kernel;
     }
 
-    struct thread *main_thread = kmalloc(sizeof(struct thread));
+    struct thread *main_thread = thread_alloc();
     _assert(main_thread);
     main_thread->proc = proc;
     list_head_init(&proc->thread_list);
@@ -325,7 +333,7 @@ int process_init_thread(struct process *proc, uintptr_t entry, void *arg, int us
 //       (Although I don't really think it's very useful -
 //        threads can just be created by thread_init() and
 //        sched_queue())
-int sys_fork(struct sys_fork_frame *frame) {
+struct process *process_fork_alloc(struct thread **thr) {
     struct thread *src_thread = thread_self;
     _assert(src_thread);
     struct process *src = src_thread->proc;
@@ -335,14 +343,10 @@ int sys_fork(struct sys_fork_frame *frame) {
         panic("XXX: kthread fork()ing not implemented\n");
     }
 
-    if (src->thread_count != 1) {
-        panic("XXX: fork() a multithreaded process\n");
-    }
-
-    struct process *dst = kmalloc(sizeof(struct process));
+    struct process *dst = process_alloc();
     _assert(dst);
     list_head_init(&dst->thread_list);
-    struct thread *dst_thread = kmalloc(sizeof(struct thread));
+    struct thread *dst_thread = thread_alloc();
     _assert(dst_thread);
     list_head_init(&dst_thread->thread_link);
 
@@ -351,15 +355,11 @@ int sys_fork(struct sys_fork_frame *frame) {
     dst->thread_count = 1;
     dst_thread->proc = dst;
 
-    // Initialize dst process: memory space
-    mm_space_t space = amd64_mm_pool_alloc();
-    dst->space = space;
-    mm_space_fork(dst, src, MM_CLONE_FLG_KERNEL | MM_CLONE_FLG_USER);
-
     // Initialize dst process state
     list_head_init(&dst->g_link);
     list_head_init(&dst->shm_list);
     thread_wait_io_init(&dst->pid_notify);
+    thread_wait_io_init(&dst->vfork_notify);
     dst->flags = 0;
     strcpy(dst->name, src->name);
     process_ioctx_fork(dst, src);
@@ -386,6 +386,7 @@ int sys_fork(struct sys_fork_frame *frame) {
     dst_thread->data.rsp0_base = MM_VIRTUALIZE(stack_pages);
     dst_thread->data.rsp0_size = MM_PAGE_SIZE * THREAD_KSTACK_PAGES;
     dst_thread->data.rsp0_top = dst_thread->data.rsp0_base + dst_thread->data.rsp0_size;
+    dst_thread->node = mm_phys_node(stack_pages);
     dst_thread->flags = 0;
     dst_thread->sigq = 0;
 
@@ -396,8 +397,6 @@ int sys_fork(struct sys_fork_frame *frame) {
     dst_thread->signal_stack_base = src_thread->signal_stack_base;
     dst_thread->signal_stack_size = src_thread->signal_stack_size;
 
-    dst_thread->data.cr3 = MM_PHYS(space);
-
     dst_thread->data.fxsave = kmalloc(FXSAVE_REGION);
     _assert(dst_thread->data.fxsave);
     _assert(src_thread->data.fxsave);
@@ -406,6 +405,12 @@ int sys_fork(struct sys_fork_frame *frame) {
         memcpy(dst_thread->data.fxsave, src_thread->data.fxsave, FXSAVE_REGION);
     }
 
+    *thr = dst_thread;
+    return dst;
+}
+
+void process_fork_enter(struct process *dst, struct thread *dst_thread, const struct sys_fork_frame *frame) {
+    dst_thread->data.cr3 = MM_PHYS(dst->space);
     dst_thread->state = THREAD_READY;
 
     uint64_t *stack = (uint64_t *) dst_thread->data.rsp0_top;
@@ -465,10 +470,125 @@ int sys_fork(struct sys_fork_frame *frame) {
     list_add(&dst->g_link, &proc_all_head);
     proc_add_entry(dst);
     sched_queue(dst_thread);
+}
+
+void process_fork_abort(struct process *dst) {
+    struct thread *thr = process_first_thread(dst);
+
+    for (size_t i = 0; i < THREAD_MAX_FDS; ++i) {
+        if (dst->fds[i]) {
+            ofile_close(&dst->ioctx, dst->fds[i]);
+        }
+    }
+    process_unchild(dst);
+
+    // Never loaded by any CPU
+    mm_space_free(dst);
+
+    for (size_t i = 0; i < thr->data.rsp0_size / MM_PAGE_SIZE; ++i) {
+        mm_phys_free_page(MM_PHYS(i * MM_PAGE_SIZE + thr->data.rsp0_base));
+    }
+    kfree(thr->data.fxsave);
+
+    memset(thr, 0, sizeof(struct thread));
+    thread_free(thr);
+    memset(dst, 0, sizeof(struct process));
+    process_dealloc(dst);
+}
+
+int sys_fork(struct sys_fork_frame *frame) {
+    struct process *src = thread_self->proc;
+    struct thread *dst_thread;
+    struct process *dst;
+
+    if (src->thread_count != 1) {
+        panic("XXX: fork() a multithreaded process\n");
+    }
+
+    dst = process_fork_alloc(&dst_thread);
+
+    // Initialize dst process: memory space
+    mm_space_t space = amd64_mm_pool_alloc();
+    _assert(space);
+    dst->space = space;
+    mm_space_fork(dst, src, MM_CLONE_FLG_KERNEL | MM_CLONE_FLG_USER);
+    if (vma_fork(&dst->vmas, &src->vmas) != 0) {
+        // Drops the references the child's space took
+        process_fork_abort(dst);
+        return -ENOMEM;
+    }
+
+    process_fork_enter(dst, dst_thread, frame);
 
     return dst->pid;
 }
 
+// Move the space and mappings of one process to another, neither of
+// which may be running in it afterwards
+static void process_space_move(struct process *dst, struct process *src) {
+    tlb_release(src);
+
+    dst->space = src->space;
+    dst->vmas = src->vmas;
+    dst->image_end = src->image_end;
+    dst->brk = src->brk;
+
+    src->space = NULL;
+    memset(&src->vmas, 0, sizeof(struct vm_map));
+}
+
+// Unlike fork(), no page is copied or write-protected: the child runs in
+// the space of the parent until it calls execve() or exits, and the parent
+// sleeps meanwhile. Instead of sharing the space, the parent hands it
+// over to the child, so it only ever has one owner for TLB shootdowns
+int sys_vfork(struct sys_fork_frame *frame) {
+    struct thread *thr = thread_self;
+    struct process *src = thr->proc;
+    struct thread *dst_thread;
+    struct process *dst;
+    pid_t pid;
+
+    if (src->thread_count != 1) {
+        panic("XXX: vfork() a multithreaded process\n");
+    }
+
+    dst = process_fork_alloc(&dst_thread);
+    pid = dst->pid;
+
+    // Signal handlers can't be entered without a space
+    src->flags |= PROC_VFORK;
+    process_space_move(dst, src);
+    dst->vfork_parent = src;
+    process_fork_enter(dst, dst_thread, frame);
+
+    _assert(thread_wait_io(thr, &src->vfork_notify) == 0);
+    src->flags &= ~PROC_VFORK;
+
+    // The child may have been done before this thread had to sleep
+    tlb_switch(src);
+
+    return pid;
+}
+
+void process_vfork_release(struct process *proc) {
+    struct process *par = proc->vfork_parent;
+
+    if (!par) {
+        return;
+    }
+
+    process_space_move(par, proc);
+    proc->vfork_parent = NULL;
+
+    // Leave the process an empty space of its own
+    proc->space = amd64_mm_pool_alloc();
+    _assert(proc->space);
+    mm_space_clone(proc->space, mm_kernel, MM_CLONE_FLG_KERNEL);
+    process_first_thread(proc)->data.cr3 = MM_PHYS(proc->space);
+
+    thread_notify_io(&par->vfork_notify);
+}
+
 void process_signal(struct process *proc, int signum) {
     // Check if it's a thread-only signal (exception)
     _assert(!signal_is_exception(signum));
@@ -12,6 +12,8 @@
 #include "sys/thread.h"
 #include "sys/sched.h"
 #include "sys/debug.h"
+#include "sys/mem/phys.h"
+#include "sys/mem/tlb.h"
 #include "sys/heap.h"
 #include "sys/spin.h"
 #include "sys/mm.h"
@@ -27,6 +29,10 @@ int sched_ncpus = 1;
 int sched_ready = 0;
 static int clk = 0;
 
+// Allow queues on thread's home NUMA node to be this much longer
+// than the shortest one before placing the thread on a remote CPU
+#define SCHED_NUMA_IMBALANCE    1
+
 static spin_t sched_lock = 0;
 
 void sched_set_ncpus(int ncpus) {
@@ -36,6 +42,8 @@ void sched_set_ncpus(int ncpus) {
 
 static void *idle(void *arg) {
     while (1) {
+        // Nothing to run, prepare some zeroed pages
+        mm_phys_zero_idle();
         asm volatile ("hlt");
     }
     return 0;
@@ -80,7 +88,9 @@ void sched_queue(struct thread *thr) {
     }
 #if defined(AMD64_SMP)
     size_t min_queue_size = (size_t) -1;
+    size_t min_local_size = (size_t) -1;
     int min_queue_index = 0;
+    int min_local_index = -1;
     uintptr_t irq;
     spin_lock_irqsave(&sched_lock, &irq);
 
@@ -89,9 +99,17 @@ void sched_queue(struct thread *thr) {
             min_queue_index = i;
             min_queue_size = queue_sizes[i];
         }
+        if (mm_phys_cpu_node(i) == thr->node && queue_sizes[i] < min_local_size) {
+            min_local_index = i;
+            min_local_size = queue_sizes[i];
+        }
     }
     spin_release_irqrestore(&sched_lock, &irq);
-    if (min_queue_size == 0) {
+    if (mm_phys_node_count() > 1 &&
+        min_local_index >= 0 &&
+        min_local_size <= min_queue_size + SCHED_NUMA_IMBALANCE) {
+        sched_queue_to(thr, min_local_index);
+    } else if (min_queue_size == 0) {
         sched_queue_to(thr, (clk++) % sched_ncpus);
     } else {
         sched_queue_to(thr, min_queue_index);
@@ -138,6 +156,7 @@ void sched_unqueue(struct thread *thr, enum thread_state new_state) {
         spin_release_irqrestore(&sched_lock, &irq);
 
         cpu->thread = &threads_idle[cpu_no];
+        tlb_switch(NULL);
         context_switch_to(&threads_idle[cpu_no], thr);
         return;
     }
@@ -157,6 +176,7 @@ void sched_unqueue(struct thread *thr, enum thread_state new_state) {
     spin_release_irqrestore(&sched_lock, &irq);
     if (thr == cpu->thread) {
         cpu->thread = sched_next;
+        tlb_switch(sched_next->proc);
         context_switch_to(sched_next, thr);
     }
 }
@@ -327,6 +347,7 @@ void yield(void) {
     to->state = THREAD_RUNNING;
     cpu->thread = to;
 
+    tlb_switch(to->proc);
     context_switch_to(to, from);
 }
 
@@ -372,5 +393,6 @@ void sched_enter(void) {
 
     first_task->state = THREAD_RUNNING;
     cpu->thread = first_task;
+    tlb_switch(first_task->proc);
     context_switch_first(first_task);
 }
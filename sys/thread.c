@@ -1,8 +1,11 @@
 #include "arch/amd64/context.h"
-#include "sys/mem/vmalloc.h"
+#include "sys/mem/vma.h"
 #include "sys/mem/phys.h"
+#include "sys/mem/slab.h"
+#include "sys/mem/tlb.h"
 #include "user/signal.h"
 #include "user/errno.h"
+#include "user/mman.h"
 #include "sys/string.h"
 #include "sys/thread.h"
 #include "sys/sched.h"
@@ -32,13 +35,13 @@ void context_restore_fpu(struct thread *new, struct thread *old) {
 }
 
 struct process *task_start(void *entry, void *arg, int flags) {
-    struct process *proc = kmalloc(sizeof(struct process));
+    struct process *proc = process_alloc();
     if (!proc) {
         return NULL;
     }
 
     if (process_init_thread(proc, (uintptr_t) entry, arg, 0) != 0) {
-        kfree(proc);
+        process_dealloc(proc);
         return NULL;
     }
 
@@ -50,10 +53,9 @@ struct process *task_start(void *entry, void *arg, int flags) {
 int sys_clone(int (*fn) (void *), void *stack, int flags, void *arg) {
     struct process *proc = thread_self->proc;
     _assert(proc);
-    struct thread *thr = kmalloc(sizeof(struct thread));
+    struct thread *thr = thread_alloc();
     _assert(thr);
 
-    memset(thr, 0, sizeof(struct thread));
     thr->proc = proc;
     // XXX: Hacky
     thr->data.rsp3_base = (uintptr_t) stack;
@@ -75,6 +77,21 @@ int sys_clone(int (*fn) (void *), void *stack, int flags, void *arg) {
     return 0;
 }
 
+static struct slab_cache *thread_cache = NULL;
+
+struct thread *thread_alloc(void) {
+    if (!thread_cache) {
+        thread_cache = slab_cache_create("thread", sizeof(struct thread), NULL, NULL);
+        _assert(thread_cache);
+    }
+    return slab_calloc(thread_cache);
+}
+
+void thread_free(struct thread *thr) {
+    _assert(thread_cache);
+    slab_free(thread_cache, thr);
+}
+
 int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags) {
     uintptr_t stack_pages = mm_phys_alloc_contiguous(THREAD_KSTACK_PAGES, PU_KERNEL);
     _assert(stack_pages != MM_NADDR);
@@ -88,6 +105,7 @@ int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags) {
     thr->data.rsp0_base = MM_VIRTUALIZE(stack_pages);
     thr->data.rsp0_size = MM_PAGE_SIZE * THREAD_KSTACK_PAGES;
     thr->data.rsp0_top = thr->data.rsp0_base + thr->data.rsp0_size;
+    thr->node = mm_phys_node(stack_pages);
     thr->flags = (flags & THR_INIT_USER) ? 0 : THREAD_KERNEL;
     thr->sigq = 0;
     list_head_init(&thr->thread_link);
@@ -114,16 +132,24 @@ int thread_init(struct thread *thr, uintptr_t entry, void *arg, int flags) {
     thr->data.cr3 = MM_PHYS(space);
 
     if (flags & THR_INIT_USER) {
-        uintptr_t ustack_base;
+        uintptr_t ustack_base, irq;
         if (!(flags & THR_INIT_STACK_SET)) {
             // Allocate thread user stack
-            ustack_base = vmfind(space, THREAD_USTACK_BEGIN, THREAD_USTACK_END, THREAD_USTACK_PAGES);
+            _assert(thr->proc);
+            tlb_space_lock(thr->proc, &irq);
+            ustack_base = vma_alloc(&thr->proc->vmas,
+                                    THREAD_USTACK_BEGIN,
+                                    THREAD_USTACK_END,
+                                    THREAD_USTACK_PAGES,
+                                    1,
+                                    PROT_READ | PROT_WRITE,
+                                    0,
+                                    VMA_STACK,
+                                    NULL,
+                                    0);
+            tlb_space_unlock(thr->proc, &irq);
+            // Stack pages are allocated on first access
             _assert(ustack_base != MM_NADDR);
-            for (size_t i = 0; i < THREAD_USTACK_PAGES; ++i) {
-                uintptr_t phys = mm_phys_alloc_page(PU_PRIVATE);
-                _assert(phys != MM_NADDR);
-                mm_map_single(space, ustack_base + i * MM_PAGE_SIZE, phys, MM_PAGE_WRITE | MM_PAGE_USER);
-            }
             thr->data.rsp3_base = ustack_base;
             thr->data.rsp3_size = MM_PAGE_SIZE * THREAD_USTACK_PAGES;
         }
@@ -293,6 +319,9 @@ __attribute__((noreturn)) void sys_exit(int status) {
     }
     kdebug("Process #%d (%s) exited with status %d\n", proc->pid, proc->name, status);
 
+    // Let a vfork()ed parent continue
+    process_vfork_release(proc);
+
     // Clear pending I/O (if exiting from signal interrupting select())
     if (!list_empty(&thr->wait_head)) {
         thread_wait_io_clear(thr);
@@ -333,7 +362,8 @@ void thread_signal(struct thread *thr, int signum) {
         thread_notify_io(&thr->sleep_notify);
     }
 
-    if (thr->cpu == (int) get_cpu()->processor_id && thr == thread_self) {
+    if (thr->cpu == (int) get_cpu()->processor_id && thr == thread_self &&
+        !(proc->flags & PROC_VFORK)) {
         kdebug("Signal will be handled now\n");
         thread_sigenter(signum);
     } else {
@@ -353,7 +383,7 @@ void thread_signal(struct thread *thr, int signum) {
 
 int thread_check_signal(struct thread *thr, int ret) {
     struct process *proc = thr->proc;
-    if (!proc) {
+    if (!proc || (proc->flags & PROC_VFORK)) {
         return ret;
     }
 